@@ -9,22 +9,29 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
-#include <map>
+#include <functional>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <unordered_map>
-#include <unordered_set>
 
 #include "src/quipper/base/logging.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "zlib.h"
 
+using google::protobuf::io::CodedOutputStream;
 using google::protobuf::io::StringOutputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
 using google::protobuf::io::GzipOutputStream;
 using google::protobuf::io::FileOutputStream;
 using google::protobuf::RepeatedField;
@@ -32,7 +39,306 @@ using google::protobuf::RepeatedField;
 namespace perftools {
 namespace profiles {
 typedef std::unordered_map<uint64, uint64> IndexMap;
-typedef std::unordered_set<uint64> IndexSet;
+
+namespace {
+
+// A set of the nonzero ids of the messages of a repeated field, held sorted
+// in a vector. That is cheaper to build and to look ids up in than an IndexSet,
+// especially for the dense ids from 1 that the builder assigns.
+class SortedIdSet {
+ public:
+  // Adds the ids of |messages|. Returns false, logging the duplicate id, if
+  // any id is repeated. |kind| names the messages in the log.
+  template <typename Messages>
+  bool Insert(const Messages &messages, const char *kind) {
+    ids_.reserve(messages.size());
+    for (const auto &message : messages) {
+      if (message.id() != 0) {
+        ids_.push_back(message.id());
+      }
+    }
+    if (!std::is_sorted(ids_.begin(), ids_.end())) {
+      std::sort(ids_.begin(), ids_.end());
+    }
+    const auto duplicate = std::adjacent_find(ids_.begin(), ids_.end());
+    if (duplicate != ids_.end()) {
+      LOG(ERROR) << "Duplicate " << kind << " id: " << *duplicate;
+      return false;
+    }
+    // Unique sorted ids from 1 up to their count are exactly 1..count.
+    dense_ = ids_.empty() || (ids_.front() == 1 && ids_.back() == ids_.size());
+    return true;
+  }
+
+  size_t count(uint64_t id) const {
+    if (dense_) {
+      return id - 1 < ids_.size();
+    }
+    return std::binary_search(ids_.begin(), ids_.end(), id);
+  }
+
+ private:
+  std::vector<uint64_t> ids_;
+  bool dense_ = true;
+};
+
+// Whether Finalize() checks profiles whose ids are trusted anyway, to catch
+// the code that builds them breaking the invariants it declares.
+#ifdef NDEBUG
+constexpr bool kCheckTrustedProfiles = false;
+#else
+constexpr bool kCheckTrustedProfiles = true;
+#endif
+
+// Returns whether the sample types of |profile| are set, unique, and include
+// the default sample type.
+bool CheckSampleTypes(const Profile &profile) {
+  if (profile.sample_type_size() == 0) {
+    LOG(ERROR) << "No sample type specified";
+    return false;
+  }
+
+  const int default_sample_type = profile.default_sample_type();
+  if (default_sample_type <= 0 ||
+      default_sample_type >= profile.string_table_size()) {
+    LOG(ERROR) << "No default sample type specified";
+    return false;
+  }
+
+  std::unordered_set<int> value_types;
+  for (const auto &sample_type : profile.sample_type()) {
+    if (!value_types.insert(sample_type.type()).second) {
+      LOG(ERROR) << "Duplicate sample_type specified";
+      return false;
+    }
+  }
+
+  if (value_types.count(default_sample_type) == 0) {
+    LOG(ERROR) << "Default sample type not found";
+    return false;
+  }
+  return true;
+}
+
+// Returns whether |sample| has |sample_type_len| values and references
+// locations in |location_ids|, and whether its labels are well formed.
+// |location_ids| is an IndexSet or a SortedIdSet.
+template <typename LocationIds>
+bool CheckSample(const Sample &sample, int sample_type_len,
+                 const LocationIds &location_ids) {
+  if (sample.value_size() != sample_type_len) {
+    LOG(ERROR) << "Found sample with " << sample.value_size()
+               << " values, expecting " << sample_type_len;
+    return false;
+  }
+  for (uint64_t location_id : sample.location_id()) {
+    if (location_id == 0) {
+      LOG(ERROR) << "Sample referencing location_id=0";
+      return false;
+    }
+
+    if (location_ids.count(location_id) == 0) {
+      LOG(ERROR) << "Missing location " << location_id;
+      return false;
+    }
+  }
+
+  for (const auto &label : sample.label()) {
+    int64_t str = label.str();
+    int64_t num = label.num();
+    if (str != 0 && num != 0) {
+      LOG(ERROR) << "One of str/num must be unset, got " << str << "," << num;
+      return false;
+    }
+  }
+  return true;
+}
+
+// The address range of a mapping, to associate locations to it.
+struct MappingRange {
+  uint64_t start;
+  uint64_t limit;
+  uint64_t id;
+};
+
+// A location to associate to a mapping, keyed by its address.
+typedef std::pair<uint64_t, Location *> LocationAddress;
+
+// Sorts the locations in [begin, end) by address, and associates each to the
+// last of |mappings| that starts at or before it, if its address is within
+// that mapping's limit. |mappings| is sorted by start address, which must be
+// unique. Both are swept together, so this takes a single pass over each.
+void SweepLocationMappings(const std::vector<MappingRange> &mappings,
+                           LocationAddress *begin, LocationAddress *end) {
+  if (begin == end) {
+    return;
+  }
+  std::sort(begin, end, [](const LocationAddress &a, const LocationAddress &b) {
+    return a.first < b.first;
+  });
+  // The first mapping that starts after the current location.
+  auto next_mapping =
+      std::upper_bound(mappings.begin(), mappings.end(), begin->first,
+                       [](uint64_t address, const MappingRange &mapping) {
+                         return address < mapping.start;
+                       });
+  for (LocationAddress *location = begin; location != end; ++location) {
+    const uint64_t address = location->first;
+    while (next_mapping != mappings.end() && next_mapping->start <= address) {
+      ++next_mapping;
+    }
+    if (next_mapping == mappings.begin()) {
+      // Address landed before the first mapping
+      continue;
+    }
+    const MappingRange &mapping = *(next_mapping - 1);
+    if (address <= mapping.limit) {
+      location->second->set_mapping_id(mapping.id);
+    }
+  }
+}
+
+// Returns the tag of the length delimited field |field_number|.
+uint32_t LengthDelimitedTag(int field_number) {
+  return (static_cast<uint32_t>(field_number) << 3) | 2;
+}
+
+// Writes each of |messages| to |output| as a record of the repeated message
+// field |field_number|.
+template <typename T>
+void WriteMessages(int field_number,
+                   const google::protobuf::RepeatedPtrField<T> &messages,
+                   CodedOutputStream *output) {
+  for (const auto &message : messages) {
+    output->WriteTag(LengthDelimitedTag(field_number));
+    output->WriteVarint32(message.ByteSizeLong());
+    message.SerializeWithCachedSizes(output);
+  }
+}
+
+// The size of the deflate window, and so of the dictionary each block is
+// primed with.
+const size_t kDeflateWindowSize = 32 * 1024;
+
+// Compresses data[begin, end) into raw deflate data that continues the
+// deflate stream of data[0, begin), ending with a sync flush, or with the
+// final block if |end| is the end of the data.
+bool DeflateBlock(const std::string &data, size_t begin, size_t end,
+                  int level, std::string *output) {
+  z_stream stream = {};
+  if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG(ERROR) << "Failed to initialize deflate stream";
+    return false;
+  }
+  bool ok = true;
+  if (begin > 0) {
+    const size_t dictionary_size = std::min(begin, kDeflateWindowSize);
+    ok = deflateSetDictionary(
+             &stream,
+             reinterpret_cast<const Bytef *>(data.data() + begin -
+                                             dictionary_size),
+             dictionary_size) == Z_OK;
+  }
+  const int flush = end == data.size() ? Z_FINISH : Z_SYNC_FLUSH;
+  // Leave room for the sync flush marker on top of the worst case expansion.
+  output->resize(deflateBound(&stream, end - begin) + 16);
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data.data() + begin));
+  stream.avail_in = end - begin;
+  stream.next_out = reinterpret_cast<Bytef *>(&(*output)[0]);
+  stream.avail_out = output->size();
+  if (ok) {
+    const int ret = deflate(&stream, flush);
+    ok = flush == Z_FINISH ? ret == Z_STREAM_END
+                           : ret == Z_OK && stream.avail_in == 0 &&
+                                 stream.avail_out > 0;
+  }
+  output->resize(output->size() - stream.avail_out);
+  deflateEnd(&stream);
+  if (!ok) {
+    LOG(ERROR) << "Failed to compress block at offset " << begin;
+  }
+  return ok;
+}
+
+// Compresses |data| into a gzip stream in |output|, see
+// Builder::MarshalOptions.
+bool ParallelGzip(const std::string &data,
+                  const Builder::MarshalOptions &options,
+                  std::string *output) {
+  const size_t block_size = std::max<size_t>(options.block_size, 1);
+  const size_t num_blocks = std::max<size_t>(
+      (data.size() + block_size - 1) / block_size, 1);
+  std::vector<std::string> blocks(num_blocks);
+  std::vector<uLong> crcs(num_blocks);
+  std::atomic<size_t> next_block(0);
+  std::atomic<bool> ok(true);
+  auto compress = [&]() {
+    for (size_t i = next_block++; i < num_blocks; i = next_block++) {
+      const size_t begin = i * block_size;
+      const size_t end = std::min(begin + block_size, data.size());
+      if (!DeflateBlock(data, begin, end, options.compression_level,
+                        &blocks[i])) {
+        ok = false;
+      }
+      crcs[i] = crc32(crc32(0L, Z_NULL, 0),
+                      reinterpret_cast<const Bytef *>(data.data() + begin),
+                      end - begin);
+    }
+  };
+  std::vector<std::thread> threads;
+  const size_t num_threads =
+      std::min<size_t>(std::max(options.num_threads, 1), num_blocks);
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(compress);
+  }
+  compress();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (!ok) {
+    return false;
+  }
+
+  // A gzip header without a file name or modification time.
+  *output = std::string("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+  uLong crc = crcs[0];
+  for (size_t i = 0; i < num_blocks; ++i) {
+    output->append(blocks[i]);
+    if (i > 0) {
+      const size_t begin = i * block_size;
+      const size_t end = std::min(begin + block_size, data.size());
+      crc = crc32_combine(crc, crcs[i], end - begin);
+    }
+  }
+  // The trailer has the CRC-32 and the size modulo 2^32 of the data, in
+  // little endian order.
+  for (uint32_t value :
+       {static_cast<uint32_t>(crc), static_cast<uint32_t>(data.size())}) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      output->push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+  }
+  return true;
+}
+
+// Writes |data| to |fd|.
+bool WriteToFd(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t ret = write(fd, data.data() + written, data.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      PLOG(ERROR) << "Failed to write profile";
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+}  // namespace
 }  // namespace profiles
 }  // namespace perftools
 
@@ -54,11 +360,27 @@ void AddCallstackToSample(Sample *sample, const void *const *stack, int depth,
   }
 }
 
-Builder::Builder() : profile_(new Profile()) {
+Builder::Builder() : Builder(false) {}
+
+Builder::Builder(bool use_arena) {
+  if (use_arena) {
+    arena_.reset(new google::protobuf::Arena());
+    profile_.reset(google::protobuf::Arena::CreateMessage<Profile>(
+        arena_.get()));
+  } else {
+    profile_.reset(new Profile());
+  }
   // string_table[0] must be ""
   profile_->add_string_table("");
 }
 
+std::unique_ptr<Profile> Builder::Consume() {
+  if (arena_ != nullptr) {
+    return std::unique_ptr<Profile>(new Profile(*profile_));
+  }
+  return std::unique_ptr<Profile>(profile_.release());
+}
+
 int64_t Builder::StringId(const char *str) {
   if (str == nullptr || !str[0]) {
     return 0;
@@ -128,9 +450,24 @@ bool Builder::Emit(std::string *output) {
 }
 
 bool Builder::Marshal(const Profile &profile, std::string *output) {
+  return Marshal(profile, MarshalOptions(), output);
+}
+
+bool Builder::Marshal(const Profile &profile, const MarshalOptions &options,
+                      std::string *output) {
   *output = "";
+  if (options.num_threads > 1) {
+    std::string serialized;
+    if (!profile.SerializeToString(&serialized)) {
+      LOG(ERROR) << "Failed to serialize profile";
+      return false;
+    }
+    return ParallelGzip(serialized, options, output);
+  }
   StringOutputStream stream(output);
-  GzipOutputStream gzip_stream(&stream);
+  GzipOutputStream::Options gzip_options;
+  gzip_options.compression_level = options.compression_level;
+  GzipOutputStream gzip_stream(&stream, gzip_options);
   if (!profile.SerializeToZeroCopyStream(&gzip_stream)) {
     LOG(ERROR) << "Failed to serialize to gzip stream";
     return false;
@@ -139,8 +476,19 @@ bool Builder::Marshal(const Profile &profile, std::string *output) {
 }
 
 bool Builder::MarshalToFile(const Profile &profile, int fd) {
+  return MarshalToFile(profile, MarshalOptions(), fd);
+}
+
+bool Builder::MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options, int fd) {
+  if (options.num_threads > 1) {
+    std::string output;
+    return Marshal(profile, options, &output) && WriteToFd(fd, output);
+  }
   FileOutputStream stream(fd);
-  GzipOutputStream gzip_stream(&stream);
+  GzipOutputStream::Options gzip_options;
+  gzip_options.compression_level = options.compression_level;
+  GzipOutputStream gzip_stream(&stream, gzip_options);
   if (!profile.SerializeToZeroCopyStream(&gzip_stream)) {
     LOG(ERROR) << "Failed to serialize to gzip stream";
     return false;
@@ -149,6 +497,12 @@ bool Builder::MarshalToFile(const Profile &profile, int fd) {
 }
 
 bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
+  return MarshalToFile(profile, MarshalOptions(), filename);
+}
+
+bool Builder::MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options,
+                            const char *filename) {
   int fd;
   while ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 &&
          errno == EINTR) {
@@ -157,7 +511,7 @@ bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
     PLOG(ERROR) << "Failed to open file " << filename;
     return false;
   }
-  int ret = MarshalToFile(profile, fd);
+  int ret = MarshalToFile(profile, options, fd);
   close(fd);
   return ret;
 }
@@ -165,43 +519,22 @@ bool Builder::MarshalToFile(const Profile &profile, const char *filename) {
 // Returns a bool indicating if the profile is valid. It logs any
 // errors it encounters.
 bool Builder::CheckValid(const Profile &profile) {
-  IndexSet mapping_ids;
-  mapping_ids.reserve(profile.mapping_size());
-  for (const auto &mapping : profile.mapping()) {
-    const int64_t id = mapping.id();
-    if (id != 0) {
-      const bool insert_successful = mapping_ids.insert(id).second;
-      if (!insert_successful) {
-        LOG(ERROR) << "Duplicate mapping id: " << id;
-        return false;
-      }
-    }
+  SortedIdSet mapping_ids;
+  if (!mapping_ids.Insert(profile.mapping(), "mapping")) {
+    return false;
   }
 
-  IndexSet function_ids;
-  function_ids.reserve(profile.function_size());
-  for (const auto &function : profile.function()) {
-    const int64_t id = function.id();
-    if (id != 0) {
-      const bool insert_successful = function_ids.insert(id).second;
-      if (!insert_successful) {
-        LOG(ERROR) << "Duplicate function id: " << id;
-        return false;
-      }
-    }
+  SortedIdSet function_ids;
+  if (!function_ids.Insert(profile.function(), "function")) {
+    return false;
   }
 
-  IndexSet location_ids;
-  location_ids.reserve(profile.location_size());
+  SortedIdSet location_ids;
+  if (!location_ids.Insert(profile.location(), "location")) {
+    return false;
+  }
   for (const auto &location : profile.location()) {
     const int64_t id = location.id();
-    if (id != 0) {
-      const bool insert_successful = location_ids.insert(id).second;
-      if (!insert_successful) {
-        LOG(ERROR) << "Duplicate location id: " << id;
-        return false;
-      }
-    }
     const int64_t mapping_id = location.mapping_id();
     if (mapping_id != 0 && mapping_ids.count(mapping_id) == 0) {
       LOG(ERROR) << "Missing mapping " << mapping_id << " from location " << id;
@@ -216,60 +549,139 @@ bool Builder::CheckValid(const Profile &profile) {
     }
   }
 
-  int sample_type_len = profile.sample_type_size();
-  if (sample_type_len == 0) {
-    LOG(ERROR) << "No sample type specified";
+  if (!CheckSampleTypes(profile)) {
     return false;
   }
 
-  const int default_sample_type = profile.default_sample_type();
-  if (default_sample_type <= 0 ||
-      default_sample_type >= profile.string_table_size()) {
-    LOG(ERROR) << "No default sample type specified";
-    return false;
+  const int sample_type_len = profile.sample_type_size();
+  for (const auto &sample : profile.sample()) {
+    if (!CheckSample(sample, sample_type_len, location_ids)) {
+      return false;
+    }
   }
+  return true;
+}
 
-  std::unordered_set<int> value_types;
-  for (const auto &sample_type : profile.sample_type()) {
-    if (!value_types.insert(sample_type.type()).second) {
-      LOG(ERROR) << "Duplicate sample_type specified";
+bool Builder::CheckFlushedSamples() {
+  const int sample_type_len = profile_->sample_type_size();
+  if (sample_type_len == 0) {
+    LOG(ERROR) << "No sample type specified";
+    return false;
+  }
+  // Locations are only ever appended, so only the ones added since the last
+  // flush have to be inserted.
+  for (; num_flushed_location_ids_ < profile_->location_size();
+       ++num_flushed_location_ids_) {
+    flushed_location_ids_.insert(
+        profile_->location(num_flushed_location_ids_).id());
+  }
+  for (const auto &sample : profile_->sample()) {
+    if (!CheckSample(sample, sample_type_len, flushed_location_ids_)) {
       return false;
     }
   }
+  return true;
+}
 
-  if (value_types.count(default_sample_type) == 0) {
-    LOG(ERROR) << "Default sample type not found";
+bool Builder::FlushSamples(ZeroCopyOutputStream *output) {
+  if (!CheckFlushedSamples()) {
     return false;
   }
+  CodedOutputStream coded_stream(output);
+  WriteMessages(Profile::kSampleFieldNumber, profile_->sample(),
+                &coded_stream);
+  profile_->clear_sample();
+  return !coded_stream.HadError();
+}
 
-  for (const auto &sample : profile.sample()) {
-    if (sample.value_size() != sample_type_len) {
-      LOG(ERROR) << "Found sample with " << sample.value_size()
-                 << " values, expecting " << sample_type_len;
-      return false;
-    }
-    for (uint64_t location_id : sample.location_id()) {
-      if (location_id == 0) {
-        LOG(ERROR) << "Sample referencing location_id=0";
-        return false;
-      }
+bool Builder::EmitToStream(ZeroCopyOutputStream *output) {
+  if (!profile_ || !Finalize()) {
+    return false;
+  }
+  // The string and function ids are no longer needed.
+  StringIndexMap().swap(strings_);
+  FunctionIndexMap().swap(functions_);
+
+  CodedOutputStream coded_stream(output);
+  WriteMessages(Profile::kSampleFieldNumber, profile_->sample(),
+                &coded_stream);
+  profile_->clear_sample();
+  WriteMessages(Profile::kLocationFieldNumber, profile_->location(),
+                &coded_stream);
+  profile_->clear_location();
+  WriteMessages(Profile::kMappingFieldNumber, profile_->mapping(),
+                &coded_stream);
+  profile_->clear_mapping();
+  WriteMessages(Profile::kFunctionFieldNumber, profile_->function(),
+                &coded_stream);
+  profile_->clear_function();
+  for (const auto &str : profile_->string_table()) {
+    coded_stream.WriteTag(LengthDelimitedTag(Profile::kStringTableFieldNumber));
+    coded_stream.WriteVarint32(str.size());
+    coded_stream.WriteString(str);
+  }
+  profile_->clear_string_table();
+  // Repeated fields of a message may be split across its serialization, so
+  // what is left of the profile can be written as is.
+  if (!profile_->SerializeToCodedStream(&coded_stream)) {
+    LOG(ERROR) << "Failed to serialize profile";
+    return false;
+  }
+  return !coded_stream.HadError();
+}
 
-      if (location_ids.count(location_id) == 0) {
-        LOG(ERROR) << "Missing location " << location_id;
-        return false;
-      }
+void Builder::ResolveLocationMappings() {
+  std::vector<MappingRange> mappings;
+  mappings.reserve(profile_->mapping_size());
+  for (const auto &mapping : profile_->mapping()) {
+    mappings.push_back(
+        {mapping.memory_start(), mapping.memory_limit(), mapping.id()});
+  }
+  // Of the mappings that start at the same address, the last one wins.
+  std::stable_sort(mappings.begin(), mappings.end(),
+                   [](const MappingRange &a, const MappingRange &b) {
+                     return a.start < b.start;
+                   });
+  auto last = mappings.begin();
+  for (auto mapping = mappings.begin(); mapping != mappings.end(); ++mapping) {
+    if (mapping->start != last->start) {
+      ++last;
     }
+    *last = *mapping;
+  }
+  mappings.erase(last + 1, mappings.end());
 
-    for (const auto &label : sample.label()) {
-      int64_t str = label.str();
-      int64_t num = label.num();
-      if (str != 0 && num != 0) {
-        LOG(ERROR) << "One of str/num must be unset, got " << str << "," << num;
-        return false;
-      }
+  std::vector<LocationAddress> locations;
+  for (auto &loc : *profile_->mutable_location()) {
+    if (loc.address() != 0 && loc.mapping_id() == 0) {
+      locations.emplace_back(loc.address(), &loc);
     }
   }
-  return true;
+
+  // Each slice of the locations is swept on its own, so that they can be
+  // sorted and swept concurrently. Every thread sets the mappings of distinct
+  // locations.
+  constexpr size_t kMinLocationsPerThread = 1 << 16;
+  const size_t num_threads =
+      std::max<size_t>(1, std::min<size_t>(finalize_threads_,
+                                           locations.size() /
+                                               kMinLocationsPerThread));
+  const size_t slice_size = (locations.size() + num_threads - 1) / num_threads;
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    LocationAddress *begin =
+        locations.data() + std::min(i * slice_size, locations.size());
+    LocationAddress *end = locations.data() +
+                           std::min((i + 1) * slice_size, locations.size());
+    threads.emplace_back(SweepLocationMappings, std::cref(mappings), begin,
+                         end);
+  }
+  SweepLocationMappings(mappings, locations.data(),
+                        locations.data() + std::min(slice_size,
+                                                    locations.size()));
+  for (auto &thread : threads) {
+    thread.join();
+  }
 }
 
 // Finalizes the profile for serialization.
@@ -304,28 +716,12 @@ bool Builder::Finalize() {
 
   // Look up location address on mapping ranges.
   if (profile_->mapping_size() > 0) {
-    std::map<uint64_t, std::pair<uint64_t, uint64_t> > mapping_map;
-    for (const auto &mapping : profile_->mapping()) {
-      mapping_map[mapping.memory_start()] =
-          std::make_pair(mapping.memory_limit(), mapping.id());
-    }
-
-    for (auto &loc : *profile_->mutable_location()) {
-      if (loc.address() != 0 && loc.mapping_id() == 0) {
-        auto mapping = mapping_map.upper_bound(loc.address());
-        if (mapping == mapping_map.begin()) {
-          // Address landed before the first mapping
-          continue;
-        }
-        mapping--;
-        uint64_t limit = mapping->second.first;
-        uint64_t id = mapping->second.second;
-
-        if (loc.address() <= limit) {
-          loc.set_mapping_id(id);
-        }
-      }
-    }
+    ResolveLocationMappings();
+  }
+  if (trusted_ids_ && !kCheckTrustedProfiles) {
+    // Only the sample types, which the builder doesn't manage, are left to
+    // check: the rest of the profile is consistent by construction.
+    return CheckSampleTypes(*profile_);
   }
   return CheckValid(*profile_);
 }
@@ -17,6 +17,7 @@
 #include <utility>
 
 #include <unordered_map>
+#include <unordered_set>
 
 namespace perftools {
 namespace profiles {
@@ -26,6 +27,7 @@ typedef uint64_t uint64;
 typedef std::string string;
 
 typedef std::unordered_map<string, int64> StringIndexMap;
+typedef std::unordered_set<uint64> IndexSet;
 
 class FunctionHasher {
  public:
@@ -45,6 +47,8 @@ typedef std::unordered_map<std::tuple<int64, int64, int64, int64>, int64,
 }  // namespace profiles
 }  // namespace perftools
 
+#include "google/protobuf/arena.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 #include "src/profile.pb.h"
 
 namespace perftools {
@@ -64,8 +68,30 @@ void AddCallstackToSample(Sample *sample, const void *const *stack, int depth,
 // corresponding sample types, and any other optional fields.
 class Builder {
  public:
+  // Options for compressing a profile in Marshal() and MarshalToFile().
+  struct MarshalOptions {
+    // The zlib compression level: -1 for the zlib default, or from 0 (no
+    // compression) to 9 (best compression).
+    int compression_level = -1;
+    // The number of threads to compress with. With more than one thread, the
+    // profile is serialized up front, and its blocks of |block_size| bytes
+    // are compressed concurrently into raw deflate data that is joined into
+    // one gzip stream, the way pigz does. Each block is primed with the end
+    // of the previous one, so the output is nearly as small as that of a
+    // single stream.
+    int num_threads = 1;
+    size_t block_size = 128 * 1024;
+  };
+
   Builder();
 
+  // If use_arena is true, the profile and all of its messages are allocated
+  // on an arena owned by the builder, and are freed all at once with it. This
+  // is much cheaper for profiles with many samples, as long as the profile is
+  // used in place, e.g. through Emit() or Marshal(): Consume() has to return
+  // a heap allocated copy of it.
+  explicit Builder(bool use_arena);
+
   // Adds a string to the profile string table if not already present.
   // Returns a unique integer id for this string.
   int64_t StringId(const char *str);
@@ -82,6 +108,22 @@ class Builder {
   // Add documentation URL.
   void SetDocURL(const std::string &url);
 
+  // Sets the number of threads Finalize() associates locations to mappings
+  // on. Each thread sorts a slice of the locations by address and sweeps it
+  // against the mappings, so this only pays off for profiles with hundreds of
+  // thousands of locations.
+  void set_finalize_threads(int num_threads) {
+    finalize_threads_ = num_threads;
+  }
+
+  // Declares that the profile is consistent by construction: the ids of its
+  // mappings, functions and locations are their 1-based indices, the ids that
+  // locations and samples reference exist, and every sample has a value for
+  // each sample type. Finalize(), and so Emit() and EmitToStream(), then skip
+  // CheckValid(), which walks the whole profile, and only check the sample
+  // types. Debug builds still check the whole profile.
+  void set_trusted_ids(bool trusted_ids) { trusted_ids_ = trusted_ids; }
+
   // Prepares the profile for encoding. Returns true on success.
   // If the profile has no locations, inserts location using the
   // location_ids from the samples as addresses.
@@ -94,19 +136,44 @@ class Builder {
   // encoding was successful.
   bool Emit(std::string *output);
 
+  // Writes the samples added so far to |output| in the profile.proto wire
+  // format, and removes them from the profile, so that they don't have to be
+  // held in memory until the profile is emitted. The samples must be final,
+  // and must only reference locations that were already added: a profile
+  // whose samples have been flushed cannot have its locations created by
+  // Finalize(). The sample types must be set beforehand, as the samples are
+  // validated against them here. Returns false if a sample is invalid or
+  // writing failed.
+  bool FlushSamples(google::protobuf::io::ZeroCopyOutputStream *output);
+
+  // Finalizes the profile and writes it to |output| in the wire format after
+  // any samples written by FlushSamples(), without serializing it as a
+  // whole. Each of the large repeated fields is released from the profile
+  // once it is written. The output is not compressed; wrap |output| in a
+  // GzipOutputStream for that. No further calls should be made to the
+  // builder after this.
+  bool EmitToStream(google::protobuf::io::ZeroCopyOutputStream *output);
+
   // Serializes and compresses a profile into a string, replacing its
   // contents. Returns false if there were errors on the serialization
   // or compression, and the output string will not contain valid data.
   static bool Marshal(const Profile &profile, std::string *output);
+  static bool Marshal(const Profile &profile, const MarshalOptions &options,
+                      std::string *output);
 
   // Serializes and compresses a profile into a file represented by a
   // file descriptor. Returns false if there were errors on the
   // serialization or compression.
   static bool MarshalToFile(const Profile &profile, int fd);
+  static bool MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options, int fd);
 
   // Serializes and compresses a profile into a file, creating a new
   // file or replacing its contents if it already exists.
   static bool MarshalToFile(const Profile &profile, const char *filename);
+  static bool MarshalToFile(const Profile &profile,
+                            const MarshalOptions &options,
+                            const char *filename);
 
   // Determines if the profile is internally consistent (suitable for
   // serialization). Returns true if no errors were encountered.
@@ -114,7 +181,7 @@ class Builder {
 
   // Extract the profile from the builder object. No further calls
   // should be made to the builder after this.
-  std::unique_ptr<Profile> Consume() { return std::move(profile_); }
+  std::unique_ptr<Profile> Consume();
 
   // Returns the underlying profile, to populate any fields not
   // managed by the builder. The fields function and string_table
@@ -123,17 +190,50 @@ class Builder {
   Profile *mutable_profile() { return profile_.get(); }
 
  private:
+  // Deletes the profile unless it is owned by an arena.
+  struct ProfileDeleter {
+    void operator()(Profile *profile) const {
+      if (profile->GetArena() == nullptr) {
+        delete profile;
+      }
+    }
+  };
+
   int64_t InternalStringId(const std::string &str);
 
+  // Returns whether the samples of the profile are consistent with its sample
+  // types and locations, for samples that won't be seen by CheckValid().
+  bool CheckFlushedSamples();
+
+  // Associates the locations that have an address but no mapping to the
+  // mapping whose address range contains it, if any.
+  void ResolveLocationMappings();
+
   // Maps to deduplicate strings and functions.
   StringIndexMap strings_;
   FunctionIndexMap functions_;
 
+  // The arena the profile is allocated on, or nullptr if it is on the heap.
+  // Declared before profile_ so that it outlives it.
+  std::unique_ptr<google::protobuf::Arena> arena_;
+
   // Actual profile being updated.
-  std::unique_ptr<Profile> profile_;
+  std::unique_ptr<Profile, ProfileDeleter> profile_;
 
   // Any error that may have been encountered while building the profile.
   std::string error_;
+
+  // The ids of the locations that flushed samples were checked against, and
+  // the number of locations in the set.
+  IndexSet flushed_location_ids_;
+  int num_flushed_location_ids_ = 0;
+  // Whether any samples were written by FlushSamples().
+  bool samples_flushed_ = false;
+
+  // The number of threads to resolve location mappings on in Finalize().
+  int finalize_threads_ = 1;
+  // Whether the profile is consistent by construction. See set_trusted_ids().
+  bool trusted_ids_ = false;
 };
 
 }  // namespace profiles
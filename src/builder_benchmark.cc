@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Compares building and emitting profiles with heap and arena allocated
+// messages. The profiles are shaped like the ones perf_data_converter builds:
+// samples with a callchain, two values and a couple of labels. 1k samples is
+// about the size of the profile converted from
+// testdata/with-callchain.perf.data.
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "src/builder.h"
+
+namespace {
+
+// The number of calls to operator new, to count the allocations made by the
+// benchmarked code.
+int64_t allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+constexpr int kCallchainDepth = 16;
+constexpr int kNumLocations = 4096;
+
+void BuildProfile(Builder* builder, int num_samples) {
+  Profile* profile = builder->mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder->StringId("cycles_sample"));
+  sample_type->set_unit(builder->StringId("count"));
+  sample_type = profile->add_sample_type();
+  sample_type->set_type(builder->StringId("cycles_event"));
+  sample_type->set_unit(builder->StringId("count"));
+  profile->set_default_sample_type(builder->StringId("cycles_event"));
+
+  auto* mapping = profile->add_mapping();
+  mapping->set_id(1);
+  mapping->set_memory_start(0x400000);
+  mapping->set_memory_limit(0x400000 + kNumLocations * 16);
+  mapping->set_filename(builder->StringId("/usr/bin/binary"));
+  for (int i = 0; i < kNumLocations; ++i) {
+    auto* location = profile->add_location();
+    location->set_id(i + 1);
+    location->set_mapping_id(1);
+    location->set_address(0x400000 + i * 16);
+  }
+
+  const int64_t pid_key = builder->StringId("pid");
+  const int64_t comm_key = builder->StringId("comm");
+  const int64_t comm = builder->StringId("binary");
+  uint64_t rng = 1;
+  for (int i = 0; i < num_samples; ++i) {
+    auto* sample = profile->add_sample();
+    for (int j = 0; j < kCallchainDepth; ++j) {
+      rng = rng * 6364136223846793005 + 1442695040888963407;
+      sample->add_location_id(1 + (rng >> 33) % kNumLocations);
+    }
+    sample->add_value(1);
+    sample->add_value(1000);
+    auto* label = sample->add_label();
+    label->set_key(pid_key);
+    label->set_num(1234);
+    label = sample->add_label();
+    label->set_key(comm_key);
+    label->set_str(comm);
+  }
+}
+
+// Builds and frees the profile.
+void BM_Build(benchmark::State& state, bool use_arena) {
+  const int num_samples = state.range(0);
+  const int64_t allocations_before = allocations;
+  for (auto _ : state) {
+    Builder builder(use_arena);
+    BuildProfile(&builder, num_samples);
+    benchmark::DoNotOptimize(builder.mutable_profile());
+  }
+  state.counters["allocs_per_profile"] = benchmark::Counter(
+      allocations - allocations_before, benchmark::Counter::kAvgIterations);
+  state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK_CAPTURE(BM_Build, Heap, false)
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 19)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Build, Arena, true)
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 19)
+    ->Unit(benchmark::kMillisecond);
+
+// Builds, finalizes, serializes and compresses the profile, and frees it.
+void BM_BuildAndEmit(benchmark::State& state, bool use_arena) {
+  const int num_samples = state.range(0);
+  const int64_t allocations_before = allocations;
+  std::string output;
+  for (auto _ : state) {
+    Builder builder(use_arena);
+    BuildProfile(&builder, num_samples);
+    if (!builder.Emit(&output)) {
+      state.SkipWithError("Emit failed");
+      break;
+    }
+  }
+  state.counters["allocs_per_profile"] = benchmark::Counter(
+      allocations - allocations_before, benchmark::Counter::kAvgIterations);
+  state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK_CAPTURE(BM_BuildAndEmit, Heap, false)
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 19)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_BuildAndEmit, Arena, true)
+    ->RangeMultiplier(8)
+    ->Range(1 << 10, 1 << 19)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
+
+BENCHMARK_MAIN();
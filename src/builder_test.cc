@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "src/builder.h"
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+namespace perftools {
+namespace profiles {
+namespace {
+
+void BuildProfile(Builder* builder) {
+  Profile* profile = builder->mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder->StringId("samples"));
+  sample_type->set_unit(builder->StringId("count"));
+  profile->set_default_sample_type(builder->StringId("samples"));
+  auto* mapping = profile->add_mapping();
+  mapping->set_id(1);
+  mapping->set_memory_start(0x1000);
+  mapping->set_memory_limit(0x2000);
+  mapping->set_filename(builder->StringId("/bin/foo"));
+  for (uint64_t address : {0x1100, 0x1200, 0x1100}) {
+    auto* sample = profile->add_sample();
+    sample->add_location_id(address);
+    sample->add_value(1);
+    auto* label = sample->add_label();
+    label->set_key(builder->StringId("pid"));
+    label->set_num(1);
+  }
+}
+
+TEST(BuilderTest, ArenaProfileMatchesHeapProfile) {
+  Builder heap_builder;
+  BuildProfile(&heap_builder);
+  Builder arena_builder(true);
+  BuildProfile(&arena_builder);
+  EXPECT_NE(nullptr, arena_builder.mutable_profile()->GetArena());
+
+  std::string heap_output, arena_output;
+  ASSERT_TRUE(heap_builder.Emit(&heap_output));
+  ASSERT_TRUE(arena_builder.Emit(&arena_output));
+  EXPECT_EQ(heap_output, arena_output);
+  EXPECT_EQ(2, arena_builder.mutable_profile()->location_size());
+
+  std::unique_ptr<Profile> heap_profile = heap_builder.Consume();
+  std::unique_ptr<Profile> arena_profile = arena_builder.Consume();
+  EXPECT_EQ(nullptr, arena_profile->GetArena());
+  EXPECT_EQ(heap_profile->SerializeAsString(),
+            arena_profile->SerializeAsString());
+}
+
+Profile Unmarshal(const std::string& output) {
+  google::protobuf::io::ArrayInputStream stream(output.data(), output.size());
+  google::protobuf::io::GzipInputStream gzip_stream(
+      &stream, google::protobuf::io::GzipInputStream::GZIP);
+  Profile profile;
+  EXPECT_TRUE(profile.ParseFromZeroCopyStream(&gzip_stream));
+  return profile;
+}
+
+TEST(BuilderTest, ParallelMarshalMatchesSerialMarshal) {
+  Builder builder;
+  Profile* profile = builder.mutable_profile();
+  for (int i = 0; i < 10000; ++i) {
+    auto* sample = profile->add_sample();
+    sample->add_location_id(i % 97);
+    sample->add_value(i);
+    const std::string key = std::to_string(i % 31);
+    sample->add_label()->set_key(builder.StringId(key.c_str()));
+  }
+  const std::string serialized = profile->SerializeAsString();
+
+  std::string serial_output;
+  ASSERT_TRUE(Builder::Marshal(*profile, &serial_output));
+  EXPECT_EQ(serialized, Unmarshal(serial_output).SerializeAsString());
+
+  for (int level : {-1, 0, 1, 9}) {
+    Builder::MarshalOptions options;
+    options.compression_level = level;
+    options.num_threads = 4;
+    options.block_size = 4096;
+    std::string parallel_output;
+    ASSERT_TRUE(Builder::Marshal(*profile, options, &parallel_output));
+    EXPECT_EQ(serialized, Unmarshal(parallel_output).SerializeAsString())
+        << "level " << level;
+  }
+
+  Profile empty;
+  Builder::MarshalOptions options;
+  options.num_threads = 2;
+  std::string empty_output;
+  ASSERT_TRUE(Builder::Marshal(empty, options, &empty_output));
+  EXPECT_EQ("", Unmarshal(empty_output).SerializeAsString());
+}
+
+// Adds a sample type, a mapping and locations to |builder|, and |num_samples|
+// samples on these locations.
+void BuildProfileWithLocations(Builder* builder, int num_samples) {
+  Profile* profile = builder->mutable_profile();
+  if (profile->sample_type_size() == 0) {
+    auto* sample_type = profile->add_sample_type();
+    sample_type->set_type(builder->StringId("samples"));
+    sample_type->set_unit(builder->StringId("count"));
+    profile->set_default_sample_type(builder->StringId("samples"));
+    auto* mapping = profile->add_mapping();
+    mapping->set_id(1);
+    mapping->set_memory_start(0x1000);
+    mapping->set_memory_limit(0x2000);
+    mapping->set_filename(builder->StringId("/bin/foo"));
+    for (int i = 1; i <= 10; ++i) {
+      auto* location = profile->add_location();
+      location->set_id(i);
+      location->set_address(0x1000 + i);
+      location->add_line()->set_function_id(
+          builder->FunctionId(std::to_string(i).c_str(), nullptr, nullptr, 0));
+    }
+  }
+  for (int i = 0; i < num_samples; ++i) {
+    auto* sample = profile->add_sample();
+    sample->add_location_id(i % 10 + 1);
+    sample->add_location_id((i + 3) % 10 + 1);
+    sample->add_value(i);
+    auto* label = sample->add_label();
+    label->set_key(builder->StringId("pid"));
+    label->set_num(i);
+  }
+}
+
+TEST(BuilderTest, EmitToStreamMatchesFinalizedProfile) {
+  Builder expected_builder;
+  for (int i = 0; i < 3; ++i) {
+    BuildProfileWithLocations(&expected_builder, 100);
+  }
+  ASSERT_TRUE(expected_builder.Finalize());
+
+  Builder builder;
+  std::string output;
+  google::protobuf::io::StringOutputStream stream(&output);
+  BuildProfileWithLocations(&builder, 100);
+  ASSERT_TRUE(builder.FlushSamples(&stream));
+  EXPECT_EQ(0, builder.mutable_profile()->sample_size());
+  BuildProfileWithLocations(&builder, 100);
+  ASSERT_TRUE(builder.FlushSamples(&stream));
+  BuildProfileWithLocations(&builder, 100);
+  ASSERT_TRUE(builder.EmitToStream(&stream));
+  EXPECT_EQ(0, builder.mutable_profile()->string_table_size());
+
+  Profile profile;
+  ASSERT_TRUE(profile.ParseFromString(output));
+  EXPECT_EQ(expected_builder.mutable_profile()->SerializeAsString(),
+            profile.SerializeAsString());
+}
+
+TEST(BuilderTest, FlushSamplesChecksSamples) {
+  Builder builder;
+  BuildProfileWithLocations(&builder, 1);
+  builder.mutable_profile()->add_sample()->add_location_id(11);
+  std::string output;
+  google::protobuf::io::StringOutputStream stream(&output);
+  EXPECT_FALSE(builder.FlushSamples(&stream));
+}
+
+// Adds mappings with overlapping and repeated start addresses to |builder|,
+// and |num_locations| locations scattered around them in no particular order.
+void BuildProfileWithMappings(Builder* builder, int num_locations) {
+  Profile* profile = builder->mutable_profile();
+  auto* sample_type = profile->add_sample_type();
+  sample_type->set_type(builder->StringId("samples"));
+  sample_type->set_unit(builder->StringId("count"));
+  profile->set_default_sample_type(builder->StringId("samples"));
+  const uint64_t kMappings[][2] = {
+      {0x1000, 0x1fff}, {0x3000, 0x3fff}, {0x3000, 0x4fff}, {0x3800, 0x38ff},
+      {0x8000, 0x8000},
+  };
+  for (const auto& range : kMappings) {
+    auto* mapping = profile->add_mapping();
+    mapping->set_id(profile->mapping_size());
+    mapping->set_memory_start(range[0]);
+    mapping->set_memory_limit(range[1]);
+  }
+  uint64_t rng = 1;
+  for (int i = 0; i < num_locations; ++i) {
+    rng = rng * 6364136223846793005 + 1442695040888963407;
+    auto* location = profile->add_location();
+    location->set_id(i + 1);
+    location->set_address((rng >> 33) % 0x9000);
+  }
+  auto* sample = profile->add_sample();
+  sample->add_location_id(1);
+  sample->add_value(1);
+}
+
+// Returns the id of the mapping that |address| belongs to in the profile
+// built by BuildProfileWithMappings(), or 0.
+uint64_t ExpectedMappingId(uint64_t address) {
+  if (address == 0) return 0;
+  if (address >= 0x1000 && address <= 0x1fff) return 1;
+  // The second mapping is shadowed by the third, which has the same start.
+  if (address >= 0x3000 && address < 0x3800) return 3;
+  // Past the end of the fourth mapping, nothing covers the address, even
+  // though the third mapping does.
+  if (address >= 0x3800 && address <= 0x38ff) return 4;
+  if (address == 0x8000) return 5;
+  return 0;
+}
+
+TEST(BuilderTest, FinalizeResolvesLocationMappings) {
+  for (int num_threads : {1, 4}) {
+    Builder builder;
+    // Enough locations to be split across threads.
+    BuildProfileWithMappings(&builder, 300000);
+    builder.set_finalize_threads(num_threads);
+    ASSERT_TRUE(builder.Finalize());
+    for (const auto& location : builder.mutable_profile()->location()) {
+      ASSERT_EQ(ExpectedMappingId(location.address()), location.mapping_id())
+          << "address " << location.address() << " with " << num_threads
+          << " threads";
+    }
+  }
+}
+
+TEST(BuilderTest, CheckValidRejectsDuplicateIds) {
+  Builder builder;
+  BuildProfileWithMappings(&builder, 10);
+  Profile* profile = builder.mutable_profile();
+  ASSERT_TRUE(Builder::CheckValid(*profile));
+  profile->mutable_location(7)->set_id(3);
+  EXPECT_FALSE(Builder::CheckValid(*profile));
+  profile->mutable_location(7)->set_id(8);
+  profile->mutable_mapping(0)->set_id(5);
+  EXPECT_FALSE(Builder::CheckValid(*profile));
+  profile->mutable_mapping(0)->set_id(10);
+  // Sparse ids are fine, but must be referenced correctly.
+  EXPECT_TRUE(Builder::CheckValid(*profile));
+  profile->mutable_location(0)->set_mapping_id(1);
+  EXPECT_FALSE(Builder::CheckValid(*profile));
+}
+
+TEST(BuilderTest, TrustedIdsSkipCheckValidInOptimizedBuilds) {
+  Builder builder;
+  BuildProfileWithMappings(&builder, 10);
+  builder.set_trusted_ids(true);
+  // A duplicate location id is only caught when the whole profile is checked.
+  builder.mutable_profile()->mutable_location(7)->set_id(3);
+#ifdef NDEBUG
+  EXPECT_TRUE(builder.Finalize());
+#else
+  EXPECT_FALSE(builder.Finalize());
+#endif
+}
+
+TEST(BuilderTest, TrustedIdsStillCheckSampleTypes) {
+  Builder builder;
+  BuildProfileWithMappings(&builder, 10);
+  builder.set_trusted_ids(true);
+  builder.mutable_profile()->set_default_sample_type(0);
+  EXPECT_FALSE(builder.Finalize());
+}
+
+}  // namespace
+}  // namespace profiles
+}  // namespace perftools
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
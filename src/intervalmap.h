@@ -8,19 +8,42 @@
 #ifndef PERFTOOLS_INTERVALMAP_H_
 #define PERFTOOLS_INTERVALMAP_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <iterator>
 #include <map>
 #include <sstream>
+#include <type_traits>
+#include <vector>
 
 #include "src/quipper/base/logging.h"
 
 namespace perftools {
 
-template <class V>
+// Lookup layouts for IntervalMap.
+//
+// TreeLayout answers lookups directly from the std::map that holds the
+// intervals. It is the better choice when updates are as frequent as lookups.
+struct TreeLayout {};
+
+// FlatLayout additionally keeps the intervals in sorted, contiguous arrays of
+// starts, limits and values, and answers Lookup() with a branchless binary
+// search over the starts. The arrays are rebuilt lazily after a Set(), Clear()
+// or ClearInterval(): lookups fall back to the std::map until enough of them
+// have accumulated to amortize the rebuild, so that interleaving updates with
+// few lookups, as with JIT mmap events, costs about the same as TreeLayout.
+// Since Lookup() may rebuild the arrays, concurrent calls to Lookup() on the
+// same map must be synchronized.
+struct FlatLayout {};
+
+template <class V, class Layout = TreeLayout>
 class IntervalMap {
  public:
+  static_assert(std::is_same<Layout, TreeLayout>::value ||
+                    std::is_same<Layout, FlatLayout>::value,
+                "Layout must be TreeLayout or FlatLayout");
+
   IntervalMap();
 
   // Set [start, limit) to value. If this interval overlaps one currently in the
@@ -31,12 +54,27 @@ class IntervalMap {
   // if no interval contains key.
   bool Lookup(uint64_t key, V* value) const;
 
+  // Like Lookup(), but also narrows [*start, *limit), which must contain key,
+  // to a range of keys that all have the same result as key: the interval
+  // containing key, or if there is none, the gap between intervals around it.
+  bool LookupRange(uint64_t key, V* value, uint64_t* start,
+                   uint64_t* limit) const;
+
   // Find the interval containing key, or the next interval containing
   // something greater than key. Returns false if one is not found, otherwise
   // it sets start, limit, and value to the corresponding values from the
   // interval.
   bool FindNext(uint64_t key, uint64_t* start, uint64_t* limit, V* value) const;
 
+  // Calls fn(start, limit, value) for every interval, in increasing order of
+  // start.
+  template <class F>
+  void ForEach(F fn) const {
+    for (const auto& interval : interval_start_) {
+      fn(interval.first, interval.second.limit, interval.second.value);
+    }
+  }
+
   // Remove all entries from the map.
   void Clear();
 
@@ -99,23 +137,69 @@ class IntervalMap {
   // end(), it is a noop.
   void SplitInterval(MapIter iter, uint64_t point);
 
+  // Marks the flat_* arrays as stale after interval_start_ changed.
+  void Invalidate() {
+    flat_valid_ = false;
+    stale_lookups_ = 0;
+  }
+
+  // Returns whether a lookup should use the flat_* arrays, rebuilding them if
+  // they are stale and enough lookups have been made since the last update.
+  bool UseFlatLayout() const;
+
+  // Rebuilds the flat_* arrays from interval_start_.
+  void BuildFlatLayout() const;
+
+  // Returns the number of intervals starting at or before key, i.e. the index
+  // of the first interval starting after key. The flat_* arrays must be up to
+  // date.
+  size_t FlatUpperBound(uint64_t key) const;
+
+  static constexpr bool kFlat = std::is_same<Layout, FlatLayout>::value;
+
+  // With FlatLayout, the arrays are rebuilt once the number of lookups since
+  // the last update exceeds the number of intervals divided by this. Copying
+  // an interval is much cheaper than a std::map lookup.
+  static constexpr uint64_t kLookupsPerRebuild = 4;
+
   // Map from the start of the interval to the limit of the interval and the
   // corresponding value.
   std::map<uint64_t, Value> interval_start_;
+
+  // The contents of interval_start_ as parallel arrays, only used with
+  // FlatLayout. flat_valid_ is false when interval_start_ has changed since
+  // they were last built, and stale_lookups_ counts the lookups since then.
+  mutable bool flat_valid_ = false;
+  mutable uint64_t stale_lookups_ = 0;
+  mutable std::vector<uint64_t> flat_starts_;
+  mutable std::vector<uint64_t> flat_limits_;
+  mutable std::vector<V> flat_values_;
 };
 
-template <class V>
-IntervalMap<V>::IntervalMap() {}
+template <class V, class Layout>
+IntervalMap<V, Layout>::IntervalMap() {}
 
-template <class V>
-void IntervalMap<V>::Set(uint64_t start, uint64_t limit, const V& value) {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::Set(uint64_t start, uint64_t limit,
+                                 const V& value) {
   CHECK_LT(start, limit);
   RemoveInterval(start, limit);
   Insert(start, limit, value);
+  Invalidate();
 }
 
-template <class V>
-bool IntervalMap<V>::Lookup(uint64_t key, V* value) const {
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::Lookup(uint64_t key, V* value) const {
+  if (UseFlatLayout()) {
+    // Intervals don't overlap, so only the last interval starting at or before
+    // key may contain it.
+    const size_t next = FlatUpperBound(key);
+    if (next == 0 || flat_limits_[next - 1] <= key) {
+      return false;
+    }
+    *value = flat_values_[next - 1];
+    return true;
+  }
   const auto contain = GetContainingInterval(key);
   if (contain == interval_start_.end()) {
     return false;
@@ -124,9 +208,57 @@ bool IntervalMap<V>::Lookup(uint64_t key, V* value) const {
   return true;
 }
 
-template <class V>
-bool IntervalMap<V>::FindNext(uint64_t key, uint64_t* start, uint64_t* limit,
-                              V* value) const {
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::LookupRange(uint64_t key, V* value,
+                                         uint64_t* start,
+                                         uint64_t* limit) const {
+  // Find the last interval starting at or before key, and the start of the
+  // one after it.
+  bool has_prev = false;
+  uint64_t prev_start = 0, prev_limit = 0;
+  const V* prev_value = nullptr;
+  uint64_t next_start = *limit;
+  if (UseFlatLayout()) {
+    const size_t next = FlatUpperBound(key);
+    if (next < flat_starts_.size()) {
+      next_start = flat_starts_[next];
+    }
+    if (next > 0) {
+      has_prev = true;
+      prev_start = flat_starts_[next - 1];
+      prev_limit = flat_limits_[next - 1];
+      prev_value = &flat_values_[next - 1];
+    }
+  } else {
+    auto next = interval_start_.upper_bound(key);
+    if (next != interval_start_.end()) {
+      next_start = next->first;
+    }
+    if (Decrement(&next)) {
+      has_prev = true;
+      prev_start = next->first;
+      prev_limit = next->second.limit;
+      prev_value = &next->second.value;
+    }
+  }
+
+  *limit = std::min(*limit, next_start);
+  if (!has_prev) {
+    return false;
+  }
+  if (prev_limit <= key) {
+    *start = std::max(*start, prev_limit);
+    return false;
+  }
+  *start = std::max(*start, prev_start);
+  *limit = std::min(*limit, prev_limit);
+  *value = *prev_value;
+  return true;
+}
+
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::FindNext(uint64_t key, uint64_t* start,
+                                      uint64_t* limit, V* value) const {
   auto iter = interval_start_.upper_bound(key);
   if (iter == interval_start_.end()) {
     return false;
@@ -137,25 +269,28 @@ bool IntervalMap<V>::FindNext(uint64_t key, uint64_t* start, uint64_t* limit,
   return true;
 }
 
-template <class V>
-void IntervalMap<V>::Clear() {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::Clear() {
   interval_start_.clear();
+  Invalidate();
 }
 
-template <class V>
-void IntervalMap<V>::ClearInterval(uint64_t clear_start, uint64_t clear_limit) {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::ClearInterval(uint64_t clear_start,
+                                           uint64_t clear_limit) {
   CHECK_LT(clear_start, clear_limit);
   RemoveInterval(clear_start, clear_limit);
+  Invalidate();
 }
 
-template <class V>
-uint64_t IntervalMap<V>::Size() const {
+template <class V, class Layout>
+uint64_t IntervalMap<V, Layout>::Size() const {
   return interval_start_.size();
 }
 
-template <class V>
-void IntervalMap<V>::RemoveInterval(uint64_t remove_start,
-                                    uint64_t remove_limit) {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::RemoveInterval(uint64_t remove_start,
+                                            uint64_t remove_limit) {
   if (remove_start >= remove_limit) {
     return;
   }
@@ -171,8 +306,8 @@ void IntervalMap<V>::RemoveInterval(uint64_t remove_start,
   interval_start_.erase(remove_interval_start, remove_interval_end);
 }
 
-template <class V>
-void IntervalMap<V>::SplitInterval(MapIter iter, uint64_t point) {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::SplitInterval(MapIter iter, uint64_t point) {
   if (iter == interval_start_.end() || point <= iter->first ||
       point >= iter->second.limit) {
     return;
@@ -182,8 +317,56 @@ void IntervalMap<V>::SplitInterval(MapIter iter, uint64_t point) {
   Insert(point, larger_limit, iter->second.value);
 }
 
-template <class V>
-bool IntervalMap<V>::Decrement(ConstMapIter* iter) const {
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::UseFlatLayout() const {
+  if (!kFlat) {
+    return false;
+  }
+  if (!flat_valid_) {
+    if (++stale_lookups_ <= interval_start_.size() / kLookupsPerRebuild) {
+      return false;
+    }
+    BuildFlatLayout();
+  }
+  return true;
+}
+
+template <class V, class Layout>
+void IntervalMap<V, Layout>::BuildFlatLayout() const {
+  flat_starts_.clear();
+  flat_limits_.clear();
+  flat_values_.clear();
+  flat_starts_.reserve(interval_start_.size());
+  flat_limits_.reserve(interval_start_.size());
+  flat_values_.reserve(interval_start_.size());
+  for (const auto& interval : interval_start_) {
+    flat_starts_.push_back(interval.first);
+    flat_limits_.push_back(interval.second.limit);
+    flat_values_.push_back(interval.second.value);
+  }
+  flat_valid_ = true;
+}
+
+template <class V, class Layout>
+size_t IntervalMap<V, Layout>::FlatUpperBound(uint64_t key) const {
+  size_t size = flat_starts_.size();
+  if (size == 0) {
+    return 0;
+  }
+  // Find the last start <= key, or the first start if there is none. Each
+  // step halves the range without a data-dependent branch, which the compiler
+  // turns into a conditional move.
+  const uint64_t* base = flat_starts_.data();
+  while (size > 1) {
+    const size_t half = size / 2;
+    base = base[half] <= key ? base + half : base;
+    size -= half;
+  }
+  return (base - flat_starts_.data()) + (*base <= key);
+}
+
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::Decrement(ConstMapIter* iter) const {
   if ((*iter) == interval_start_.begin()) {
     return false;
   }
@@ -191,8 +374,8 @@ bool IntervalMap<V>::Decrement(ConstMapIter* iter) const {
   return true;
 }
 
-template <class V>
-bool IntervalMap<V>::Decrement(MapIter* iter) {
+template <class V, class Layout>
+bool IntervalMap<V, Layout>::Decrement(MapIter* iter) {
   if ((*iter) == interval_start_.begin()) {
     return false;
   }
@@ -200,8 +383,9 @@ bool IntervalMap<V>::Decrement(MapIter* iter) {
   return true;
 }
 
-template <class V>
-void IntervalMap<V>::Insert(uint64_t start, uint64_t limit, const V& value) {
+template <class V, class Layout>
+void IntervalMap<V, Layout>::Insert(uint64_t start, uint64_t limit,
+                                    const V& value) {
   interval_start_.emplace(std::pair<uint64_t, Value>{start, {limit, value}});
 }
 
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016, Google Inc.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Compares the lookup layouts of IntervalMap on address spaces shaped like
+// the ones the Normalizer builds: a few hundred page aligned library mappings
+// and a varying number of small, unaligned JIT mappings.
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/intervalmap.h"
+
+namespace perftools {
+namespace {
+
+constexpr int kLibraryMappings = 300;
+
+struct AddressSpace {
+  std::vector<uint64_t> starts;
+  std::vector<uint64_t> limits;
+};
+
+// Returns kLibraryMappings library mappings followed by jit_mappings JIT
+// mappings, in random order.
+AddressSpace MakeAddressSpace(int jit_mappings) {
+  std::mt19937_64 rng(42);
+  AddressSpace space;
+  uint64_t addr = 0x7f0000000000;
+  for (int i = 0; i < kLibraryMappings; ++i) {
+    const uint64_t size = (1 + rng() % 512) * 4096;
+    space.starts.push_back(addr);
+    space.limits.push_back(addr + size);
+    addr += size + 4096 * (rng() % 4);
+  }
+  addr = 0x40000000;
+  for (int i = 0; i < jit_mappings; ++i) {
+    const uint64_t size = 64 + rng() % 4096;
+    space.starts.push_back(addr);
+    space.limits.push_back(addr + size);
+    addr += size + rng() % 256;
+  }
+  std::vector<size_t> order(space.starts.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::shuffle(order.begin(), order.end(), rng);
+  AddressSpace shuffled;
+  for (size_t i : order) {
+    shuffled.starts.push_back(space.starts[i]);
+    shuffled.limits.push_back(space.limits[i]);
+  }
+  return shuffled;
+}
+
+// Returns addresses that mostly fall inside one of the mappings.
+std::vector<uint64_t> MakeKeys(const AddressSpace& space, int count) {
+  std::mt19937_64 rng(7);
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < count; ++i) {
+    const size_t m = rng() % space.starts.size();
+    keys.push_back(space.starts[m] +
+                   rng() % (space.limits[m] - space.starts[m] + 64));
+  }
+  return keys;
+}
+
+template <class Layout>
+void BM_Lookup(benchmark::State& state) {
+  const AddressSpace space = MakeAddressSpace(state.range(0));
+  const std::vector<uint64_t> keys = MakeKeys(space, 1 << 16);
+  IntervalMap<uint64_t, Layout> map;
+  for (size_t i = 0; i < space.starts.size(); ++i) {
+    map.Set(space.starts[i], space.limits[i], i);
+  }
+  size_t next = 0;
+  for (auto _ : state) {
+    uint64_t value = 0;
+    benchmark::DoNotOptimize(map.Lookup(keys[next], &value));
+    benchmark::DoNotOptimize(value);
+    next = (next + 1) & (keys.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_Lookup, TreeLayout)->RangeMultiplier(4)->Range(16, 16384);
+BENCHMARK_TEMPLATE(BM_Lookup, FlatLayout)->RangeMultiplier(4)->Range(16, 16384);
+
+// Builds the address space one mapping at a time, doing state.range(1)
+// lookups after each mapping, like samples interleaved with mmap events.
+template <class Layout>
+void BM_InterleavedSetAndLookup(benchmark::State& state) {
+  const AddressSpace space = MakeAddressSpace(state.range(0));
+  const int lookups_per_set = state.range(1);
+  const std::vector<uint64_t> keys =
+      MakeKeys(space, space.starts.size() * lookups_per_set);
+  for (auto _ : state) {
+    IntervalMap<uint64_t, Layout> map;
+    size_t next = 0;
+    for (size_t i = 0; i < space.starts.size(); ++i) {
+      map.Set(space.starts[i], space.limits[i], i);
+      for (int j = 0; j < lookups_per_set; ++j) {
+        uint64_t value = 0;
+        benchmark::DoNotOptimize(map.Lookup(keys[next++], &value));
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * space.starts.size() *
+                          lookups_per_set);
+}
+BENCHMARK_TEMPLATE(BM_InterleavedSetAndLookup, TreeLayout)
+    ->ArgsProduct({{1024, 4096}, {1, 64, 1024}});
+BENCHMARK_TEMPLATE(BM_InterleavedSetAndLookup, FlatLayout)
+    ->ArgsProduct({{1024, 4096}, {1, 64, 1024}});
+
+}  // namespace
+}  // namespace perftools
+
+BENCHMARK_MAIN();
@@ -10,6 +10,7 @@
 
 #include "src/intervalmap.h"
 
+#include <random>
 #include <utility>
 #include <vector>
 
@@ -282,6 +283,80 @@ TEST_P(IntervalMapTest, GenericTest) {
 INSTANTIATE_TEST_SUITE_P(AllIntervalMapTests, IntervalMapTest,
                          ::testing::ValuesIn(tests));
 
+TEST(IntervalMapRangeTest, LookupRangeNarrowsToIntervalOrGap) {
+  IntervalMap<std::string> map;
+  map.Set(10, 20, "A");
+  map.Set(30, 40, "B");
+  std::string value;
+
+  uint64_t start = 0, limit = 100;
+  ASSERT_TRUE(map.LookupRange(15, &value, &start, &limit));
+  EXPECT_EQ("A", value);
+  EXPECT_EQ(10, start);
+  EXPECT_EQ(20, limit);
+
+  start = 0, limit = 100;
+  EXPECT_FALSE(map.LookupRange(25, &value, &start, &limit));
+  EXPECT_EQ(20, start);
+  EXPECT_EQ(30, limit);
+
+  start = 0, limit = 100;
+  EXPECT_FALSE(map.LookupRange(5, &value, &start, &limit));
+  EXPECT_EQ(0, start);
+  EXPECT_EQ(10, limit);
+
+  start = 0, limit = 100;
+  EXPECT_FALSE(map.LookupRange(50, &value, &start, &limit));
+  EXPECT_EQ(40, start);
+  EXPECT_EQ(100, limit);
+
+  // A range narrower than the interval is left as is.
+  start = 32, limit = 35;
+  ASSERT_TRUE(map.LookupRange(33, &value, &start, &limit));
+  EXPECT_EQ("B", value);
+  EXPECT_EQ(32, start);
+  EXPECT_EQ(35, limit);
+}
+
+TEST(IntervalMapLayoutTest, FlatLayoutMatchesTreeLayout) {
+  IntervalMap<int, TreeLayout> tree;
+  IntervalMap<int, FlatLayout> flat;
+  std::mt19937_64 rng(1);
+  std::uniform_int_distribution<uint64_t> point(0, 1000);
+  for (int i = 0; i < 2000; ++i) {
+    uint64_t start = point(rng);
+    uint64_t limit = start + 1 + point(rng) % 50;
+    if (i % 5 == 4) {
+      tree.ClearInterval(start, limit);
+      flat.ClearInterval(start, limit);
+    } else {
+      tree.Set(start, limit, i);
+      flat.Set(start, limit, i);
+    }
+    ASSERT_EQ(tree.Size(), flat.Size());
+    // Alternate between lookups right after each update and lookups after
+    // several updates, so that the flat arrays are rebuilt in both cases.
+    if (i % 3 == 0) continue;
+    for (uint64_t key = 0; key <= 1100; key += 7) {
+      int tree_value = -1, flat_value = -1;
+      ASSERT_EQ(tree.Lookup(key, &tree_value), flat.Lookup(key, &flat_value))
+          << "For key: " << key;
+      ASSERT_EQ(tree_value, flat_value) << "For key: " << key;
+      uint64_t tree_start = 0, tree_limit = 2000;
+      uint64_t flat_start = 0, flat_limit = 2000;
+      ASSERT_EQ(tree.LookupRange(key, &tree_value, &tree_start, &tree_limit),
+                flat.LookupRange(key, &flat_value, &flat_start, &flat_limit))
+          << "For key: " << key;
+      ASSERT_EQ(tree_start, flat_start) << "For key: " << key;
+      ASSERT_EQ(tree_limit, flat_limit) << "For key: " << key;
+    }
+  }
+  flat.Clear();
+  int value;
+  EXPECT_FALSE(flat.Lookup(0, &value));
+  EXPECT_EQ(0, flat.Size());
+}
+
 }  // namespace
 }  // namespace perftools
 
@@ -7,14 +7,25 @@
 
 #include "src/perf_data_converter.h"
 
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <deque>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -64,6 +75,79 @@ int64_t UTF8StringId(const std::string& s, ProfileBuilder* builder) {
 // List of profile location IDs, currently used to represent a call stack.
 typedef std::vector<uint64_t> LocationIdVector;
 
+// Mixes value into the hash seed.
+inline size_t HashCombine(size_t seed, uint64_t value) {
+  return seed ^ (std::hash<uint64_t>()(value) + 0x9e3779b97f4a7c15 +
+                 (seed << 6) + (seed >> 2));
+}
+
+// Interns call stacks in a trie: each node is a location ID together with the
+// node of the rest of the stack, towards the root. Stacks are identified by
+// their leaf node, so identical stacks, and the common root-side parts of
+// different ones, are stored only once. This matters for deep callchains, such
+// as those of Java and C++ servers, which mostly differ near the leaf.
+class StackInterner {
+ public:
+  StackInterner() { Clear(); }
+
+  // Returns the ID of stack, listed leaf first, adding the nodes it doesn't
+  // share with previous stacks. The empty stack has ID 0.
+  uint64_t Intern(const LocationIdVector& stack) {
+    uint64_t node = 0;
+    for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+      auto inserted = children_.emplace(Edge{node, *it}, nodes_.size());
+      if (inserted.second) {
+        nodes_.push_back(Node{node, *it});
+      }
+      node = inserted.first->second;
+    }
+    return node;
+  }
+
+  // Calls fn(location_id) for each location of the stack with the given ID,
+  // leaf first.
+  template <class F>
+  void ForEachLocation(uint64_t id, F fn) const {
+    for (; id != 0; id = nodes_[id].parent) {
+      fn(nodes_[id].location_id);
+    }
+  }
+
+  void Clear() {
+    children_.clear();
+    nodes_.assign(1, Node{0, 0});
+  }
+
+  // Returns the number of edges between nodes, and the buckets of their map.
+  size_t size() const { return children_.size(); }
+  size_t bucket_count() const { return children_.bucket_count(); }
+
+ private:
+  struct Node {
+    uint64_t parent;
+    uint64_t location_id;
+  };
+
+  struct Edge {
+    uint64_t parent;
+    uint64_t location_id;
+    bool operator==(const Edge& other) const {
+      return parent == other.parent && location_id == other.location_id;
+    }
+  };
+
+  struct EdgeHasher {
+    size_t operator()(const Edge& edge) const {
+      return HashCombine(std::hash<uint64_t>()(edge.parent), edge.location_id);
+    }
+  };
+
+  // The nodes of the trie, indexed by ID. Node 0 is the root, the empty stack.
+  std::vector<Node> nodes_;
+  // Maps the edges from parent nodes to the IDs of their children.
+  std::unordered_map<Edge, uint64_t, EdgeHasher> children_;
+};
+
 // It is sufficient to key the location and mapping maps by PID.
 // However, when Samples include labels, it is necessary to key their maps
 // not only by PID, but also by anything their labels may contain, since labels
@@ -71,6 +155,11 @@ typedef std::vector<uint64_t> LocationIdVector;
 // required to uniquely identify a Sample: if two Samples you consider different
 // end up with the same SampleKey, you should extend SampleKey til they don't.
 //
+// All the fields are fixed-size: strings are interned into the profile's
+// string table and the stack into the process's StackInterner. Once they are
+// set, ComputeHash() must be called, so that looking the key up in a SampleMap
+// costs a single hash probe and a few integer comparisons.
+//
 // If any of these values are not used as labels, they should be set to 0.
 struct SampleKey {
   Pid pid = 0;
@@ -91,7 +180,8 @@ struct SampleKey {
   uint64_t cache_latency = 0;
   uint64_t data_src = 0;
   uint64_t snoop_status = 0;
-  LocationIdVector stack;
+  // The ID of the sample's call stack in the process's StackInterner.
+  uint64_t stack_id = 0;
   // Cycle count from the start of the sampled operation up to the point where
   // the operation has finished execution and is no longer capable of stalling
   // any instruction that consumes its output.
@@ -104,11 +194,38 @@ struct SampleKey {
   // Cycle count from a virtual address being passed to the MMU for translation,
   // to the result of the translation being available.
   uint32_t translation_latency = 0;
+
+  // The hash of all the fields above, set by ComputeHash().
+  size_t hash = 0;
+
+  void ComputeHash() {
+    size_t h = 0;
+    h = HashCombine(h, pid);
+    h = HashCombine(h, tid);
+    h = HashCombine(h, time_ns);
+    h = HashCombine(h, static_cast<uint64_t>(exec_mode));
+    h = HashCombine(h, comm);
+    h = HashCombine(h, thread_type);
+    h = HashCombine(h, thread_comm);
+    h = HashCombine(h, cgroup);
+    h = HashCombine(h, code_page_size);
+    h = HashCombine(h, data_page_size);
+    h = HashCombine(h, cpu);
+    h = HashCombine(h, cache_latency);
+    h = HashCombine(h, data_src);
+    h = HashCombine(h, snoop_status);
+    h = HashCombine(h, stack_id);
+    h = HashCombine(h, total_latency);
+    h = HashCombine(h, issue_latency);
+    h = HashCombine(h, translation_latency);
+    hash = h;
+  }
 };
 
 struct SampleKeyEqualityTester {
-  bool operator()(const SampleKey a, const SampleKey b) const {
-    return ((a.pid == b.pid) && (a.tid == b.tid) && (a.time_ns == b.time_ns) &&
+  bool operator()(const SampleKey& a, const SampleKey& b) const {
+    return ((a.hash == b.hash) && (a.stack_id == b.stack_id) &&
+            (a.pid == b.pid) && (a.tid == b.tid) && (a.time_ns == b.time_ns) &&
             (a.exec_mode == b.exec_mode) && (a.comm == b.comm) &&
             (a.thread_type == b.thread_type) &&
             (a.thread_comm == b.thread_comm) && (a.cgroup == b.cgroup) &&
@@ -116,37 +233,14 @@ struct SampleKeyEqualityTester {
             (a.data_page_size == b.data_page_size) && (a.cpu == b.cpu) &&
             (a.cache_latency == b.cache_latency) &&
             (a.data_src == b.data_src) && (a.snoop_status == b.snoop_status) &&
-            (a.stack == b.stack) && (a.total_latency == b.total_latency) &&
+            (a.total_latency == b.total_latency) &&
             (a.issue_latency == b.issue_latency) &&
             (a.translation_latency == b.translation_latency));
   }
 };
 
 struct SampleKeyHasher {
-  size_t operator()(const SampleKey k) const {
-    size_t hash = 0;
-    hash ^= std::hash<int32_t>()(k.pid);
-    hash ^= std::hash<int32_t>()(k.tid);
-    hash ^= std::hash<uint64_t>()(k.time_ns);
-    hash ^= std::hash<int>()(static_cast<int>(k.exec_mode));
-    hash ^= std::hash<uint64_t>()(k.comm);
-    hash ^= std::hash<uint64_t>()(k.thread_type);
-    hash ^= std::hash<uint64_t>()(k.thread_comm);
-    hash ^= std::hash<uint64_t>()(k.cgroup);
-    hash ^= std::hash<uint64_t>()(k.code_page_size);
-    hash ^= std::hash<uint64_t>()(k.data_page_size);
-    hash ^= std::hash<uint32_t>()(k.cpu);
-    hash ^= std::hash<uint64_t>()(k.cache_latency);
-    hash ^= std::hash<uint64_t>()(k.data_src);
-    hash ^= std::hash<uint64_t>()(k.snoop_status);
-    for (const auto& id : k.stack) {
-      hash ^= std::hash<uint64_t>()(id);
-    }
-    hash ^= std::hash<uint32_t>()(k.total_latency);
-    hash ^= std::hash<uint32_t>()(k.issue_latency);
-    hash ^= std::hash<uint32_t>()(k.translation_latency);
-    return hash;
-  }
+  size_t operator()(const SampleKey& k) const { return k.hash; }
 };
 
 // While Locations and Mappings are per-address-space (=per-process), samples
@@ -171,6 +265,15 @@ typedef std::map<uint64_t, uint64_t> LocationMap;
 typedef std::unordered_map<const PerfDataHandler::Mapping*, uint64_t>
     MappingMap;
 
+// Map from the contents of a handler mapping (start, limit, file offset,
+// filename and build ID) to profile mapping ID. When the inputs of a merge are
+// converted one after the other, the mappings of the earlier inputs are looked
+// up by contents, since their handler mapping objects are gone.
+typedef std::map<
+    std::tuple<uint64_t, uint64_t, uint64_t, std::string, std::string>,
+    uint64_t>
+    MappingContentMap;
+
 // Per-process (aggregated when no PID grouping requested) info.
 // See docs on ProcessProfile in the header file for details on the fields.
 class ProcessMeta {
@@ -213,7 +316,8 @@ class PerfDataConverter : public PerfDataHandler {
       const quipper::PerfDataProto& perf_data,
       uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
       const std::map<Tid, std::string>& thread_types = {})
-      : perf_data_(perf_data),
+      : perf_data_(&perf_data),
+        events_(EventKeys(perf_data)),
         sample_labels_(sample_labels),
         options_(options) {
     for (auto& it : thread_types) {
@@ -224,13 +328,43 @@ class PerfDataConverter : public PerfDataHandler {
   PerfDataConverter& operator=(const PerfDataConverter&) = delete;
   virtual ~PerfDataConverter() {}
 
-  ProcessProfiles Profiles();
+  virtual ProcessProfiles Profiles();
+
+  // Returns the profiles of the samples converted so far, like Profiles(),
+  // but leaves the converter able to take more samples.
+  virtual ProcessProfiles SnapshotProfiles();
+
+  // Continues with the events of another input, whose samples are merged
+  // into the profiles so far. The mappings and locations of the earlier
+  // inputs are reused when the new input has the same mappings. Returns false,
+  // and keeps the current input, if the new input doesn't have the same
+  // events as the current one.
+  virtual bool StartNextInput(const quipper::PerfDataProto& perf_data);
+
+  // Adds the sizes of the hash maps of the converter to |hash_maps|, see
+  // ConversionStats.
+  virtual void AddHashMapStats(
+      std::vector<ConversionStats::HashMap>* hash_maps) const;
 
   // Callbacks for PerfDataHandler
   bool Sample(const PerfDataHandler::SampleContext& sample) override;
   void Comm(const CommContext& comm) override;
   void MMap(const MMapContext& mmap) override;
 
+  // Sets the position of the event being handled within the input. Each
+  // profile remembers the position of the sample that created it, so that the
+  // profiles of several converters can be put back into input order.
+  void set_sequence(uint64_t sequence) { sequence_ = sequence; }
+
+  // Returns the creation position of each profile returned by Profiles().
+  const std::deque<uint64_t>& profile_sequences() const {
+    return profile_sequences_;
+  }
+
+ protected:
+  // Returns whether Sample() converts the sample rather than dropping it.
+  bool AcceptsSample(const PerfDataHandler::SampleContext& sample) const;
+
  private:
   // Adds a new sample updating the event counters if such sample is not present
   // in the profile initializing its metrics. Updates the metrics associated
@@ -330,29 +464,57 @@ class PerfDataConverter : public PerfDataHandler {
   ProfileBuilder* GetOrCreateBuilder(
       const PerfDataHandler::SampleContext& sample);
 
-  const quipper::PerfDataProto& perf_data_;
+  // Returns the key of |smap| in a MappingContentMap.
+  static MappingContentMap::key_type MappingContentKey(
+      const PerfDataHandler::Mapping* smap);
+
+  // The type and config of an event.
+  using EventKey = std::pair<uint32_t, uint64_t>;
+
+  // Returns the keys of the events of |perf_data|, by file_attrs index.
+  static std::vector<EventKey> EventKeys(
+      const quipper::PerfDataProto& perf_data);
+
+  const quipper::PerfDataProto* perf_data_;
+  // The events of the inputs, whose profiles have two values per event.
+  const std::vector<EventKey> events_;
+  // Whether the converter has moved on to another input, see
+  // StartNextInput(), and the PIDs of the earlier inputs that haven't had a
+  // comm event in the current input yet.
+  bool merging_inputs_ = false;
+  std::unordered_set<Pid> continued_pids_;
   // Using deque so that appends do not invalidate existing pointers.
   std::deque<ProfileBuilder> builders_;
   std::deque<ProcessMeta> process_metas_;
+  std::deque<uint64_t> profile_sequences_;
+  uint64_t sequence_ = 0;
 
   struct PerPidInfo {
     ProfileBuilder* builder = nullptr;
     ProcessMeta* process_meta = nullptr;
     LocationMap location_map;
     MappingMap mapping_map;
+    MappingContentMap mapping_content_map;
     std::unordered_map<Tid, std::string> tid_to_comm_map;
+    StackInterner stacks;
     SampleMap sample_map;
     void clear() {
       builder = nullptr;
       process_meta = nullptr;
       location_map.clear();
       mapping_map.clear();
+      mapping_content_map.clear();
       tid_to_comm_map.clear();
+      stacks.Clear();
       sample_map.clear();
     }
   };
   std::unordered_map<Pid, PerPidInfo> per_pid_;
 
+  // The call stack of the sample being converted, kept across samples to reuse
+  // its storage.
+  LocationIdVector stack_;
+
   const uint32_t sample_labels_;
   const uint32_t options_;
   std::unordered_map<Tid, std::string> thread_types_;
@@ -492,22 +654,26 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
     VLOG(2) << "Creating a new profile for PID key " << builder_pid;
     builders_.push_back(ProfileBuilder());
     per_pid.builder = &builders_.back();
+    // Mappings and locations are numbered as they are added, and samples only
+    // reference locations added for them.
+    per_pid.builder->set_trusted_ids(true);
     process_metas_.push_back(ProcessMeta(builder_pid));
     per_pid.process_meta = &process_metas_.back();
+    profile_sequences_.push_back(sequence_);
 
     ProfileBuilder* builder = per_pid.builder;
     Profile* profile = builder->mutable_profile();
     int last_index = 0;
     int unknown_event_idx = 0;
-    for (int event_idx = 0; event_idx < perf_data_.file_attrs_size();
+    for (int event_idx = 0; event_idx < perf_data_->file_attrs_size();
          ++event_idx) {
       // Come up with an event name for this event.  perf.data will usually
       // contain an event_types section of the same cardinality as its
       // file_attrs; in this case we can just use the name there.  Otherwise
       // we just give it an anonymous name.
       std::string event_name = "";
-      if (perf_data_.file_attrs_size() == perf_data_.event_types_size()) {
-        const auto& event_type = perf_data_.event_types(event_idx);
+      if (perf_data_->file_attrs_size() == perf_data_->event_types_size()) {
+        const auto& event_type = perf_data_->event_types(event_idx);
         if (event_type.has_name()) {
           event_name = event_type.name() + "_";
         }
@@ -533,15 +699,16 @@ ProfileBuilder* PerfDataConverter::GetOrCreateBuilder(
     } else {
       AddOrGetMapping(sample.sample.pid(), sample.main_mapping, builder);
     }
-    if (perf_data_.string_metadata().has_perf_version()) {
+    if (perf_data_->string_metadata().has_perf_version()) {
       std::string perf_version =
-          "perf-version:" + perf_data_.string_metadata().perf_version().value();
+          "perf-version:" +
+          perf_data_->string_metadata().perf_version().value();
       profile->add_comment(UTF8StringId(perf_version, builder));
     }
-    if (perf_data_.string_metadata().has_perf_command_line_whole()) {
+    if (perf_data_->string_metadata().has_perf_command_line_whole()) {
       std::string perf_command =
           "perf-command:" +
-          perf_data_.string_metadata().perf_command_line_whole().value();
+          perf_data_->string_metadata().perf_command_line_whole().value();
       profile->add_comment(UTF8StringId(perf_command, builder));
     }
   } else {
@@ -583,6 +750,15 @@ uint64_t PerfDataConverter::AddOrGetMapping(
   if (it != mapmap.end()) {
     return it->second;
   }
+  MappingContentMap& content_map = per_pid_[pid].mapping_content_map;
+  auto content_key = MappingContentKey(smap);
+  if (merging_inputs_) {
+    auto content_it = content_map.find(content_key);
+    if (content_it != content_map.end()) {
+      mapmap.insert(std::make_pair(smap, content_it->second));
+      return content_it->second;
+    }
+  }
 
   Profile* profile = builder->mutable_profile();
   auto mapping = profile->add_mapping();
@@ -605,21 +781,29 @@ uint64_t PerfDataConverter::AddOrGetMapping(
           << ", memory_limit=" << mapping->memory_limit()
           << ", file_offset=" << mapping->file_offset();
   mapmap.insert(std::make_pair(smap, mapping_id));
+  content_map.emplace(std::move(content_key), mapping_id);
   return mapping_id;
 }
 
+MappingContentMap::key_type
+PerfDataConverter::MappingContentKey(const PerfDataHandler::Mapping* smap) {
+  return std::make_tuple(smap->start, smap->limit, smap->file_offset,
+                         MappingFilename(smap), smap->build_id.value);
+}
+
 void PerfDataConverter::AddOrUpdateSample(
     const PerfDataHandler::SampleContext& context, const Pid& pid,
     const SampleKey& sample_key, ProfileBuilder* builder) {
-  perftools::profiles::Sample* sample = per_pid_[pid].sample_map[sample_key];
+  PerPidInfo& per_pid = per_pid_[pid];
+  perftools::profiles::Sample*& sample = per_pid.sample_map[sample_key];
 
   if (sample == nullptr) {
     Profile* profile = builder->mutable_profile();
     sample = profile->add_sample();
-    per_pid_[pid].sample_map[sample_key] = sample;
-    for (const auto& location_id : sample_key.stack) {
-      sample->add_location_id(location_id);
-    }
+    per_pid.stacks.ForEachLocation(sample_key.stack_id,
+                                   [sample](uint64_t location_id) {
+                                     sample->add_location_id(location_id);
+                                   });
     // Emit any requested labels.
     if (IncludePidLabels() && context.sample.has_pid()) {
       auto* label = sample->add_label();
@@ -721,7 +905,7 @@ void PerfDataConverter::AddOrUpdateSample(
 
     // Two values per collected event: the first is sample counts, the second is
     // event counts (unsampled weight for each sample).
-    for (int event_id = 0; event_id < perf_data_.file_attrs_size();
+    for (int event_id = 0; event_id < perf_data_->file_attrs_size();
          ++event_id) {
       sample->add_value(0);
       sample->add_value(0);
@@ -734,7 +918,7 @@ void PerfDataConverter::AddOrUpdateSample(
     weight = context.sample.period();
   } else if (context.file_attrs_index >= 0) {
     uint64_t period =
-        perf_data_.file_attrs(context.file_attrs_index).attr().sample_period();
+        perf_data_->file_attrs(context.file_attrs_index).attr().sample_period();
     if (period > 0) {
       // If sampling used a fixed period, use that as the weight.
       weight = period;
@@ -775,26 +959,99 @@ uint64_t PerfDataConverter::AddOrGetLocation(
 void PerfDataConverter::Comm(const CommContext& comm) {
   Pid pid = comm.comm->pid();
   Tid tid = comm.comm->tid();
-  if (comm.is_exec) {
+  const std::string name = PerfDataHandler::NameOrMd5Prefix(
+      comm.comm->comm(), comm.comm->comm_md5_prefix());
+  // When merging inputs, the first comm event of a process of an earlier
+  // input is the one perf synthesizes for the processes that already run,
+  // rather than an exec(), if the process still has the same name.
+  bool continued = false;
+  if (pid == tid && continued_pids_.erase(pid) > 0) {
+    const auto& tid_to_comm = per_pid_[pid].tid_to_comm_map;
+    auto it = tid_to_comm.find(tid);
+    continued = it != tid_to_comm.end() && it->second == name;
+  }
+  if (comm.is_exec && !continued) {
     // The is_exec bit indicates an exec() happened, so clear everything
     // from the existing pid.
     VLOG(2) << "exec() for PID=" << pid << ", clearing the profile";
     per_pid_[pid].clear();
   }
-  per_pid_[pid].tid_to_comm_map[tid] = PerfDataHandler::NameOrMd5Prefix(
-      comm.comm->comm(), comm.comm->comm_md5_prefix());
+  per_pid_[pid].tid_to_comm_map[tid] = name;
 }
 
 // Invalidates the locations in location_map in the mmap event's range.
 void PerfDataConverter::MMap(const MMapContext& mmap) {
-  LocationMap& loc_map = per_pid_[mmap.pid].location_map;
-  loc_map.erase(loc_map.lower_bound(mmap.mapping->start),
-                loc_map.lower_bound(mmap.mapping->limit));
+  PerPidInfo& per_pid = per_pid_[mmap.pid];
+  LocationMap& loc_map = per_pid.location_map;
+  auto begin = loc_map.lower_bound(mmap.mapping->start);
+  auto end = loc_map.lower_bound(mmap.mapping->limit);
+  // When merging inputs, the locations of a mapping that an earlier input had
+  // as well are still valid.
+  ProfileBuilder* builder =
+      per_pid_[(options_ & kGroupByPids) ? mmap.pid : 0].builder;
+  MappingContentMap& content_map = per_pid.mapping_content_map;
+  auto content_it = content_map.end();
+  if (merging_inputs_ && builder != nullptr) {
+    content_it = content_map.find(MappingContentKey(mmap.mapping));
+  }
+  if (content_it == content_map.end()) {
+    loc_map.erase(begin, end);
+    return;
+  }
+  const Profile& profile = *builder->mutable_profile();
+  while (begin != end) {
+    if (profile.location(begin->second - 1).mapping_id() ==
+        content_it->second) {
+      ++begin;
+    } else {
+      begin = loc_map.erase(begin);
+    }
+  }
 }
 
-bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
+std::vector<PerfDataConverter::EventKey> PerfDataConverter::EventKeys(
+    const quipper::PerfDataProto& perf_data) {
+  std::vector<EventKey> keys;
+  keys.reserve(perf_data.file_attrs_size());
+  for (const auto& file_attr : perf_data.file_attrs()) {
+    keys.emplace_back(file_attr.attr().type(), file_attr.attr().config());
+  }
+  return keys;
+}
+
+bool PerfDataConverter::StartNextInput(
+    const quipper::PerfDataProto& perf_data) {
+  const std::vector<EventKey> events = EventKeys(perf_data);
+  if (events.size() != events_.size()) {
+    LOG(ERROR) << "Cannot merge an input with " << events.size()
+               << " events into profiles with " << events_.size()
+               << " events";
+    return false;
+  }
+  for (size_t i = 0; i < events.size(); ++i) {
+    if (events[i] != events_[i]) {
+      LOG(ERROR) << "Cannot merge an input whose event " << i << " has type "
+                 << events[i].first << " and config " << events[i].second
+                 << " into profiles where it has type " << events_[i].first
+                 << " and config " << events_[i].second;
+      return false;
+    }
+  }
+  perf_data_ = &perf_data;
+  merging_inputs_ = true;
+  // The handler mappings of the previous input are gone.
+  continued_pids_.clear();
+  for (auto& it : per_pid_) {
+    it.second.mapping_map.clear();
+    continued_pids_.insert(it.first);
+  }
+  return true;
+}
+
+bool PerfDataConverter::AcceptsSample(
+    const PerfDataHandler::SampleContext& sample) const {
   if (sample.file_attrs_index < 0 ||
-      sample.file_attrs_index >= perf_data_.file_attrs_size()) {
+      sample.file_attrs_index >= perf_data_->file_attrs_size()) {
     LOG(WARNING) << "out of bounds file_attrs_index: "
                  << sample.file_attrs_index;
     return false;
@@ -803,10 +1060,18 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
   if (sample.lost && (options_ & kDropLostEvents)) {
     return false;
   }
+  return true;
+}
+
+bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
+  if (!AcceptsSample(sample)) {
+    return false;
+  }
 
   Pid event_pid = sample.sample.pid();
   ProfileBuilder* builder = GetOrCreateBuilder(sample);
   SampleKey sample_key = MakeSampleKey(sample, builder);
+  stack_.clear();
 
   uint64_t ip = sample.sample_mapping != nullptr ? sample.sample.ip() : 0;
   if (ip != 0) {
@@ -827,10 +1092,10 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
       CHECK_GE(addr, start);
       CHECK_LT(addr, limit);
     }
-    sample_key.stack.push_back(
+    stack_.push_back(
         AddOrGetLocation(event_pid, addr, sample.addr_mapping, builder));
   }
-  sample_key.stack.push_back(
+  stack_.push_back(
       AddOrGetLocation(event_pid, ip, sample.sample_mapping, builder));
   IncBuildIdStats(event_pid, sample.sample_mapping);
 
@@ -872,7 +1137,7 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
     }
 
     // Subtract one so we point to the call instead of the return addr.
-    sample_key.stack.push_back(
+    stack_.push_back(
         AddOrGetLocation(event_pid, frame.ip - 1, frame.mapping, builder));
     IncBuildIdStats(event_pid, frame.mapping);
   }
@@ -892,12 +1157,14 @@ bool PerfDataConverter::Sample(const PerfDataHandler::SampleContext& sample) {
       if (frame.from.ip < frame.from.mapping->start) {
         continue;
       }
-      sample_key.stack.push_back(AddOrGetLocation(event_pid, frame.from.ip,
-                                                  frame.from.mapping, builder));
+      stack_.push_back(AddOrGetLocation(event_pid, frame.from.ip,
+                                        frame.from.mapping, builder));
       IncBuildIdStats(event_pid, frame.from.mapping);
     }
   }
 
+  sample_key.stack_id = per_pid_[event_pid].stacks.Intern(stack_);
+  sample_key.ComputeHash();
   AddOrUpdateSample(sample, event_pid, sample_key, builder);
   return true;
 }
@@ -914,39 +1181,718 @@ ProcessProfiles PerfDataConverter::Profiles() {
   return pps;
 }
 
-}  // namespace
+// Adds |size| entries in |bucket_count| buckets to the hash map |name| of
+// |hash_maps|.
+void AddHashMapStat(const char* name, size_t size, size_t bucket_count,
+                    std::vector<ConversionStats::HashMap>* hash_maps) {
+  auto it = std::find_if(
+      hash_maps->begin(), hash_maps->end(),
+      [name](const ConversionStats::HashMap& map) { return map.name == name; });
+  if (it == hash_maps->end()) {
+    hash_maps->emplace_back();
+    it = hash_maps->end() - 1;
+    it->name = name;
+  }
+  it->size += size;
+  it->bucket_count += bucket_count;
+}
 
-ProcessProfiles PerfDataProtoToProfiles(
-    const quipper::PerfDataProto* perf_data, const uint32_t sample_labels,
-    const uint32_t options, const std::map<Tid, std::string>& thread_types) {
-  PerfDataConverter converter(*perf_data, sample_labels, options, thread_types);
-  PerfDataHandler::Process(*perf_data, &converter);
-  return converter.Profiles();
+void PerfDataConverter::AddHashMapStats(
+    std::vector<ConversionStats::HashMap>* hash_maps) const {
+  for (const auto& it : per_pid_) {
+    const PerPidInfo& info = it.second;
+    AddHashMapStat("samples", info.sample_map.size(),
+                   info.sample_map.bucket_count(), hash_maps);
+    AddHashMapStat("stack nodes", info.stacks.size(),
+                   info.stacks.bucket_count(), hash_maps);
+    AddHashMapStat("mappings", info.mapping_map.size(),
+                   info.mapping_map.bucket_count(), hash_maps);
+    AddHashMapStat("locations", info.location_map.size(), 0, hash_maps);
+  }
 }
 
-ProcessProfiles RawPerfDataToProfiles(
+ProcessProfiles PerfDataConverter::SnapshotProfiles() {
+  ProcessProfiles pps;
+  for (size_t i = 0; i < builders_.size(); i++) {
+    // Finalize a copy, since Finalize() rewrites the profile.
+    ProfileBuilder b;
+    *b.mutable_profile() = *builders_[i].mutable_profile();
+    b.set_trusted_ids(true);
+    b.Finalize();
+    auto pp = process_metas_[i].MakeProcessProfile(b.mutable_profile(),
+                                                   process_build_id_stats_);
+    pps.push_back(std::move(pp));
+  }
+  return pps;
+}
+
+// ParallelPerfDataConverter builds the per-process profiles on a pool of
+// worker threads while the calling thread keeps normalizing events. PIDs are
+// sharded across the workers, each of which owns a PerfDataConverter. All the
+// callbacks for a PID are forwarded in order to the same shard, so every
+// process profile comes out exactly as the serial converter would build it.
+class ParallelPerfDataConverter : public PerfDataConverter {
+ public:
+  ParallelPerfDataConverter(const quipper::PerfDataProto& perf_data,
+                            uint32_t sample_labels, uint32_t options,
+                            const std::map<Tid, std::string>& thread_types,
+                            size_t num_shards)
+      : PerfDataConverter(perf_data, sample_labels, options, thread_types) {
+    CHECK(options & kGroupByPids);
+    for (size_t i = 0; i < std::max<size_t>(num_shards, 1); ++i) {
+      shards_.emplace_back(new Shard(perf_data, sample_labels, options,
+                                     thread_types));
+    }
+    for (auto& shard : shards_) {
+      Shard* s = shard.get();
+      s->thread = std::thread([s] { s->Run(); });
+    }
+  }
+  ParallelPerfDataConverter(const ParallelPerfDataConverter&) = delete;
+  ParallelPerfDataConverter& operator=(const ParallelPerfDataConverter&) =
+      delete;
+  ~ParallelPerfDataConverter() override { Stop(); }
+
+  ProcessProfiles Profiles() override;
+  ProcessProfiles SnapshotProfiles() override;
+  bool StartNextInput(const quipper::PerfDataProto& perf_data) override;
+  void AddHashMapStats(
+      std::vector<ConversionStats::HashMap>* hash_maps) const override;
+
+  bool Sample(const PerfDataHandler::SampleContext& sample) override;
+  void Comm(const CommContext& comm) override;
+  void MMap(const MMapContext& mmap) override;
+  void Finish() override { Drain(); }
+
+ private:
+  // A callback deferred to a shard. The contexts handed to the callbacks only
+  // live for the duration of the call, so tasks own copies of the events they
+  // refer to. Mappings are owned by the normalizer and outlive the tasks.
+  struct Task {
+    Task(uint64_t sequence, const PerfDataHandler::SampleContext& c)
+        : sequence(sequence),
+          header(c.header),
+          sample(c.sample),
+          sample_context(header, sample) {
+      sample_context.main_mapping = c.main_mapping;
+      sample_context.sample_mapping = c.sample_mapping;
+      sample_context.addr_mapping = c.addr_mapping;
+      sample_context.callchain = c.callchain;
+      sample_context.branch_stack = c.branch_stack;
+      sample_context.file_attrs_index = c.file_attrs_index;
+      sample_context.cgroup = c.cgroup;
+      sample_context.lost = c.lost;
+      sample_context.spe.is_spe = c.spe.is_spe;
+      sample_context.spe.record = c.spe.record;
+    }
+    Task(uint64_t sequence, const CommContext& c)
+        : sequence(sequence),
+          is_comm(true),
+          sample_context(header, sample),
+          comm_event(*c.comm) {
+      comm_context.comm = &comm_event;
+      comm_context.is_exec = c.is_exec;
+    }
+    Task(uint64_t sequence, const MMapContext& c)
+        : sequence(sequence),
+          is_mmap(true),
+          sample_context(header, sample),
+          mmap_context(c) {}
+
+    uint64_t sequence;
+    bool is_comm = false;
+    bool is_mmap = false;
+    quipper::PerfDataProto::EventHeader header;
+    quipper::PerfDataProto::SampleEvent sample;
+    PerfDataHandler::SampleContext sample_context;
+    quipper::PerfDataProto::CommEvent comm_event;
+    CommContext comm_context;
+    MMapContext mmap_context;
+  };
+
+  typedef std::vector<std::unique_ptr<Task>> TaskBatch;
+
+  // Tasks are handed to the shards in batches to keep the locking overhead
+  // off the per-sample path, and the producer blocks once a shard has this
+  // many tasks queued so that memory stays bounded.
+  static constexpr size_t kBatchSize = 256;
+  static constexpr size_t kMaxQueuedTasks = 64 * kBatchSize;
+
+  struct Shard {
+    Shard(const quipper::PerfDataProto& perf_data, uint32_t sample_labels,
+          uint32_t options, const std::map<Tid, std::string>& thread_types)
+        : converter(perf_data, sample_labels, options, thread_types) {}
+
+    // Runs the tasks queued for this shard until stopped.
+    void Run();
+
+    // Only accessed by the worker thread until it is joined.
+    PerfDataConverter converter;
+    std::thread thread;
+
+    // Tasks accumulated by the producer and not yet queued.
+    TaskBatch pending;
+
+    std::mutex mu;
+    std::condition_variable cv;
+    // The following are guarded by mu.
+    std::deque<TaskBatch> queue;
+    size_t queued_tasks = 0;
+    bool busy = false;
+    bool done = false;
+  };
+
+  // Queues the task on the shard of pid.
+  void Dispatch(Pid pid, std::unique_ptr<Task> task);
+  // Moves the batch accumulated for the shard to its queue.
+  void Flush(Shard* shard);
+  // Waits until all the dispatched tasks have been run.
+  void Drain();
+  // Runs the outstanding tasks and joins the worker threads.
+  void Stop();
+  // Returns the profiles of the shards in input order, see Profiles() and
+  // SnapshotProfiles(). The shards must be idle.
+  ProcessProfiles ShardProfiles(bool snapshot);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  uint64_t next_sequence_ = 0;
+};
+
+constexpr size_t ParallelPerfDataConverter::kBatchSize;
+constexpr size_t ParallelPerfDataConverter::kMaxQueuedTasks;
+
+void ParallelPerfDataConverter::Shard::Run() {
+  while (true) {
+    TaskBatch batch;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [this] { return !queue.empty() || done; });
+      if (queue.empty()) {
+        return;
+      }
+      batch = std::move(queue.front());
+      queue.pop_front();
+      queued_tasks -= batch.size();
+      busy = true;
+    }
+    cv.notify_all();
+    for (const auto& task : batch) {
+      converter.set_sequence(task->sequence);
+      if (task->is_comm) {
+        converter.Comm(task->comm_context);
+      } else if (task->is_mmap) {
+        converter.MMap(task->mmap_context);
+      } else {
+        converter.Sample(task->sample_context);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      busy = false;
+    }
+    cv.notify_all();
+  }
+}
+
+void ParallelPerfDataConverter::Dispatch(Pid pid, std::unique_ptr<Task> task) {
+  Shard* shard = shards_[pid % shards_.size()].get();
+  shard->pending.push_back(std::move(task));
+  if (shard->pending.size() >= kBatchSize) {
+    Flush(shard);
+  }
+}
+
+void ParallelPerfDataConverter::Flush(Shard* shard) {
+  if (shard->pending.empty()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(shard->mu);
+    shard->cv.wait(lock,
+                   [shard] { return shard->queued_tasks < kMaxQueuedTasks; });
+    shard->queued_tasks += shard->pending.size();
+    shard->queue.push_back(std::move(shard->pending));
+  }
+  shard->pending.clear();
+  shard->cv.notify_all();
+}
+
+void ParallelPerfDataConverter::Drain() {
+  for (auto& shard : shards_) {
+    Flush(shard.get());
+  }
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> lock(shard->mu);
+    Shard* s = shard.get();
+    s->cv.wait(lock, [s] { return s->queue.empty() && !s->busy; });
+  }
+}
+
+void ParallelPerfDataConverter::Stop() {
+  for (auto& shard : shards_) {
+    if (!shard->thread.joinable()) {
+      continue;
+    }
+    Flush(shard.get());
+    {
+      std::lock_guard<std::mutex> lock(shard->mu);
+      shard->done = true;
+    }
+    shard->cv.notify_all();
+    shard->thread.join();
+  }
+}
+
+bool ParallelPerfDataConverter::Sample(
+    const PerfDataHandler::SampleContext& sample) {
+  if (!AcceptsSample(sample)) {
+    return false;
+  }
+  Dispatch(sample.sample.pid(),
+           std::unique_ptr<Task>(new Task(next_sequence_++, sample)));
+  return true;
+}
+
+void ParallelPerfDataConverter::Comm(const CommContext& comm) {
+  Dispatch(comm.comm->pid(),
+           std::unique_ptr<Task>(new Task(next_sequence_++, comm)));
+}
+
+void ParallelPerfDataConverter::MMap(const MMapContext& mmap) {
+  Dispatch(mmap.pid, std::unique_ptr<Task>(new Task(next_sequence_++, mmap)));
+  // The normalizer renames the main mapping of the process right after this
+  // callback. Let the shards catch up first, so that no worker reads the
+  // mapping while it changes and the profiles see the same names as with the
+  // serial conversion.
+  if (mmap.renamed_mapping != nullptr) {
+    Drain();
+  }
+}
+
+ProcessProfiles ParallelPerfDataConverter::Profiles() {
+  Stop();
+  return ShardProfiles(/*snapshot=*/false);
+}
+
+ProcessProfiles ParallelPerfDataConverter::SnapshotProfiles() {
+  Drain();
+  return ShardProfiles(/*snapshot=*/true);
+}
+
+bool ParallelPerfDataConverter::StartNextInput(
+    const quipper::PerfDataProto& perf_data) {
+  if (!PerfDataConverter::StartNextInput(perf_data)) {
+    return false;
+  }
+  // The tasks of the previous input refer to its handler mappings.
+  Drain();
+  for (auto& shard : shards_) {
+    shard->converter.StartNextInput(perf_data);
+  }
+  return true;
+}
+
+void ParallelPerfDataConverter::AddHashMapStats(
+    std::vector<ConversionStats::HashMap>* hash_maps) const {
+  for (const auto& shard : shards_) {
+    shard->converter.AddHashMapStats(hash_maps);
+  }
+}
+
+ProcessProfiles ParallelPerfDataConverter::ShardProfiles(bool snapshot) {
+  std::vector<std::pair<uint64_t, std::unique_ptr<ProcessProfile>>> ordered;
+  for (auto& shard : shards_) {
+    ProcessProfiles pps = snapshot ? shard->converter.SnapshotProfiles()
+                                   : shard->converter.Profiles();
+    const auto& sequences = shard->converter.profile_sequences();
+    for (size_t i = 0; i < pps.size(); ++i) {
+      ordered.emplace_back(sequences[i], std::move(pps[i]));
+    }
+  }
+  std::sort(ordered.begin(), ordered.end(),
+            [](const std::pair<uint64_t, std::unique_ptr<ProcessProfile>>& a,
+               const std::pair<uint64_t, std::unique_ptr<ProcessProfile>>& b) {
+              return a.first < b.first;
+            });
+  ProcessProfiles pps;
+  for (auto& it : ordered) {
+    pps.push_back(std::move(it.second));
+  }
+  return pps;
+}
+
+// Returns |num_threads|, or the number of CPUs if it is 0, see
+// ConversionThreads.
+int NumThreadsOrCpus(int num_threads) {
+  if (num_threads > 0) {
+    return num_threads;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Returns the converter for the given options. With kParallelizeByPid, the
+// converter has |num_shards| shards, see ConversionThreads.
+std::unique_ptr<PerfDataConverter> NewPerfDataConverter(
+    const quipper::PerfDataProto& perf_data, uint32_t sample_labels,
+    uint32_t options, const std::map<Tid, std::string>& thread_types,
+    int num_shards) {
+  if ((options & kParallelizeByPid) && (options & kGroupByPids)) {
+    return std::unique_ptr<PerfDataConverter>(new ParallelPerfDataConverter(
+        perf_data, sample_labels, options, thread_types,
+        NumThreadsOrCpus(num_shards)));
+  }
+  return std::unique_ptr<PerfDataConverter>(
+      new PerfDataConverter(perf_data, sample_labels, options, thread_types));
+}
+
+// Returns the seconds elapsed since |start|.
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Returns the CPU time used by the process so far, in seconds.
+double ProcessCpuSeconds() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Records the phases of a conversion in ConversionStats. Does nothing if the
+// stats are null.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(ConversionStats* stats) : stats_(stats) {}
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+  ~PhaseTimer() { Stop(); }
+
+  // Ends the current phase, if any, and starts the phase |name|.
+  void Start(const char* name) {
+    if (stats_ == nullptr) {
+      return;
+    }
+    Stop();
+    name_ = name;
+    wall_start_ = std::chrono::steady_clock::now();
+    cpu_start_ = ProcessCpuSeconds();
+  }
+
+  // Ends the current phase, if any.
+  void Stop() {
+    if (stats_ == nullptr || name_ == nullptr) {
+      return;
+    }
+    stats_->phases.emplace_back();
+    ConversionStats::Phase& phase = stats_->phases.back();
+    phase.name = name_;
+    phase.wall_seconds = SecondsSince(wall_start_);
+    phase.cpu_seconds = ProcessCpuSeconds() - cpu_start_;
+    name_ = nullptr;
+  }
+
+ private:
+  ConversionStats* const stats_;
+  const char* name_ = nullptr;
+  std::chrono::steady_clock::time_point wall_start_;
+  double cpu_start_ = 0;
+};
+
+// Forwards the callbacks of a PerfDataHandler to another one, and measures
+// the time spent in them.
+class TimedHandler : public PerfDataHandler {
+ public:
+  explicit TimedHandler(PerfDataHandler* handler) : handler_(handler) {}
+  TimedHandler(const TimedHandler&) = delete;
+  TimedHandler& operator=(const TimedHandler&) = delete;
+
+  bool Sample(const SampleContext& sample) override {
+    ++num_samples_;
+    const auto start = std::chrono::steady_clock::now();
+    const bool ret = handler_->Sample(sample);
+    seconds_ += SecondsSince(start);
+    return ret;
+  }
+
+  void Comm(const CommContext& comm) override {
+    const auto start = std::chrono::steady_clock::now();
+    handler_->Comm(comm);
+    seconds_ += SecondsSince(start);
+  }
+
+  void MMap(const MMapContext& mmap) override {
+    const auto start = std::chrono::steady_clock::now();
+    handler_->MMap(mmap);
+    seconds_ += SecondsSince(start);
+  }
+
+  void Finish() override {
+    const auto start = std::chrono::steady_clock::now();
+    handler_->Finish();
+    seconds_ += SecondsSince(start);
+  }
+
+  uint64_t num_samples() const { return num_samples_; }
+  double seconds() const { return seconds_; }
+
+ private:
+  PerfDataHandler* const handler_;
+  uint64_t num_samples_ = 0;
+  double seconds_ = 0;
+};
+
+// Records in |stats| the statistics of |converter|, whose callbacks were
+// timed by |handler| during the phase |phase|. The time spent in the callbacks
+// is moved from that phase to a "convert" phase.
+void RecordConverterStats(const PerfDataConverter& converter,
+                          const TimedHandler& handler, const char* phase,
+                          uint64_t num_events, ConversionStats* stats) {
+  auto it = std::find_if(
+      stats->phases.begin(), stats->phases.end(),
+      [phase](const ConversionStats::Phase& p) { return p.name == phase; });
+  if (it != stats->phases.end()) {
+    ConversionStats::Phase convert;
+    convert.name = "convert";
+    convert.wall_seconds = std::min(handler.seconds(), it->wall_seconds);
+    if (it->wall_seconds > 0) {
+      convert.cpu_seconds =
+          it->cpu_seconds * convert.wall_seconds / it->wall_seconds;
+    }
+    it->wall_seconds -= convert.wall_seconds;
+    it->cpu_seconds -= convert.cpu_seconds;
+    stats->phases.insert(it + 1, convert);
+  }
+  stats->num_events = num_events;
+  stats->num_samples = handler.num_samples();
+  converter.AddHashMapStats(&stats->hash_maps);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    // ru_maxrss is in kilobytes.
+    stats->peak_rss_bytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+  }
+}
+
+// Converts |perf_data| into profiles, recording the phases of the conversion
+// with |timer| and its statistics in |stats| if it isn't null.
+ProcessProfiles ConvertPerfDataProto(
+    const quipper::PerfDataProto& perf_data, uint32_t sample_labels,
+    uint32_t options, const std::map<Tid, std::string>& thread_types,
+    int num_shards, PhaseTimer* timer, ConversionStats* stats) {
+  auto converter = NewPerfDataConverter(perf_data, sample_labels, options,
+                                        thread_types, num_shards);
+  TimedHandler handler(converter.get());
+  timer->Start("normalize");
+  PerfDataHandler::Process(perf_data, stats != nullptr
+                                          ? static_cast<PerfDataHandler*>(
+                                                &handler)
+                                          : converter.get());
+  timer->Start("finalize");
+  ProcessProfiles pps = converter->Profiles();
+  timer->Stop();
+  if (stats != nullptr) {
+    RecordConverterStats(*converter, handler, "normalize",
+                         perf_data.events_size(), stats);
+    stats->num_profiles = pps.size();
+  }
+  return pps;
+}
+
+// Returns the fields of sample events that the conversion with the given
+// labels and options reads, as a bitfield of quipper::perf_event_sample_format.
+uint64_t SampleFieldsToConvert(uint32_t sample_labels, uint32_t options) {
+  uint64_t fields = quipper::PERF_SAMPLE_IP | quipper::PERF_SAMPLE_TID |
+                    quipper::PERF_SAMPLE_TIME | quipper::PERF_SAMPLE_ID |
+                    quipper::PERF_SAMPLE_IDENTIFIER |
+                    quipper::PERF_SAMPLE_PERIOD |
+                    quipper::PERF_SAMPLE_CALLCHAIN |
+                    quipper::PERF_SAMPLE_BRANCH_STACK;
+  if (options & kAddDataAddressFrames) fields |= quipper::PERF_SAMPLE_ADDR;
+  if (sample_labels & kCpuLabel) fields |= quipper::PERF_SAMPLE_CPU;
+  if (sample_labels & kCgroupLabel) fields |= quipper::PERF_SAMPLE_CGROUP;
+  if (sample_labels & kCodePageSizeLabel) {
+    fields |= quipper::PERF_SAMPLE_CODE_PAGE_SIZE;
+  }
+  if (sample_labels & kDataPageSizeLabel) {
+    fields |= quipper::PERF_SAMPLE_DATA_PAGE_SIZE;
+  }
+  if (sample_labels & (kCacheLatencyLabel | kTotalLatencyLabel)) {
+    fields |= quipper::PERF_SAMPLE_WEIGHT | quipper::PERF_SAMPLE_WEIGHT_STRUCT;
+  }
+  if (sample_labels & kDataSrcLabel) fields |= quipper::PERF_SAMPLE_DATA_SRC;
+  return fields;
+}
+
+// Perf populates info about the kernel using multiple pathways,
+// which don't actually all match up how they name kernel data; in
+// particular, buildids are reported by a different name ("[kernel.kallsyms]")
+// than the actual mmap filename ("[kernel.kallsyms]_text" or
+// "[kernel.kallsyms]_stext"). Normalize these names so our ProcessProfiles
+// will match kernel mappings to a buildid.
+void AlternateKernelBuildIDFilenames(quipper::PerfReader* reader) {
+  reader->AlternateBuildIDFilenames({
+      {"[kernel.kallsyms]", "[kernel.kallsyms]_text"},
+      {"[kernel.kallsyms]", "[kernel.kallsyms]_stext"},
+  });
+}
+
+// Converts the events read by a PerfReader as they are decoded, see
+// kStreamEvents.
+class StreamingConverter {
+ public:
+  // The converter has |num_shards| shards with kParallelizeByPid, see
+  // ConversionThreads. If |timed| is true, the events are counted and the
+  // callbacks of the converter are timed, see RecordStats().
+  StreamingConverter(const std::map<std::string, std::string>& build_ids,
+                     uint32_t sample_labels, uint32_t options,
+                     const std::map<Tid, std::string>& thread_types,
+                     int num_shards = 0, bool timed = false)
+      : build_ids_(build_ids),
+        sample_labels_(sample_labels),
+        options_(options),
+        thread_types_(thread_types),
+        num_shards_(num_shards),
+        timed_(timed) {
+    reader_.SetSampleFieldsToSerialize(
+        SampleFieldsToConvert(sample_labels, options));
+    reader_.SetOrderStreamedEventsByTime(true);
+    reader_.SetEventCallback(
+        [this](const quipper::PerfDataProto::PerfEvent& event) {
+          if (stream_ == nullptr) {
+            Start();
+          }
+          ++num_events_;
+          stream_->Process(event);
+        });
+  }
+  StreamingConverter(const StreamingConverter&) = delete;
+  StreamingConverter& operator=(const StreamingConverter&) = delete;
+
+  quipper::PerfReader* reader() { return &reader_; }
+
+  // Returns the profiles of the events converted so far.
+  ProcessProfiles Snapshot() {
+    if (stream_ == nullptr) {
+      return ProcessProfiles();
+    }
+    return converter_->SnapshotProfiles();
+  }
+
+  // Returns the profiles once all the events have been read.
+  ProcessProfiles Finish() {
+    FinishEvents();
+    return converter_->Profiles();
+  }
+
+  // Converts the events held back once all the events have been read. The
+  // profiles are then returned by Profiles().
+  void FinishEvents() {
+    if (stream_ == nullptr) {
+      Start();
+    }
+    stream_->Finish();
+  }
+  ProcessProfiles Profiles() { return converter_->Profiles(); }
+
+  // Records the statistics of the conversion in |stats|, where the events were
+  // read and normalized during the phase |phase|. The converter must have been
+  // constructed as timed.
+  void RecordStats(const char* phase, ConversionStats* stats) const {
+    RecordConverterStats(*converter_, *timed_handler_, phase, num_events_,
+                         stats);
+  }
+
+ private:
+  // The metadata the converter depends on (attrs, build IDs, etc.) has been
+  // read by the time the first event is decoded, so start the stream then.
+  void Start() {
+    const int num_build_ids = reader_.build_ids().size();
+    reader_.InjectBuildIDs(build_ids_);
+    // InjectBuildIDs takes the misc bits of new build IDs from the MMAP
+    // events, which have not been read yet, so it marks them all as kernel.
+    // Mark the ones that aren't as user, so that they cannot be mistaken for
+    // the kernel build ID.
+    for (int i = num_build_ids; i < reader_.build_ids().size(); ++i) {
+      auto* build_id = reader_.mutable_build_ids()->Mutable(i);
+      const std::string& filename = build_id->filename();
+      if (!filename.empty() && filename[0] != '[' &&
+          (filename.size() < 3 ||
+           filename.compare(filename.size() - 3, 3, ".ko") != 0)) {
+        build_id->set_misc(quipper::PERF_RECORD_MISC_USER);
+      }
+    }
+    AlternateKernelBuildIDFilenames(&reader_);
+    converter_ = NewPerfDataConverter(reader_.proto(), sample_labels_,
+                                      options_, thread_types_, num_shards_);
+    PerfDataHandler* handler = converter_.get();
+    if (timed_) {
+      timed_handler_.reset(new TimedHandler(converter_.get()));
+      handler = timed_handler_.get();
+    }
+    stream_ = PerfDataHandler::StartStreaming(reader_.proto(), handler);
+  }
+
+  const std::map<std::string, std::string> build_ids_;
+  const uint32_t sample_labels_;
+  const uint32_t options_;
+  const std::map<Tid, std::string> thread_types_;
+  const int num_shards_;
+  const bool timed_;
+
+  quipper::PerfReader reader_;
+  std::unique_ptr<PerfDataConverter> converter_;
+  std::unique_ptr<TimedHandler> timed_handler_;
+  std::unique_ptr<PerfDataHandler::EventStream> stream_;
+  uint64_t num_events_ = 0;
+};
+
+// Converts the raw perf data event by event, see kStreamEvents.
+ProcessProfiles StreamRawPerfDataToProfiles(
     const void* raw, const uint64_t raw_size,
     const std::map<std::string, std::string>& build_ids,
     const uint32_t sample_labels, const uint32_t options,
-    const std::map<Tid, std::string>& thread_types) {
-  quipper::PerfReader reader;
-  if (!reader.ReadFromPointer(reinterpret_cast<const char*>(raw), raw_size)) {
+    const std::map<Tid, std::string>& thread_types, int num_shards,
+    PhaseTimer* timer, ConversionStats* stats) {
+  StreamingConverter converter(build_ids, sample_labels, options,
+                               thread_types, num_shards, stats != nullptr);
+  timer->Start("read and normalize");
+  if (!converter.reader()->ReadFromPointer(reinterpret_cast<const char*>(raw),
+                                           raw_size)) {
     LOG(ERROR) << "Could not read input perf.data";
     return ProcessProfiles();
   }
+  converter.FinishEvents();
+  timer->Start("finalize");
+  ProcessProfiles pps = converter.Profiles();
+  timer->Stop();
+  if (stats != nullptr) {
+    converter.RecordStats("read and normalize", stats);
+    stats->num_profiles = pps.size();
+  }
+  return pps;
+}
 
-  reader.InjectBuildIDs(build_ids);
+// Reads and parses the raw perf data as RawPerfDataToProfiles does without
+// kStreamEvents, recording the phases with |timer|. Returns false if any
+// error occurs.
+bool ReadRawPerfData(const void* raw, const uint64_t raw_size,
+                     const std::map<std::string, std::string>& build_ids,
+                     const uint32_t sample_labels, const uint32_t options,
+                     quipper::PerfReader* reader, PhaseTimer* timer) {
+  reader->SetSampleFieldsToSerialize(
+      SampleFieldsToConvert(sample_labels, options));
+  timer->Start("read");
+  if (!reader->ReadFromPointer(reinterpret_cast<const char*>(raw), raw_size)) {
+    LOG(ERROR) << "Could not read input perf.data";
+    return false;
+  }
 
-  // Perf populates info about the kernel using multiple pathways,
-  // which don't actually all match up how they name kernel data; in
-  // particular, buildids are reported by a different name ("[kernel.kallsyms]")
-  // than the actual mmap filename ("[kernel.kallsyms]_text" or
-  // "[kernel.kallsyms]_stext"). Normalize these names so our ProcessProfiles
-  // will match kernel mappings to a buildid.
-  reader.AlternateBuildIDFilenames({
-      {"[kernel.kallsyms]", "[kernel.kallsyms]_text"},
-      {"[kernel.kallsyms]", "[kernel.kallsyms]_stext"},
-  });
+  timer->Start("parse");
+
+  reader->InjectBuildIDs(build_ids);
+  AlternateKernelBuildIDFilenames(reader);
 
   // Use PerfParser to modify reader's events to have magic done to them such
   // as hugepage deduction and sorting events based on time, if timestamps are
@@ -956,14 +1902,248 @@ ProcessProfiles RawPerfDataToProfiles(
   opts.deduce_huge_page_mappings = true;
   opts.combine_mappings = true;
   opts.allow_unaligned_jit_mappings = options & kAllowUnalignedJitMappings;
-  quipper::PerfParser parser(&reader, opts);
+  quipper::PerfParser parser(reader, opts);
   if (!parser.ParseRawEvents()) {
     LOG(ERROR) << "Could not parse perf events.";
+    return false;
+  }
+  timer->Stop();
+  return true;
+}
+
+// Converts |num_inputs| inputs one after the other with a single converter,
+// so that their samples are merged into one set of profiles. |get_input|
+// returns input i, or nullptr if it could not be read, in which case it is
+// skipped. |release_input| is called once input i has been converted.
+ProcessProfiles MergeInputsToProfiles(
+    size_t num_inputs,
+    const std::function<const quipper::PerfDataProto*(size_t)>& get_input,
+    const std::function<void(size_t)>& release_input,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types) {
+  std::unique_ptr<PerfDataConverter> converter;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    const quipper::PerfDataProto* perf_data = get_input(i);
+    if (perf_data == nullptr) {
+      LOG(ERROR) << "Skipping input " << i << ", which could not be read";
+    } else if (converter == nullptr) {
+      converter = NewPerfDataConverter(*perf_data, sample_labels, options,
+                                       thread_types, /*num_shards=*/0);
+      PerfDataHandler::Process(*perf_data, converter.get());
+    } else if (converter->StartNextInput(*perf_data)) {
+      PerfDataHandler::Process(*perf_data, converter.get());
+    } else {
+      LOG(ERROR) << "Skipping input " << i << ", which cannot be merged";
+    }
+    release_input(i);
+  }
+  if (converter == nullptr) {
+    return ProcessProfiles();
+  }
+  return converter->Profiles();
+}
+
+}  // namespace
+
+class PerfDataConversionSession::Impl : public StreamingConverter {
+ public:
+  using StreamingConverter::StreamingConverter;
+
+  // Set once reading the data failed.
+  bool failed = false;
+};
+
+PerfDataConversionSession::PerfDataConversionSession(
+    const std::map<std::string, std::string>& build_ids,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types)
+    : impl_(new Impl(build_ids, sample_labels, options, thread_types)) {}
+
+PerfDataConversionSession::~PerfDataConversionSession() {}
+
+bool PerfDataConversionSession::Append(const void* data, uint64_t size) {
+  if (impl_->failed) {
+    return false;
+  }
+  if (!impl_->reader()->ReadPipedDataChunk(
+          reinterpret_cast<const char*>(data), size)) {
+    LOG(ERROR) << "Could not read input perf.data";
+    impl_->failed = true;
+    return false;
+  }
+  return true;
+}
+
+ProcessProfiles PerfDataConversionSession::Snapshot() {
+  if (impl_->failed) {
     return ProcessProfiles();
   }
+  // Piped data often has no PERF_RECORD_FINISHED_ROUND events, in which case
+  // all the events would be held back for ordering until the end.
+  impl_->reader()->FlushQueuedStreamedEvents();
+  return impl_->Snapshot();
+}
 
-  return PerfDataProtoToProfiles(&reader.proto(), sample_labels, options,
-                                 thread_types);
+ProcessProfiles PerfDataConversionSession::Finish() {
+  if (impl_->failed) {
+    return ProcessProfiles();
+  }
+  // Data that is still being written may end with a partial event, which is
+  // dropped. The events queued before it are still converted.
+  if (!impl_->reader()->FinishPipedData()) {
+    impl_->reader()->FlushQueuedStreamedEvents();
+  }
+  return impl_->Finish();
+}
+
+std::string ConversionStats::ToString() const {
+  std::ostringstream out;
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+  for (const auto& phase : phases) {
+    out << "phase " << phase.name << ": " << phase.wall_seconds
+        << " s wall, " << phase.cpu_seconds << " s cpu\n";
+    wall_seconds += phase.wall_seconds;
+    cpu_seconds += phase.cpu_seconds;
+  }
+  out << "total: " << wall_seconds << " s wall, " << cpu_seconds
+      << " s cpu\n";
+  out << "input: " << input_bytes << " bytes";
+  if (wall_seconds > 0) {
+    out << ", " << input_bytes / wall_seconds << " bytes/s";
+  }
+  out << "\nevents: " << num_events;
+  if (wall_seconds > 0) {
+    out << ", " << num_events / wall_seconds << " events/s";
+  }
+  out << "\nsamples: " << num_samples << "\nprofiles: " << num_profiles
+      << "\npeak rss: " << peak_rss_bytes << " bytes\n";
+  for (const auto& map : hash_maps) {
+    out << "map " << map.name << ": " << map.size << " entries";
+    if (map.bucket_count > 0) {
+      out << ", " << map.bucket_count << " buckets, load factor "
+          << static_cast<double>(map.size) / map.bucket_count;
+    }
+    out << "\n";
+  }
+  return out.str();
+}
+
+ProcessProfiles PerfDataProtoToProfiles(
+    const quipper::PerfDataProto* perf_data, const uint32_t sample_labels,
+    const uint32_t options, const std::map<Tid, std::string>& thread_types,
+    ConversionStats* stats, const ConversionThreads& threads) {
+  if (stats != nullptr) {
+    *stats = ConversionStats();
+  }
+  PhaseTimer timer(stats);
+  return ConvertPerfDataProto(*perf_data, sample_labels, options, thread_types,
+                              threads.num_shards, &timer, stats);
+}
+
+ProcessProfiles RawPerfDataToProfiles(
+    const void* raw, const uint64_t raw_size,
+    const std::map<std::string, std::string>& build_ids,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types, ConversionStats* stats,
+    const ConversionThreads& threads) {
+  if (stats != nullptr) {
+    *stats = ConversionStats();
+    stats->input_bytes = raw_size;
+  }
+  PhaseTimer timer(stats);
+  if (options & kStreamEvents) {
+    return StreamRawPerfDataToProfiles(raw, raw_size, build_ids, sample_labels,
+                                       options, thread_types,
+                                       threads.num_shards, &timer, stats);
+  }
+
+  quipper::PerfReader reader;
+  reader.SetNumThreads(NumThreadsOrCpus(threads.decode_threads));
+  if (!ReadRawPerfData(raw, raw_size, build_ids, sample_labels, options,
+                       &reader, &timer)) {
+    return ProcessProfiles();
+  }
+  return ConvertPerfDataProto(reader.proto(), sample_labels, options,
+                              thread_types, threads.num_shards, &timer,
+                              stats);
+}
+
+ProcessProfiles MergePerfDataProtosToProfiles(
+    const std::vector<const quipper::PerfDataProto*>& perf_data,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types) {
+  return MergeInputsToProfiles(
+      perf_data.size(), [&](size_t i) { return perf_data[i]; },
+      [](size_t) {}, sample_labels, options, thread_types);
+}
+
+ProcessProfiles MergeRawPerfDataToProfiles(
+    const std::vector<RawPerfData>& inputs,
+    const std::map<std::string, std::string>& build_ids,
+    const uint32_t sample_labels, const uint32_t options,
+    const std::map<Tid, std::string>& thread_types) {
+  // The inputs are read and parsed concurrently, a few inputs ahead of the
+  // one being converted, and freed once they have been converted. The
+  // conversion itself goes through the inputs one after another.
+  const size_t num_threads = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(), inputs.size()));
+  const size_t max_read_ahead = 2 * num_threads;
+  std::vector<std::unique_ptr<quipper::PerfReader>> readers(inputs.size());
+  std::vector<bool> read(inputs.size(), false);
+  size_t next_input = 0;
+  size_t num_converted = 0;
+  std::mutex mu;
+  std::condition_variable cv;
+
+  auto read_inputs = [&]() {
+    std::unique_lock<std::mutex> lock(mu);
+    while (true) {
+      cv.wait(lock, [&] {
+        return next_input >= inputs.size() ||
+               next_input < num_converted + max_read_ahead;
+      });
+      if (next_input >= inputs.size()) {
+        return;
+      }
+      const size_t i = next_input++;
+      lock.unlock();
+      std::unique_ptr<quipper::PerfReader> reader(new quipper::PerfReader);
+      PhaseTimer timer(nullptr);
+      if (!ReadRawPerfData(inputs[i].data, inputs[i].size, build_ids,
+                           sample_labels, options, reader.get(), &timer)) {
+        reader.reset();
+      }
+      lock.lock();
+      readers[i] = std::move(reader);
+      read[i] = true;
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back(read_inputs);
+  }
+
+  ProcessProfiles pps = MergeInputsToProfiles(
+      inputs.size(),
+      [&](size_t i) -> const quipper::PerfDataProto* {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return read[i]; });
+        return readers[i] != nullptr ? &readers[i]->proto() : nullptr;
+      },
+      [&](size_t i) {
+        std::lock_guard<std::mutex> lock(mu);
+        readers[i].reset();
+        num_converted = i + 1;
+        cv.notify_all();
+      },
+      sample_labels, options, thread_types);
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return pps;
 }
 
 }  // namespace perftools
@@ -9,6 +9,7 @@
 #define PERFTOOLS_PERF_DATA_CONVERTER_H_
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "src/profile.pb.h"
@@ -117,6 +118,20 @@ enum ConversionOptions {
   kAddDataAddressFrames = 8,
   // Whether to drop synthetic samples representing lost events/lost samples.
   kDropLostEvents = 16,
+  // Whether to convert the events as they are read instead of first reading
+  // all of them into a PerfDataProto. This bounds memory usage by the process
+  // and mapping state rather than by the number of events, at the cost of
+  // the PerfParser passes: events are only ordered by time within a window of
+  // two rounds, and huge page mappings are neither deduced nor combined. Arm
+  // SPE records only resolve the PIDs of threads whose COMM or FORK event
+  // came before them; the others are attributed to PID 0. Only applies to
+  // RawPerfDataToProfiles.
+  kStreamEvents = 32,
+  // Whether to build the per-process profiles concurrently on a pool of worker
+  // threads, one shard of PIDs per thread, see ConversionThreads. The output
+  // is identical to the single threaded conversion. Only applies together
+  // with kGroupByPids.
+  kParallelizeByPid = 64,
 };
 
 struct ProcessProfile {
@@ -139,6 +154,53 @@ struct ProcessProfile {
 // Type alias for a random access sequence of owned ProcessProfile objects.
 using ProcessProfiles = std::vector<std::unique_ptr<ProcessProfile>>;
 
+// Statistics of a conversion, to find out where its time and memory go.
+struct ConversionStats {
+  // A phase of the conversion, in the order they ran.
+  struct Phase {
+    std::string name;
+    double wall_seconds = 0;
+    // The CPU time of the process, worker threads included. The normalization
+    // of events and their conversion into profiles are interleaved, so only
+    // their wall times are measured apart, and their CPU time is split in
+    // proportion.
+    double cpu_seconds = 0;
+  };
+  // The entries and buckets of the hash maps of the converter, summed over
+  // the processes. Maps that are not hash maps have no buckets.
+  struct HashMap {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t bucket_count = 0;
+  };
+
+  std::vector<Phase> phases;
+  std::vector<HashMap> hash_maps;
+  // The size of the input, and the number of its events and sample events.
+  uint64_t input_bytes = 0;
+  uint64_t num_events = 0;
+  uint64_t num_samples = 0;
+  uint64_t num_profiles = 0;
+  // The peak resident set size of the process at the end of the conversion.
+  uint64_t peak_rss_bytes = 0;
+
+  // Returns a human readable report, with one line per phase, counter and
+  // hash map, and the throughput of the conversion.
+  std::string ToString() const;
+};
+
+// The threads a conversion may use. A count of 0 means one thread per CPU.
+// Callers that convert several inputs at once should leave decode_threads at
+// 1, so as not to run more threads than there are CPUs.
+struct ConversionThreads {
+  // The threads decoding the events of raw perf data into a PerfDataProto.
+  // Doesn't apply with kStreamEvents, whose events are decoded in order.
+  int decode_threads = 1;
+  // The shards of PIDs, each with its own thread, that build the profiles
+  // with kParallelizeByPid.
+  int num_shards = 0;
+};
+
 // Converts raw Linux perf data to a vector of process profiles.
 //
 // sample_labels is the OR-product of all SampleLabels desired in the output
@@ -153,19 +215,94 @@ using ProcessProfiles = std::vector<std::unique_ptr<ProcessProfile>>;
 // If sample_labels doesn't include ThreadTypeLabelKey *or* the TID is not in
 // |thread_types|, no ThreadTypeLabelKey will be applied to the sample.
 //
+// If stats is not null, the statistics of the conversion are stored in it.
+// Gathering them slows the conversion down slightly.
+//
+// threads sets the number of threads used to decode the events and to build
+// the profiles, see ConversionThreads.
+//
 // Returns a vector of process profiles, empty if any error occurs.
 extern ProcessProfiles RawPerfDataToProfiles(
     const void* raw, uint64_t raw_size,
     const std::map<std::string, std::string>& build_ids,
     uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
-    const std::map<uint32_t, std::string>& thread_types = {});
+    const std::map<uint32_t, std::string>& thread_types = {},
+    ConversionStats* stats = nullptr, const ConversionThreads& threads = {});
 
 // Converts a PerfDataProto to a vector of process profiles.
 extern ProcessProfiles PerfDataProtoToProfiles(
     const quipper::PerfDataProto* perf_data, uint32_t sample_labels = kNoLabels,
     uint32_t options = kGroupByPids,
+    const std::map<uint32_t, std::string>& thread_types = {},
+    ConversionStats* stats = nullptr, const ConversionThreads& threads = {});
+
+// A buffer of raw Linux perf data.
+struct RawPerfData {
+  const void* data;
+  uint64_t size;
+};
+
+// Converts several inputs of raw Linux perf data to a single vector of
+// process profiles, as if the inputs had been recorded in one perf.data, e.g.
+// to aggregate the perf.data files collected periodically on a host. Only the
+// reading and parsing of the inputs is concurrent, a few inputs ahead of the
+// conversion: the inputs are converted one after another, and their samples
+// are merged into the same profiles as they are converted, so identical
+// mappings, locations and samples are only stored once. Processes are told
+// apart by PID only, so the inputs should come from the same machine unless
+// kGroupByPids is unset. All the inputs must have the same events. An input
+// that can't be read or merged is skipped. The other arguments are the same
+// as those of RawPerfDataToProfiles, without kStreamEvents.
+extern ProcessProfiles MergeRawPerfDataToProfiles(
+    const std::vector<RawPerfData>& inputs,
+    const std::map<std::string, std::string>& build_ids,
+    uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
+    const std::map<uint32_t, std::string>& thread_types = {});
+
+// Converts several PerfDataProtos to a single vector of process profiles, see
+// MergeRawPerfDataToProfiles.
+extern ProcessProfiles MergePerfDataProtosToProfiles(
+    const std::vector<const quipper::PerfDataProto*>& perf_data,
+    uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
     const std::map<uint32_t, std::string>& thread_types = {});
 
+// Converts piped Linux perf data that arrives in chunks, such as the output of
+// "perf record -o -" while it is still being written. The events are converted
+// as they are read, as with kStreamEvents, and the state of the processes
+// (mappings, comms, build IDs) is kept between chunks, so that the profiles so
+// far can be taken at any point. The data may continue with another piped
+// file of the same perf session, e.g. after the output was rotated. The
+// arguments are the same as those of RawPerfDataToProfiles.
+class PerfDataConversionSession {
+ public:
+  explicit PerfDataConversionSession(
+      const std::map<std::string, std::string>& build_ids,
+      uint32_t sample_labels = kNoLabels, uint32_t options = kGroupByPids,
+      const std::map<uint32_t, std::string>& thread_types = {});
+  PerfDataConversionSession(const PerfDataConversionSession&) = delete;
+  PerfDataConversionSession& operator=(const PerfDataConversionSession&) =
+      delete;
+  ~PerfDataConversionSession();
+
+  // Converts the events in the next |size| bytes of the data. A trailing
+  // partial event is kept until the next call. Returns false if the data
+  // can't be read, after which the session returns no profiles.
+  bool Append(const void* data, uint64_t size);
+
+  // Returns the profiles of the events read so far. The events held back to
+  // order them by time are converted first, so older events that arrive
+  // later are converted out of order. More data can be appended afterwards.
+  ProcessProfiles Snapshot();
+
+  // Returns the profiles of all the events. A trailing partial event is
+  // dropped. The session can't be used afterwards.
+  ProcessProfiles Finish();
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
 }  // namespace perftools
 
 #endif  // PERFTOOLS_PERF_DATA_CONVERTER_H_
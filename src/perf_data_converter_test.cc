@@ -11,6 +11,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -260,6 +261,279 @@ TEST_F(PerfDataConverterTest, Converts) {
   }
 }
 
+TEST_F(PerfDataConverterTest, StreamingMatchesInMemoryConversion) {
+  std::vector<std::string> files = {
+      "single-event-single-process.perf.data",
+      "single-event-multi-process.perf.data",
+      "multi-event-single-process.perf.data",
+      "with-callchain.perf.data",
+  };
+  for (const auto& file : files) {
+    std::string path = GetResource(file);
+    std::string raw_perf_data = GetContents(path);
+    ASSERT_FALSE(raw_perf_data.empty()) << path;
+
+    const auto want = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kPidLabel, kGroupByPids);
+    const auto got = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kPidLabel, kGroupByPids | kStreamEvents);
+
+    EXPECT_EQ(want.size(), got.size()) << file;
+    EXPECT_EQ(GetMapCounts(want), GetMapCounts(got)) << file;
+    EXPECT_EQ(AllBuildIDs(want), AllBuildIDs(got)) << file;
+  }
+}
+
+TEST_F(PerfDataConverterTest, SessionMatchesStreamingConversion) {
+  const std::string path = "src/quipper/testdata/perf.data.piped.target-3.8";
+  const std::string raw_perf_data = GetContents(path);
+  ASSERT_FALSE(raw_perf_data.empty()) << path;
+  auto num_samples = [](const ProcessProfiles& pps) {
+    int64_t n = 0;
+    for (const auto& pp : pps) {
+      n += pp->data.sample_size();
+    }
+    return n;
+  };
+
+  const uint32_t serial = kGroupByPids;
+  const uint32_t parallel = kGroupByPids | kParallelizeByPid;
+  for (uint32_t options : {serial, parallel}) {
+    const auto want = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kPidLabel, options | kStreamEvents);
+
+    PerfDataConversionSession session({}, kPidLabel, options);
+    ProcessProfiles snapshot;
+    const size_t chunk_size = 4096;
+    for (size_t offset = 0; offset < raw_perf_data.size();
+         offset += chunk_size) {
+      ASSERT_TRUE(session.Append(
+          raw_perf_data.data() + offset,
+          std::min(chunk_size, raw_perf_data.size() - offset)));
+      if (snapshot.empty() && offset >= raw_perf_data.size() / 2) {
+        snapshot = session.Snapshot();
+      }
+    }
+    const auto got = session.Finish();
+
+    EXPECT_GT(num_samples(snapshot), 0);
+    EXPECT_LT(num_samples(snapshot), num_samples(got));
+    EXPECT_EQ(want.size(), got.size());
+    EXPECT_EQ(GetMapCounts(want), GetMapCounts(got));
+    EXPECT_EQ(AllBuildIDs(want), AllBuildIDs(got));
+  }
+}
+
+TEST_F(PerfDataConverterTest, SessionFinishesMidEvent) {
+  const std::string path = "src/quipper/testdata/perf.data.piped.target-3.8";
+  const std::string raw_perf_data = GetContents(path);
+  ASSERT_FALSE(raw_perf_data.empty()) << path;
+  const auto want = RawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, kPidLabel, kGroupByPids | kStreamEvents);
+
+  // The data ends with the header of a sample whose body was never written.
+  const quipper::perf_event_header partial_header = {
+      .type = quipper::PERF_RECORD_SAMPLE,
+      .misc = 0,
+      .size = 64,
+  };
+  PerfDataConversionSession session({}, kPidLabel, kGroupByPids);
+  ASSERT_TRUE(session.Append(raw_perf_data.data(), raw_perf_data.size()));
+  ASSERT_TRUE(session.Append(&partial_header, sizeof(partial_header)));
+  const auto got = session.Finish();
+
+  EXPECT_EQ(want.size(), got.size());
+  EXPECT_EQ(GetMapCounts(want), GetMapCounts(got));
+  EXPECT_EQ(AllBuildIDs(want), AllBuildIDs(got));
+}
+
+TEST_F(PerfDataConverterTest, SessionFailsOnBadInput) {
+  const std::string bad_perf_data(64, 'x');
+  PerfDataConversionSession session({}, kPidLabel, kGroupByPids);
+  EXPECT_FALSE(session.Append(bad_perf_data.data(), bad_perf_data.size()));
+  EXPECT_TRUE(session.Snapshot().empty());
+  EXPECT_TRUE(session.Finish().empty());
+}
+
+TEST_F(PerfDataConverterTest, MergesInputs) {
+  const std::string raw_perf_data =
+      GetContents(GetResource("with-callchain.perf.data"));
+  const std::string other_raw_perf_data =
+      GetContents(GetResource("multi-event-single-process.perf.data"));
+  ASSERT_FALSE(raw_perf_data.empty());
+  ASSERT_FALSE(other_raw_perf_data.empty());
+  const RawPerfData input = {raw_perf_data.data(), raw_perf_data.size()};
+  const RawPerfData other_input = {other_raw_perf_data.data(),
+                                   other_raw_perf_data.size()};
+
+  const uint32_t serial = kGroupByPids;
+  const uint32_t parallel = kGroupByPids | kParallelizeByPid;
+  for (uint32_t options : {serial, parallel}) {
+    const auto want = RawPerfDataToProfiles(input.data, input.size, {},
+                                            kPidLabel, options);
+    // The same input twice doubles the sample values, without adding
+    // samples, locations or mappings. The other input has different events,
+    // so it can't be merged and is skipped.
+    const auto got = MergeRawPerfDataToProfiles({input, other_input, input},
+                                                {}, kPidLabel, options);
+
+    ASSERT_EQ(want.size(), got.size());
+    for (size_t i = 0; i < want.size(); ++i) {
+      const Profile& want_profile = want[i]->data;
+      const Profile& got_profile = got[i]->data;
+      EXPECT_EQ(want[i]->pid, got[i]->pid);
+      EXPECT_EQ(want_profile.mapping_size(), got_profile.mapping_size());
+      EXPECT_EQ(want_profile.location_size(), got_profile.location_size());
+      ASSERT_EQ(want_profile.sample_size(), got_profile.sample_size());
+      for (int j = 0; j < want_profile.sample_size(); ++j) {
+        const auto& want_sample = want_profile.sample(j);
+        const auto& got_sample = got_profile.sample(j);
+        ASSERT_EQ(want_sample.value_size(), got_sample.value_size());
+        for (int k = 0; k < want_sample.value_size(); ++k) {
+          EXPECT_EQ(2 * want_sample.value(k), got_sample.value(k));
+        }
+      }
+    }
+  }
+}
+
+TEST_F(PerfDataConverterTest, SkipsInputsWithOtherEvents) {
+  const std::string raw_perf_data =
+      GetContents(GetResource("with-callchain.perf.data"));
+  ASSERT_FALSE(raw_perf_data.empty());
+  const PerfDataProto perf_data = ToPerfDataProto(raw_perf_data);
+  // The same number of events, but counting something else.
+  PerfDataProto other_perf_data = perf_data;
+  auto* attr = other_perf_data.mutable_file_attrs(0)->mutable_attr();
+  attr->set_config(attr->config() + 1);
+
+  const auto want = MergePerfDataProtosToProfiles({&perf_data, &perf_data},
+                                                  kPidLabel, kGroupByPids);
+  const auto got = MergePerfDataProtosToProfiles(
+      {&perf_data, &other_perf_data, &perf_data}, kPidLabel, kGroupByPids);
+
+  ASSERT_EQ(want.size(), got.size());
+  for (size_t i = 0; i < want.size(); ++i) {
+    EXPECT_EQ(want[i]->pid, got[i]->pid);
+    EXPECT_EQ(want[i]->data.SerializeAsString(),
+              got[i]->data.SerializeAsString())
+        << "pid " << want[i]->pid;
+  }
+}
+
+TEST_F(PerfDataConverterTest, ParallelMatchesSerialConversion) {
+  std::vector<std::string> files = {
+      "single-event-multi-process.perf.data",
+      "with-callchain.perf.data",
+  };
+  for (const auto& file : files) {
+    std::string path = GetResource(file);
+    std::string raw_perf_data = GetContents(path);
+    ASSERT_FALSE(raw_perf_data.empty()) << path;
+    const auto perf_data_proto = ToPerfDataProto(raw_perf_data);
+    const uint32_t labels = kPidAndTidLabels | kCommLabel;
+
+    const auto want =
+        PerfDataProtoToProfiles(&perf_data_proto, labels, kGroupByPids);
+    // Several shards, whatever the number of CPUs, so that their profiles
+    // have to be merged.
+    ConversionThreads threads;
+    threads.num_shards = 4;
+    const auto got =
+        PerfDataProtoToProfiles(&perf_data_proto, labels,
+                                kGroupByPids | kParallelizeByPid, {}, nullptr,
+                                threads);
+
+    ASSERT_EQ(want.size(), got.size()) << file;
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->pid, got[i]->pid) << file;
+      EXPECT_EQ(want[i]->data.SerializeAsString(),
+                got[i]->data.SerializeAsString())
+          << file << " pid " << want[i]->pid;
+      EXPECT_EQ(want[i]->build_id_stats, got[i]->build_id_stats) << file;
+    }
+  }
+}
+
+TEST_F(PerfDataConverterTest, DecodeThreadsMatchSerialConversion) {
+  const std::string raw_perf_data =
+      GetContents(GetResource("with-callchain.perf.data"));
+  ASSERT_FALSE(raw_perf_data.empty());
+  const auto want = RawPerfDataToProfiles(raw_perf_data.data(),
+                                          raw_perf_data.size(), {}, kPidLabel,
+                                          kGroupByPids);
+  ConversionThreads threads;
+  threads.decode_threads = 4;
+  const auto got = RawPerfDataToProfiles(
+      raw_perf_data.data(), raw_perf_data.size(), {}, kPidLabel, kGroupByPids,
+      {}, nullptr, threads);
+
+  ASSERT_EQ(want.size(), got.size());
+  for (size_t i = 0; i < want.size(); ++i) {
+    EXPECT_EQ(want[i]->pid, got[i]->pid);
+    EXPECT_EQ(want[i]->data.SerializeAsString(),
+              got[i]->data.SerializeAsString())
+        << "pid " << want[i]->pid;
+  }
+}
+
+TEST_F(PerfDataConverterTest, ReportsConversionStats) {
+  std::string raw_perf_data =
+      GetContents(GetResource("with-callchain.perf.data"));
+  ASSERT_FALSE(raw_perf_data.empty());
+  const auto want = RawPerfDataToProfiles(
+      reinterpret_cast<const void*>(raw_perf_data.c_str()),
+      raw_perf_data.size(), {}, kPidLabel, kGroupByPids);
+
+  struct Test {
+    uint32_t options;
+    std::vector<std::string> phases;
+  };
+  const uint32_t kStreamed = kGroupByPids | kStreamEvents;
+  const uint32_t kParallel = kGroupByPids | kParallelizeByPid;
+  const std::vector<std::string> kInMemoryPhases = {
+      "read", "parse", "normalize", "convert", "finalize"};
+  for (const auto& test : std::vector<Test>{
+           {kGroupByPids, kInMemoryPhases},
+           {kParallel, kInMemoryPhases},
+           {kStreamed, {"read and normalize", "convert", "finalize"}}}) {
+    ConversionStats stats;
+    const auto got = RawPerfDataToProfiles(
+        reinterpret_cast<const void*>(raw_perf_data.c_str()),
+        raw_perf_data.size(), {}, kPidLabel, test.options, {}, &stats);
+    ASSERT_EQ(want.size(), got.size()) << test.options;
+    for (size_t i = 0; i < want.size(); ++i) {
+      EXPECT_EQ(want[i]->data.SerializeAsString(),
+                got[i]->data.SerializeAsString())
+          << test.options;
+    }
+
+    std::vector<std::string> phases;
+    for (const auto& phase : stats.phases) {
+      phases.push_back(phase.name);
+      EXPECT_GE(phase.wall_seconds, 0) << phase.name;
+      EXPECT_GE(phase.cpu_seconds, 0) << phase.name;
+    }
+    EXPECT_EQ(test.phases, phases) << test.options;
+    EXPECT_EQ(raw_perf_data.size(), stats.input_bytes);
+    EXPECT_GT(stats.num_events, stats.num_samples) << test.options;
+    EXPECT_GT(stats.num_samples, 0) << test.options;
+    EXPECT_EQ(got.size(), stats.num_profiles);
+    EXPECT_GT(stats.peak_rss_bytes, 0);
+    std::map<std::string, uint64_t> hash_map_sizes;
+    for (const auto& map : stats.hash_maps) {
+      hash_map_sizes[map.name] = map.size;
+    }
+    EXPECT_GT(hash_map_sizes["samples"], 0) << test.options;
+    EXPECT_GT(hash_map_sizes["locations"], 0) << test.options;
+    EXPECT_NE(std::string::npos, stats.ToString().find("phase convert: "));
+  }
+}
+
 TEST_F(PerfDataConverterTest, ConvertsGroupPid) {
   std::string multiple_profile(
       GetResource("single-event-multi-process.perf.data"));
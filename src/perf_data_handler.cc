@@ -9,6 +9,8 @@
 
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
@@ -87,64 +89,144 @@ std::unordered_map<uint32_t, uint32_t> TidToPidMapping(
   return t2p;
 }
 
+// Samples far outnumber mmap events, so the address spaces use the layout
+// optimized for lookups.
+typedef IntervalMap<const PerfDataHandler::Mapping*, FlatLayout>
+    MMapIntervalMap;
+
+// AddressSpace holds the mappings of a process. A forked process shares the
+// address space of its parent copy-on-write: the mappings the parent has so
+// far are frozen into a layer shared by both processes, and each of them adds
+// its own mappings to a private layer on top of it. Mappings are only ever
+// added, never removed, so an address that is not in the private layer has
+// the mapping it had in the shared layers at the time of the fork.
+//
+// Consecutive lookups mostly hit the same few mappings, so the address space
+// also remembers the address ranges of its most recent lookups, including
+// those that found no mapping.
+class AddressSpace {
+ public:
+  AddressSpace() {}
+
+  AddressSpace(const AddressSpace&) = delete;
+  AddressSpace& operator=(const AddressSpace&) = delete;
+
+  // Returns a new address space with the same mappings as this one, without
+  // copying them.
+  std::unique_ptr<AddressSpace> Fork() {
+    if (mappings_.Size() > 0) {
+      auto frozen = std::make_shared<AddressSpace>();
+      std::swap(frozen->mappings_, mappings_);
+      frozen->parent_ = std::move(parent_);
+      frozen->depth_ = depth_;
+      parent_ = std::move(frozen);
+      ++depth_;
+    }
+    std::unique_ptr<AddressSpace> child(new AddressSpace);
+    child->parent_ = parent_;
+    child->depth_ = depth_;
+    return child;
+  }
+
+  // Maps [start, limit) to mapping, overwriting what was mapped there.
+  void Set(uint64_t start, uint64_t limit,
+           const PerfDataHandler::Mapping* mapping) {
+    if (depth_ > kMaxDepth) {
+      Flatten();
+    }
+    mappings_.Set(start, limit, mapping);
+    recent_.fill(CachedRange());
+  }
+
+  // Returns the mapping containing addr, or nullptr if there is none. Sets
+  // *cached to whether the result was found among the recent lookups.
+  const PerfDataHandler::Mapping* Lookup(uint64_t addr, bool* cached) const {
+    for (size_t i = 0; i < recent_.size(); ++i) {
+      if (addr >= recent_[i].start && addr < recent_[i].limit) {
+        // Move the hit to the front.
+        const CachedRange hit = recent_[i];
+        std::copy_backward(recent_.begin(), recent_.begin() + i,
+                           recent_.begin() + i + 1);
+        recent_[0] = hit;
+        *cached = true;
+        return hit.mapping;
+      }
+    }
+    *cached = false;
+    // Narrow the range down to the part of the layer that has the result, and
+    // of the gaps around addr in the layers above it.
+    CachedRange result;
+    result.limit = std::numeric_limits<uint64_t>::max();
+    for (const AddressSpace* layer = this; layer != nullptr;
+         layer = layer->parent_.get()) {
+      if (layer->mappings_.LookupRange(addr, &result.mapping, &result.start,
+                                       &result.limit)) {
+        break;
+      }
+    }
+    std::copy_backward(recent_.begin(), recent_.end() - 1, recent_.end());
+    recent_[0] = result;
+    return result.mapping;
+  }
+
+ private:
+  // A range of addresses with the same lookup result.
+  struct CachedRange {
+    uint64_t start = 0;
+    uint64_t limit = 0;
+    const PerfDataHandler::Mapping* mapping = nullptr;
+  };
+
+  // Copies the shared layers into the private one once a process has more than
+  // this many, to bound the number of layers a lookup walks through.
+  static constexpr int kMaxDepth = 4;
+
+  // Replaces the shared layers with a private copy of their mappings.
+  void Flatten() {
+    std::vector<const AddressSpace*> layers;
+    for (const AddressSpace* layer = this; layer != nullptr;
+         layer = layer->parent_.get()) {
+      layers.push_back(layer);
+    }
+    MMapIntervalMap flattened;
+    // Apply the oldest layer first so that newer mappings overwrite it.
+    for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+      (*it)->mappings_.ForEach(
+          [&flattened](uint64_t start, uint64_t limit,
+                       const PerfDataHandler::Mapping* mapping) {
+            flattened.Set(start, limit, mapping);
+          });
+    }
+    std::swap(mappings_, flattened);
+    parent_.reset();
+    depth_ = 0;
+  }
+
+  // The mappings added to this layer.
+  MMapIntervalMap mappings_;
+  // The layers shared with other processes, or nullptr if there are none.
+  std::shared_ptr<const AddressSpace> parent_;
+  // The number of layers in parent_.
+  int depth_ = 0;
+  // The results of the most recent lookups, most recent first.
+  mutable std::array<CachedRange, 4> recent_;
+};
+
 // Normalizer iterates through the events and metadata of the given
 // PerfDataProto to create its own tables and metadata for each process. During
 // the iteration, it drives callbacks to PerfDataHandler with samples in a fully
 // normalized form (e.g. samples with their corresponding metadata like their
 // mappings, call chains, branch stacks etc.).
-class Normalizer {
+//
+// When streaming, the events are not taken from the PerfDataProto but are
+// passed one at a time to Process(), so any state derived from an event must
+// be copied out of it.
+class Normalizer : public PerfDataHandler::EventStream {
  public:
-  Normalizer(const PerfDataProto& perf_proto, PerfDataHandler* handler)
-      : perf_proto_(perf_proto), handler_(handler) {
-    for (const auto& build_id : perf_proto_.build_ids()) {
-      const std::string& bytes = build_id.build_id_hash();
-      std::stringstream hex;
-      for (size_t i = 0; i < bytes.size(); ++i) {
-        // The char must be turned into an int to be used by stringstream;
-        // however, if the byte's value -8 it should be turned to 0x00f8 as an
-        // int, not 0xfff8. This cast solves this problem.
-        const auto& byte = static_cast<unsigned char>(bytes[i]);
-        hex << std::hex << std::setfill('0') << std::setw(2)
-            << static_cast<int>(byte);
-      }
-      std::string filename = PerfDataHandler::NameOrMd5Prefix(
-          build_id.filename(), build_id.filename_md5_prefix());
-      auto build_id_it = filename_to_build_id_.find(filename);
-      BuildIdSource build_id_source =
-          build_id.has_is_injected() && build_id.is_injected()
-              ? kBuildIdFilenameInjected
-              : kBuildIdFilename;
-      if (build_id_it != filename_to_build_id_.end() &&
-          build_id_it->second.value != hex.str()) {
-        LOG(WARNING)
-            << "Observed build ID changed for file path " << filename
-            << ": initially saw " << build_id_it->second.value << ", now saw "
-            << hex.str() << std::hex << " (pid=0x" << build_id.pid() << ")"
-            << ". In-flight build ID change may lead to wrong symbolization.";
-        build_id_source = kBuildIdFilenameAmbiguous;
-      }
-      filename_to_build_id_[filename] = BuildId(hex.str(), build_id_source);
-
-      switch (build_id.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
-        case quipper::PERF_RECORD_MISC_KERNEL:
-          if (quipper::IsKernelNonModuleName(filename) ||
-              !HasSuffixString(filename, ".ko")) {
-            std::string build_id = hex.str();
-            if (!maybe_kernel_build_id_.empty() &&
-                maybe_kernel_build_id_ != build_id) {
-              LOG(WARNING) << "Multiple kernel buildids found, file name: "
-                           << filename << ", build id: " << build_id
-                           << ". Using the "
-                              "first found buildid: "
-                           << maybe_kernel_build_id_ << ".";
-              break;
-            }
-            LOG(INFO) << "Using the build id found for the file name: "
-                      << filename << ", build id: " << build_id << ".";
-            maybe_kernel_build_id_ = build_id;
-          }
-      }
-    }
+  Normalizer(const PerfDataProto& perf_proto, PerfDataHandler* handler,
+             bool streaming = false)
+      : perf_proto_(perf_proto), handler_(handler), streaming_(streaming) {
+    AddBuildIds();
 
     // We will use LOST_SAMPLE events to count lost samples for perf version
     // 6.1 or newer.
@@ -167,28 +249,39 @@ class Normalizer {
       LOG(WARNING) << "Invalid perf version: " << perf_version;
     }
 
-    uint64_t current_event_index = 0;
-    for (const auto& attr : perf_proto_.file_attrs()) {
-      for (uint64_t id : attr.ids()) {
-        id_to_event_index_[id] = current_event_index;
+    AddAttrIds();
+
+    // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
+    // file_attrs.
+    for (const auto& fa : perf_proto_.file_attrs()) {
+      if (fa.attr().comm_exec()) {
+        has_comm_exec_support_ = true;
+        break;
       }
-      current_event_index++;
     }
 
-    has_spe_auxtrace_ = HasArmSPEAuxtrace(perf_proto_);
-    if (has_spe_auxtrace_) {
-      tid_to_pid_ = TidToPidMapping(perf_proto_);
+    // When streaming, the events are not available up front; the SPE flag
+    // and the tid->pid mapping are instead built up as events arrive.
+    if (!streaming_) {
+      has_spe_auxtrace_ = HasArmSPEAuxtrace(perf_proto_);
+      if (has_spe_auxtrace_) {
+        tid_to_pid_ = TidToPidMapping(perf_proto_);
+      }
     }
   }
 
   Normalizer(const Normalizer&) = delete;
   Normalizer& operator=(const Normalizer&) = delete;
 
-  ~Normalizer() {}
+  ~Normalizer() override {}
 
   // Converts to a protobuf using quipper and then aggregate the results.
   void Normalize();
 
+  // EventStream implementation.
+  void Process(const quipper::PerfDataProto::PerfEvent& event_proto) override;
+  void Finish() override;
+
  private:
   // Using a 32-bit type for the PID values as the max PID value on 64-bit
   // systems is 2^22, see http://man7.org/linux/man-pages/man5/proc.5.html.
@@ -196,8 +289,6 @@ class Normalizer {
   typedef std::unordered_map<uint32_t, const quipper::PerfDataProto_CommEvent*>
       PidToCommMap;
 
-  typedef IntervalMap<const PerfDataHandler::Mapping*> MMapIntervalMap;
-
   // Gets the build ID if the mmap2 event's build_id field exists, otherwise
   // finds the build ID according to the filename from the mmap.
   BuildId GetBuildId(const quipper::PerfDataProto_MMapEvent* mmap);
@@ -213,6 +304,9 @@ class Normalizer {
   void UpdateMapsWithForkEvent(const quipper::PerfDataProto_ForkEvent& fork);
   void LogStats();
 
+  // Dispatches a single event to the handler for its type.
+  void HandleEvent(const quipper::PerfDataProto::PerfEvent& event_proto);
+
   // Handles the sample_event in event_proto (wrapped in the sample context) and
   // call handler_->Sample.
   void HandleSample(PerfDataHandler::SampleContext* context);
@@ -237,13 +331,12 @@ class Normalizer {
 
   // Find the MMAP event which has ip in its address range from pid.  If no
   // mapping is found, returns nullptr.
-  const PerfDataHandler::Mapping* TryLookupInPid(uint32_t pid,
-                                                 uint64_t ip) const;
+  const PerfDataHandler::Mapping* TryLookupInPid(uint32_t pid, uint64_t ip);
 
   // Find the mapping for a given ip given a context; returns nullptr if none
   // can be found.
   const PerfDataHandler::Mapping* GetMappingFromPidAndIP(
-      uint32_t pid, uint64_t ip, quipper::AddressContext context) const;
+      uint32_t pid, uint64_t ip, quipper::AddressContext context);
 
   // Find the main MMAP event for this pid.  If no mapping is found,
   // nullptr is returned.
@@ -253,17 +346,35 @@ class Normalizer {
   // id.  So, if there is only one event, the event index must be 0.
   // Returns the event index corresponding to the id for this sample, or
   // -1 for an error.
+  // When streaming, attr IDs that were read after streaming started are
+  // looked up in perf_proto_ on a miss.
   int64_t GetEventIndexForSample(
-      const quipper::PerfDataProto_SampleEvent& sample) const;
+      const quipper::PerfDataProto_SampleEvent& sample);
+
+  // Adds the build IDs of perf_proto_ from num_build_ids_ on to
+  // filename_to_build_id_.
+  void AddBuildIds();
+
+  // Maps the IDs of each file attr in perf_proto_ to its index.
+  void AddAttrIds();
 
   const quipper::PerfDataProto& perf_proto_;
   PerfDataHandler* handler_;  // unowned.
 
+  // Whether events are passed to Process() rather than read from
+  // perf_proto_.
+  const bool streaming_;
+
   // Mapping we have allocated.
   std::vector<std::unique_ptr<PerfDataHandler::Mapping>> owned_mappings_;
   std::vector<std::unique_ptr<quipper::PerfDataProto_MMapEvent>>
       owned_quipper_mappings_;
 
+  // Copies of the comm events referenced from pid_to_comm_event_ when
+  // streaming, since the streamed events don't outlive Process().
+  std::vector<std::unique_ptr<quipper::PerfDataProto_CommEvent>>
+      owned_comm_events_;
+
   struct FakeMappingKey {
     std::string comm;
     std::string build_id;
@@ -296,7 +407,17 @@ class Normalizer {
   PidToCommMap pid_to_comm_event_;
 
   // pid_to_mmaps maps a pid to all mmap events that correspond to that pid.
-  std::unordered_map<uint32_t, std::unique_ptr<MMapIntervalMap>> pid_to_mmaps_;
+  std::unordered_map<uint32_t, std::unique_ptr<AddressSpace>> pid_to_mmaps_;
+
+  // The entries of pid_to_mmaps_ for the last process looked up and for the
+  // kernel, to skip the hash lookup for consecutive samples of a process.
+  // space is nullptr if unknown.
+  struct CachedAddressSpace {
+    uint32_t pid = 0;
+    const AddressSpace* space = nullptr;
+  };
+  CachedAddressSpace last_address_space_;
+  CachedAddressSpace kernel_address_space_;
 
   // pid_to_executable_mmap maps a pid to mmap that most likely contains the
   // filename of the main executable for that pid.
@@ -309,6 +430,9 @@ class Normalizer {
   // is not available.
   std::unordered_map<std::string, BuildId> filename_to_build_id_;
 
+  // The number of build IDs of perf_proto_ in filename_to_build_id_.
+  int num_build_ids_ = 0;
+
   // maybe_kernel_build_id_ contains a possible kernel build id obtained from a
   // perf proto buildid whose misc bits set to
   // quipper::PERF_RECORD_MISC_CPUMODE_MASK. This is used as a kernel buildid
@@ -331,10 +455,17 @@ class Normalizer {
   // Whether the following auxtrace events contain Arm SPE data.
   bool has_spe_auxtrace_ = false;
 
+  // Whether any of the file attrs has comm_exec set.
+  bool has_comm_exec_support_ = false;
+
   // map from thread ID to process ID. It is used for parsing SPE records into
   // samples.
   std::unordered_map<uint32_t, uint32_t> tid_to_pid_;
 
+  // The batch of SPE records being turned into samples, kept across auxtrace
+  // events to reuse its storage.
+  std::vector<quipper::ArmSpeDecoder::Record> spe_records_;
+
   struct {
     int64_t samples = 0;
     int64_t samples_with_addr = 0;
@@ -351,6 +482,9 @@ class Normalizer {
     int64_t missing_branch_stack_mmap = 0;
 
     int64_t no_event_errors = 0;
+
+    int64_t mapping_lookups = 0;
+    int64_t mapping_cache_hits = 0;
   } stat_;
 };
 
@@ -362,8 +496,9 @@ void Normalizer::UpdateMapsWithForkEvent(
   }
   const auto& it = pid_to_mmaps_.find(fork.ppid());
   if (it != pid_to_mmaps_.end()) {
-    pid_to_mmaps_[fork.pid()] =
-        std::unique_ptr<MMapIntervalMap>(new MMapIntervalMap(*it->second));
+    pid_to_mmaps_[fork.pid()] = it->second->Fork();
+    // The child's previous address space, if any, was just destroyed.
+    last_address_space_ = CachedAddressSpace();
   }
   auto comm_it = pid_to_comm_event_.find(fork.ppid());
   if (comm_it != pid_to_comm_event_.end()) {
@@ -379,93 +514,184 @@ static constexpr char kLostMappingFilename[] = "[lost]";
 static const uint64_t kLostMd5Prefix = quipper::Md5Prefix(kLostMappingFilename);
 
 void Normalizer::Normalize() {
-  // Perf keeps the tracking bits (e.g. comm_exec) in only one of the events'
-  // file_attrs.
-  bool has_comm_exec_support = false;
-  for (const auto& fa : perf_proto_.file_attrs()) {
-    if (fa.attr().comm_exec()) {
-      has_comm_exec_support = true;
-      break;
-    }
-  }
   for (const auto& event_proto : perf_proto_.events()) {
-    if (event_proto.has_mmap_event()) {
-      UpdateMapsWithMMapEvent(&event_proto.mmap_event());
-      pid_had_any_mmap_.insert(event_proto.mmap_event().pid());
-    } else if (event_proto.has_comm_event()) {
-      PerfDataHandler::CommContext comm_context;
-      if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
-        if (!has_comm_exec_support ||
-            event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
-            pid_had_any_mmap_.find(event_proto.comm_event().pid()) ==
-                pid_had_any_mmap_.end()) {
-          // Based on the perf data collected, comm events (with pid == tid) can
-          // be generated (1) on exec() or (2) when the main thread name is set
-          // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
-          // http://man7.org/linux/man-pages/man2/prctl.2.html).
-          // We want to identify if a comm event (with pid == tid) is due to
-          // exec() (the first case) and erase the pid to executable mapping in
-          // |pid_to_executable_mmap_| if so.
-          // One way to know that comm event is due to exec() is to check if the
-          // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
-          // bit is only set in newer kernels (>= 3.16) and for execs that
-          // happen after perf collection start. Thus, we need to have some
-          // heuristics to cover other cases and identify possible comm events
-          // that happen due to exec().
-          // Another way is to find the contrary scenario for the second case.
-          // Commonly found patterns of comm events on setting the main thread
-          // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
-          // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
-          // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
-          // for a pid before a comm event, this comm event is due to setting
-          // the main thread name. Vice versa, if the mmap event is not yet
-          // found for the pid, it is very likely this comm event happens due
-          // to exec() and |pid_to_executable_mmap_| should be erased.
-          // Also note that for older kernels (< 3.16), where the comm_exec
-          // in perf file attribute is not set, we will erase the mapping in
-          // |pid_to_executable_mmap_| at the occurrence of a comm event.
-          // Thus we have the following heuristics:
-          // The pid to executable mapping in |pid_to_executable_mmap_| is
-          // erased when either one of the following is true (1) comm_exec in
-          // perf file attribute is not set (kernel < 3.16) (2) comm_event's
-          // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
-          // exec() happened, (3) no mmap event for this pid has been found,
-          // meaning this is the first comm event after an exec().
-          pid_to_executable_mmap_.erase(event_proto.comm_event().pid());
-          // is_exec is true if the comm event happened due to exec(), this flag
-          // is passed to perf_data_converter and used to modify PerPidInfo.
-          comm_context.is_exec = true;
+    HandleEvent(event_proto);
+  }
+
+  LogStats();
+  handler_->Finish();
+}
+
+void Normalizer::AddBuildIds() {
+  for (int index = num_build_ids_; index < perf_proto_.build_ids_size();
+       ++index) {
+    const auto& build_id = perf_proto_.build_ids(index);
+    const std::string& bytes = build_id.build_id_hash();
+    std::stringstream hex;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+      // The char must be turned into an int to be used by stringstream;
+      // however, if the byte's value -8 it should be turned to 0x00f8 as an
+      // int, not 0xfff8. This cast solves this problem.
+      const auto& byte = static_cast<unsigned char>(bytes[i]);
+      hex << std::hex << std::setfill('0') << std::setw(2)
+          << static_cast<int>(byte);
+    }
+    std::string filename = PerfDataHandler::NameOrMd5Prefix(
+        build_id.filename(), build_id.filename_md5_prefix());
+    auto build_id_it = filename_to_build_id_.find(filename);
+    BuildIdSource build_id_source =
+        build_id.has_is_injected() && build_id.is_injected()
+            ? kBuildIdFilenameInjected
+            : kBuildIdFilename;
+    if (build_id_it != filename_to_build_id_.end() &&
+        build_id_it->second.value != hex.str()) {
+      LOG(WARNING)
+          << "Observed build ID changed for file path " << filename
+          << ": initially saw " << build_id_it->second.value << ", now saw "
+          << hex.str() << std::hex << " (pid=0x" << build_id.pid() << ")"
+          << ". In-flight build ID change may lead to wrong symbolization.";
+      build_id_source = kBuildIdFilenameAmbiguous;
+    }
+    filename_to_build_id_[filename] = BuildId(hex.str(), build_id_source);
+
+    switch (build_id.misc() & quipper::PERF_RECORD_MISC_CPUMODE_MASK) {
+      case quipper::PERF_RECORD_MISC_KERNEL:
+        if (quipper::IsKernelNonModuleName(filename) ||
+            !HasSuffixString(filename, ".ko")) {
+          std::string build_id = hex.str();
+          if (!maybe_kernel_build_id_.empty() &&
+              maybe_kernel_build_id_ != build_id) {
+            LOG(WARNING) << "Multiple kernel buildids found, file name: "
+                         << filename << ", build id: " << build_id
+                         << ". Using the "
+                            "first found buildid: "
+                         << maybe_kernel_build_id_ << ".";
+            break;
+          }
+          LOG(INFO) << "Using the build id found for the file name: "
+                    << filename << ", build id: " << build_id << ".";
+          maybe_kernel_build_id_ = build_id;
         }
-        pid_to_comm_event_[event_proto.comm_event().pid()] =
-            &event_proto.comm_event();
-      }
-      comm_context.comm = &event_proto.comm_event();
-      handler_->Comm(comm_context);
-    } else if (event_proto.has_fork_event()) {
-      UpdateMapsWithForkEvent(event_proto.fork_event());
-    } else if (event_proto.has_cgroup_event()) {
-      const auto& cgroup = event_proto.cgroup_event();
-      cgroup_map_.insert({cgroup.id(), cgroup.path()});
-    } else if (event_proto.has_lost_samples_event() ||
-               event_proto.has_lost_event()) {
-      HandleLost(event_proto);
-    } else if (event_proto.has_sample_event()) {
-      PerfDataHandler::SampleContext sample_context(event_proto.header(),
-                                                    event_proto.sample_event());
-      HandleSample(&sample_context);
-    } else if (event_proto.has_auxtrace_event()) {
-      if (has_spe_auxtrace_) {
-        HandleSpeAuxtrace(event_proto);
-      }
-    } else if (event_proto.has_auxtrace_error_event()) {
-      LOG(WARNING) << "auxtrace_error event: "
-                   << event_proto.auxtrace_error_event().msg();
-    } else if (event_proto.has_ksymbol_event()) {
-      HandleKsymbol(event_proto);
     }
   }
+  num_build_ids_ = perf_proto_.build_ids_size();
+}
+
+void Normalizer::AddAttrIds() {
+  uint64_t current_event_index = 0;
+  for (const auto& attr : perf_proto_.file_attrs()) {
+    for (uint64_t id : attr.ids()) {
+      id_to_event_index_[id] = current_event_index;
+    }
+    current_event_index++;
+  }
+}
 
+void Normalizer::Process(const quipper::PerfDataProto::PerfEvent& event_proto) {
+  if (event_proto.has_auxtrace_info_event() &&
+      event_proto.auxtrace_info_event().type() ==
+          quipper::PERF_AUXTRACE_ARM_SPE) {
+    has_spe_auxtrace_ = true;
+  }
+  if (event_proto.has_fork_event()) {
+    const auto& fork = event_proto.fork_event();
+    tid_to_pid_[fork.tid()] = fork.pid();
+  } else if (event_proto.has_comm_event()) {
+    const auto& comm = event_proto.comm_event();
+    tid_to_pid_[comm.tid()] = comm.pid();
+  }
+  // Build IDs may be read after streaming started, e.g. from the
+  // PERF_RECORD_HEADER_BUILD_ID events of piped data.
+  if (perf_proto_.build_ids_size() > num_build_ids_) AddBuildIds();
+  HandleEvent(event_proto);
+}
+
+void Normalizer::Finish() {
   LogStats();
+  handler_->Finish();
+}
+
+void Normalizer::HandleEvent(
+    const quipper::PerfDataProto::PerfEvent& event_proto) {
+  if (event_proto.has_mmap_event()) {
+    UpdateMapsWithMMapEvent(&event_proto.mmap_event());
+    pid_had_any_mmap_.insert(event_proto.mmap_event().pid());
+  } else if (event_proto.has_comm_event()) {
+    PerfDataHandler::CommContext comm_context;
+    if (event_proto.comm_event().pid() == event_proto.comm_event().tid()) {
+      if (!has_comm_exec_support_ ||
+          event_proto.header().misc() & quipper::PERF_RECORD_MISC_COMM_EXEC ||
+          pid_had_any_mmap_.find(event_proto.comm_event().pid()) ==
+              pid_had_any_mmap_.end()) {
+        // Based on the perf data collected, comm events (with pid == tid) can
+        // be generated (1) on exec() or (2) when the main thread name is set
+        // after exec (generating another COMM EVENT, e.g. using PR_SET_NAME
+        // http://man7.org/linux/man-pages/man2/prctl.2.html).
+        // We want to identify if a comm event (with pid == tid) is due to
+        // exec() (the first case) and erase the pid to executable mapping in
+        // |pid_to_executable_mmap_| if so.
+        // One way to know that comm event is due to exec() is to check if the
+        // misc bit is set to PERF_RECORD_MISC_COMM_EXEC. However, this misc
+        // bit is only set in newer kernels (>= 3.16) and for execs that
+        // happen after perf collection start. Thus, we need to have some
+        // heuristics to cover other cases and identify possible comm events
+        // that happen due to exec().
+        // Another way is to find the contrary scenario for the second case.
+        // Commonly found patterns of comm events on setting the main thread
+        // name can look like this: FORK EVENT -> COMM EVENT (on exec()) ->
+        // MMAP EVENTs -> SAMPLE EVENTs -> COMM EVENT (on setting main thread
+        // name) -> SAMPLE EVENTs ... Thus, if a mmap event is already found
+        // for a pid before a comm event, this comm event is due to setting
+        // the main thread name. Vice versa, if the mmap event is not yet
+        // found for the pid, it is very likely this comm event happens due
+        // to exec() and |pid_to_executable_mmap_| should be erased.
+        // Also note that for older kernels (< 3.16), where the comm_exec
+        // in perf file attribute is not set, we will erase the mapping in
+        // |pid_to_executable_mmap_| at the occurrence of a comm event.
+        // Thus we have the following heuristics:
+        // The pid to executable mapping in |pid_to_executable_mmap_| is
+        // erased when either one of the following is true (1) comm_exec in
+        // perf file attribute is not set (kernel < 3.16) (2) comm_event's
+        // PERF_RECORD_MISC_COMM_EXEC misc bit is set in header, meaning an
+        // exec() happened, (3) no mmap event for this pid has been found,
+        // meaning this is the first comm event after an exec().
+        pid_to_executable_mmap_.erase(event_proto.comm_event().pid());
+        // is_exec is true if the comm event happened due to exec(), this flag
+        // is passed to perf_data_converter and used to modify PerPidInfo.
+        comm_context.is_exec = true;
+      }
+      const quipper::PerfDataProto_CommEvent* comm = &event_proto.comm_event();
+      if (streaming_) {
+        owned_comm_events_.emplace_back(
+            new quipper::PerfDataProto_CommEvent(*comm));
+        comm = owned_comm_events_.back().get();
+      }
+      pid_to_comm_event_[event_proto.comm_event().pid()] = comm;
+    }
+    comm_context.comm = &event_proto.comm_event();
+    handler_->Comm(comm_context);
+  } else if (event_proto.has_fork_event()) {
+    UpdateMapsWithForkEvent(event_proto.fork_event());
+  } else if (event_proto.has_cgroup_event()) {
+    const auto& cgroup = event_proto.cgroup_event();
+    cgroup_map_.insert({cgroup.id(), cgroup.path()});
+  } else if (event_proto.has_lost_samples_event() ||
+             event_proto.has_lost_event()) {
+    HandleLost(event_proto);
+  } else if (event_proto.has_sample_event()) {
+    PerfDataHandler::SampleContext sample_context(event_proto.header(),
+                                                  event_proto.sample_event());
+    HandleSample(&sample_context);
+  } else if (event_proto.has_auxtrace_event()) {
+    if (has_spe_auxtrace_) {
+      HandleSpeAuxtrace(event_proto);
+    }
+  } else if (event_proto.has_auxtrace_error_event()) {
+    LOG(WARNING) << "auxtrace_error event: "
+                 << event_proto.auxtrace_error_event().msg();
+  } else if (event_proto.has_ksymbol_event()) {
+    HandleKsymbol(event_proto);
+  }
 }
 
 void Normalizer::HandleSample(PerfDataHandler::SampleContext* context) {
@@ -702,6 +928,8 @@ void Normalizer::LogStats() {
             "missing_branch_stack_mmap");
   CheckStat(stat_.missing_pid, stat_.samples, "missing_pid");
   CheckStat(stat_.no_event_errors, 1, "unknown event id");
+  VLOG(1) << "stat: mapping_cache_hits " << stat_.mapping_cache_hits << "/"
+          << stat_.mapping_lookups;
 }
 
 // IsSameBuildId returns true iff build ID is a prefix of the other AND the rest
@@ -782,13 +1010,13 @@ void Normalizer::UpdateMapsWithMMapEvent(
     return;
   }
   uint32_t pid = mmap->pid();
-  MMapIntervalMap* interval_map = nullptr;
+  AddressSpace* address_space = nullptr;
   const auto& it = pid_to_mmaps_.find(pid);
   if (it == pid_to_mmaps_.end()) {
-    interval_map = new MMapIntervalMap;
-    pid_to_mmaps_[pid] = std::unique_ptr<MMapIntervalMap>(interval_map);
+    address_space = new AddressSpace;
+    pid_to_mmaps_[pid] = std::unique_ptr<AddressSpace>(address_space);
   } else {
-    interval_map = it->second.get();
+    address_space = it->second.get();
   }
 
   PerfDataHandler::Mapping* mapping = new PerfDataHandler::Mapping(
@@ -809,22 +1037,15 @@ void Normalizer::UpdateMapsWithMMapEvent(
     mapping->start = mapping->file_offset - mapping->file_offset % 4096;
   }
 
-  interval_map->Set(mapping->start, mapping->limit, mapping);
-  // Pass the final mapping through to the subclass also.
-  PerfDataHandler::MMapContext mmap_context;
-  mmap_context.pid = pid;
-  mmap_context.mapping = mapping;
-  handler_->MMap(mmap_context);
+  address_space->Set(mapping->start, mapping->limit, mapping);
 
   // Main executables are usually loaded at 0x8048000 or 0x400000.
   // If we ever see an MMAP starting at one of those locations, that should be
   // our guess.
   // This is true even if the old MMAP started at one of the locations, because
   // the pid may have been recycled since then (so newer is better).
-  if (mapping->start == 0x8048000 || mapping->start == 0x400000) {
-    pid_to_executable_mmap_[pid] = mapping;
-    return;
-  }
+  const bool at_executable_start =
+      mapping->start == 0x8048000 || mapping->start == 0x400000;
   // Figure out whether this MMAP is the main executable.
   // If there have been no previous MMAPs for this pid, then this MMAP is our
   // best guess.
@@ -832,12 +1053,27 @@ void Normalizer::UpdateMapsWithMMapEvent(
   PerfDataHandler::Mapping* old_mapping =
       old_mapping_it == pid_to_executable_mmap_.end() ? nullptr
                                                       : old_mapping_it->second;
+  // Hugepages remap the main binary, but the original mapping loses its name,
+  // so we have this hack. The subclass is told before the rename.
+  const bool renames_old_mapping =
+      !at_executable_start && old_mapping != nullptr &&
+      old_mapping->start == 0x400000 && old_mapping->filename.empty() &&
+      mapping->start - mapping->file_offset == 0x400000;
+
+  // Pass the final mapping through to the subclass also.
+  PerfDataHandler::MMapContext mmap_context;
+  mmap_context.pid = pid;
+  mmap_context.mapping = mapping;
+  if (renames_old_mapping) {
+    mmap_context.renamed_mapping = old_mapping;
+  }
+  handler_->MMap(mmap_context);
 
-  if (old_mapping != nullptr && old_mapping->start == 0x400000 &&
-      old_mapping->filename.empty() &&
-      mapping->start - mapping->file_offset == 0x400000) {
-    // Hugepages remap the main binary, but the original mapping loses
-    // its name, so we have this hack.
+  if (at_executable_start) {
+    pid_to_executable_mmap_[pid] = mapping;
+    return;
+  }
+  if (renames_old_mapping) {
     old_mapping->filename = mmap->filename();
   }
 
@@ -873,16 +1109,23 @@ void Normalizer::UpdateMapsWithMMapEvent(
 }
 
 const PerfDataHandler::Mapping* Normalizer::TryLookupInPid(uint32_t pid,
-                                                           uint64_t ip) const {
-  const auto& it = pid_to_mmaps_.find(pid);
-  if (it == pid_to_mmaps_.end()) {
-    VLOG(2) << "No mmaps for pid " << pid;
-    return nullptr;
+                                                           uint64_t ip) {
+  CachedAddressSpace& cached =
+      pid == kKernelPid ? kernel_address_space_ : last_address_space_;
+  if (cached.space == nullptr || cached.pid != pid) {
+    const auto& it = pid_to_mmaps_.find(pid);
+    if (it == pid_to_mmaps_.end()) {
+      VLOG(2) << "No mmaps for pid " << pid;
+      return nullptr;
+    }
+    cached.pid = pid;
+    cached.space = it->second.get();
   }
-  MMapIntervalMap* mmaps = it->second.get();
-
-  const PerfDataHandler::Mapping* mapping = nullptr;
-  mmaps->Lookup(ip, &mapping);
+  bool cache_hit = false;
+  const PerfDataHandler::Mapping* mapping =
+      cached.space->Lookup(ip, &cache_hit);
+  ++stat_.mapping_lookups;
+  stat_.mapping_cache_hits += cache_hit;
   return mapping;
 }
 
@@ -891,7 +1134,7 @@ const PerfDataHandler::Mapping* Normalizer::TryLookupInPid(uint32_t pid,
 // stored in our map as pid = -1), so check there if the lookup fails
 // in our process.
 const PerfDataHandler::Mapping* Normalizer::GetMappingFromPidAndIP(
-    uint32_t pid, uint64_t ip, quipper::AddressContext context) const {
+    uint32_t pid, uint64_t ip, quipper::AddressContext context) {
   if (ip >> 60 == 0x8) {
     // In case the highest 4 bits of ip is 1000, it has a null mapping. See
     // the comment mentioning "highest 4 bits" in perf_parser.cc for details.
@@ -934,7 +1177,7 @@ const PerfDataHandler::Mapping* Normalizer::GetMainMMapFromPid(
 }
 
 int64_t Normalizer::GetEventIndexForSample(
-    const quipper::PerfDataProto_SampleEvent& sample) const {
+    const quipper::PerfDataProto_SampleEvent& sample) {
   if (perf_proto_.file_attrs().size() == 1) {
     return 0;
   }
@@ -945,6 +1188,10 @@ int64_t Normalizer::GetEventIndexForSample(
   }
 
   auto it = id_to_event_index_.find(sample.id());
+  if (it == id_to_event_index_.end() && streaming_) {
+    AddAttrIds();
+    it = id_to_event_index_.find(sample.id());
+  }
   if (it == id_to_event_index_.end()) {
     LOG(ERROR) << "Incorrect event id: " << sample.id();
     return -1;
@@ -960,32 +1207,43 @@ void Normalizer::HandleSpeAuxtrace(
     return;
   }
 
-  quipper::ArmSpeDecoder::Record record;
+  // The records are decoded in batches, and their samples are synthesized in
+  // a single event, whose fields are all overwritten for each record.
+  constexpr size_t kSpeRecordBatchSize = 256;
+  quipper::PerfDataProto::PerfEvent sample_event;
+  auto& sample = *sample_event.mutable_sample_event();
+  // Consecutive records tend to come from the same thread.
+  uint32_t last_tid = 0;
+  uint32_t last_pid = 0;
   quipper::ArmSpeDecoder decoder(auxtrace_event.trace_data(), false);
-  while (decoder.NextRecord(&record)) {
-    // Synthesize a perf data sample with from the SPE record.
-    uint32_t tid = record.context.id;
-    uint32_t pid = 0;
-    if (tid != 0) {
-      auto pid_it = tid_to_pid_.find(tid);
-      if (pid_it == tid_to_pid_.end()) {
-        stat_.missing_pid++;
-        LOG(WARNING) << "tid->pid mapping does not contain tid " << tid;
-      } else {
-        pid = pid_it->second;
+  while (decoder.NextRecords(kSpeRecordBatchSize, &spe_records_)) {
+    for (const auto& record : spe_records_) {
+      // Synthesize a perf data sample with from the SPE record.
+      uint32_t tid = record.context.id;
+      uint32_t pid = 0;
+      if (tid != 0 && tid == last_tid) {
+        pid = last_pid;
+      } else if (tid != 0) {
+        auto pid_it = tid_to_pid_.find(tid);
+        if (pid_it == tid_to_pid_.end()) {
+          stat_.missing_pid++;
+          LOG(WARNING) << "tid->pid mapping does not contain tid " << tid;
+        } else {
+          pid = pid_it->second;
+          last_tid = tid;
+          last_pid = pid;
+        }
       }
-    }
 
-    quipper::PerfDataProto::PerfEvent event_proto;
-    auto& sample = *event_proto.mutable_sample_event();
-    sample.set_tid(tid);
-    sample.set_pid(pid);
-    sample.set_ip(record.ip.addr);
+      sample.set_tid(tid);
+      sample.set_pid(pid);
+      sample.set_ip(record.ip.addr);
 
-    PerfDataHandler::SampleContext context(event_proto.header(), sample);
-    context.spe.is_spe = true;
-    context.spe.record = record;
-    HandleSample(&context);
+      PerfDataHandler::SampleContext context(sample_event.header(), sample);
+      context.spe.is_spe = true;
+      context.spe.record = record;
+      HandleSample(&context);
+    }
   }
 }
 
@@ -1037,6 +1295,12 @@ void PerfDataHandler::Process(const quipper::PerfDataProto& perf_proto,
   return Normalizer.Normalize();
 }
 
+std::unique_ptr<PerfDataHandler::EventStream> PerfDataHandler::StartStreaming(
+    const quipper::PerfDataProto& perf_proto, PerfDataHandler* handler) {
+  return std::unique_ptr<EventStream>(
+      new Normalizer(perf_proto, handler, /*streaming=*/true));
+}
+
 std::string PerfDataHandler::NameOrMd5Prefix(std::string name,
                                              uint64_t md5_prefix) {
   if (name.empty()) {
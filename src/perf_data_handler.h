@@ -8,6 +8,7 @@
 #ifndef PERFTOOLS_PERF_DATA_HANDLER_H_
 #define PERFTOOLS_PERF_DATA_HANDLER_H_
 
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -183,6 +184,10 @@ class PerfDataHandler {
     const PerfDataHandler::Mapping* mapping;
     // The process id used as a key to pid_to_mmaps_.
     uint32_t pid;
+    // If not null, the main mapping of the process, which is given the name
+    // of |mapping| right after this callback because |mapping| is a huge page
+    // remapping of it.
+    const PerfDataHandler::Mapping* renamed_mapping = nullptr;
   };
 
   PerfDataHandler(const PerfDataHandler&) = delete;
@@ -193,6 +198,30 @@ class PerfDataHandler {
   static void Process(const quipper::PerfDataProto& perf_proto,
                       PerfDataHandler* handler);
 
+  // EventStream normalizes events one at a time, as they are decoded, instead
+  // of walking PerfDataProto.events(). See StartStreaming().
+  class EventStream {
+   public:
+    virtual ~EventStream() {}
+
+    // Normalizes a single event and calls the handler for it. The event only
+    // needs to remain valid for the duration of the call.
+    virtual void Process(const quipper::PerfDataProto::PerfEvent& event) = 0;
+
+    // Called once after the last event has been processed.
+    virtual void Finish() = 0;
+  };
+
+  // StartStreaming is the streaming counterpart of Process(). The metadata of
+  // perf_proto (file attrs, build IDs, etc.) is read when the stream is
+  // created; its events are ignored and are instead fed through the returned
+  // stream, in the order in which they should be processed. Unlike Process(),
+  // which maps the threads of the whole input to their PIDs up front, Arm SPE
+  // records are only matched against the threads of the events streamed
+  // before them. perf_proto and handler must outlive the returned stream.
+  static std::unique_ptr<EventStream> StartStreaming(
+      const quipper::PerfDataProto& perf_proto, PerfDataHandler* handler);
+
   // Returns name string if it's non empty or hex string of md5_prefix.
   static std::string NameOrMd5Prefix(std::string name, uint64_t md5_prefix);
 
@@ -210,6 +239,9 @@ class PerfDataHandler {
   virtual void Comm(const CommContext& comm) = 0;
   // Called for every mmap event.
   virtual void MMap(const MMapContext& mmap) = 0;
+  // Called once after the last event, while the mappings passed to the other
+  // callbacks are still valid.
+  virtual void Finish() {}
 
  protected:
   PerfDataHandler();
@@ -127,6 +127,9 @@ class TestPerfDataHandler : public PerfDataHandler {
   }
   void Comm(const CommContext& comm) override {}
   void MMap(const MMapContext& mmap) override {
+    if (mmap.renamed_mapping != nullptr) {
+      renamed_mappings_.push_back(mmap.renamed_mapping->start);
+    }
     std::string actual_build_id = mmap.mapping->build_id.value;
     std::string actual_filename = mmap.mapping->filename;
     const auto expected_build_id_it =
@@ -167,6 +170,11 @@ class TestPerfDataHandler : public PerfDataHandler {
     return seen_arm_spe_records_;
   }
 
+  // The starts of the mappings that MMap() was told would be renamed.
+  const std::vector<uint64_t>& RenamedMappings() const {
+    return renamed_mappings_;
+  }
+
  private:
   // Ensure necessary information contained in the BranchStackEntry is also
   // present in the resulting profile.
@@ -186,6 +194,7 @@ class TestPerfDataHandler : public PerfDataHandler {
   std::vector<std::unique_ptr<Mapping>> seen_addr_mappings_;
   std::vector<quipper::PerfDataProto::SampleEvent> seen_sample_events_;
   std::vector<quipper::ArmSpeDecoder::Record> seen_arm_spe_records_;
+  std::vector<uint64_t> renamed_mappings_;
 };
 
 TEST(PerfDataHandlerTest, KernelBuildIdWithDifferentFilename) {
@@ -374,6 +383,109 @@ TEST(PerfDataHandlerTest, AddressMappingIsSet) {
   EXPECT_EQ(0x1000, mapping->file_offset);
 }
 
+TEST(PerfDataHandlerTest, ForkedAddressSpacesDivergeAndLookupsFollowMMaps) {
+  quipper::PerfDataProto proto;
+  uint64_t file_attr_id = 0;
+  proto.add_file_attrs()->add_ids(file_attr_id);
+
+  auto add_mmap = [&proto](uint32_t pid, const std::string& filename,
+                           uint64_t start, uint64_t len) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(pid);
+    mmap_event->set_tid(pid);
+    mmap_event->set_start(start);
+    mmap_event->set_len(len);
+  };
+  auto add_fork = [&proto](uint32_t ppid, uint32_t pid) {
+    auto* fork_event = proto.add_events()->mutable_fork_event();
+    fork_event->set_ppid(ppid);
+    fork_event->set_ptid(ppid);
+    fork_event->set_pid(pid);
+    fork_event->set_tid(pid);
+  };
+  auto add_sample = [&proto, file_attr_id](uint32_t pid, uint64_t addr) {
+    auto* sample_event = proto.add_events()->mutable_sample_event();
+    sample_event->set_ip(1);
+    sample_event->set_pid(pid);
+    sample_event->set_tid(pid);
+    sample_event->set_addr(addr);
+    sample_event->set_period(1);
+    sample_event->set_id(file_attr_id);
+  };
+
+  add_mmap(100, "/a", 0x1000, 0x1000);
+  add_sample(100, 0x1900);  // /a
+  add_sample(100, 0x3100);  // None
+  add_fork(100, 200);
+  // Mappings added after the fork are private to the process adding them.
+  add_mmap(100, "/b", 0x3000, 0x1000);
+  add_mmap(200, "/c", 0x1800, 0x800);
+  // Fork a chain of processes deep enough for the shared mappings to be
+  // flattened, each adding a mapping of its own.
+  for (uint32_t pid = 200; pid < 210; ++pid) {
+    add_fork(pid, pid + 1);
+    add_mmap(pid + 1, "/d" + std::to_string(pid + 1), 0x10000 * pid, 0x1000);
+  }
+  // The lookups above must not be remembered past the mmaps.
+  add_sample(100, 0x1900);  // /a
+  add_sample(100, 0x3100);  // /b
+  add_sample(200, 0x1100);  // /a
+  add_sample(200, 0x1900);  // /c
+  add_sample(200, 0x3100);  // None
+  add_sample(210, 0x1100);  // /a
+  add_sample(210, 0x1900);  // /c
+  add_sample(210, 0x10000 * 205 + 1);  // /d206
+  add_sample(210, 0x10000 * 209 + 1);  // /d210
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  std::vector<std::string> filenames;
+  for (const auto& mapping : handler.SeenAddrMappings()) {
+    filenames.push_back(mapping == nullptr ? "None" : mapping->filename);
+  }
+  EXPECT_THAT(filenames,
+              testing::ElementsAre("/a", "None", "/a", "/b", "/a", "/c", "None",
+                                   "/a", "/c", "/d206", "/d210"));
+}
+
+TEST(PerfDataHandlerTest, HugePageRemappingRenamesMainMapping) {
+  quipper::PerfDataProto proto;
+  uint64_t file_attr_id = 0;
+  proto.add_file_attrs()->add_ids(file_attr_id);
+
+  auto add_mmap = [&proto](const std::string& filename, uint64_t start,
+                           uint64_t len, uint64_t pgoff) {
+    auto* mmap_event = proto.add_events()->mutable_mmap_event();
+    mmap_event->set_filename(filename);
+    mmap_event->set_pid(100);
+    mmap_event->set_tid(100);
+    mmap_event->set_start(start);
+    mmap_event->set_len(len);
+    mmap_event->set_pgoff(pgoff);
+  };
+  // The main binary loses its name when huge pages remap part of it.
+  add_mmap("", 0x400000, 0x200000, 0);
+  add_mmap("/lib/libfoo.so", 0x800000, 0x1000, 0);
+  add_mmap("/usr/bin/app", 0x600000, 0x200000, 0x200000);
+  auto* sample_event = proto.add_events()->mutable_sample_event();
+  sample_event->set_ip(1);
+  sample_event->set_pid(100);
+  sample_event->set_tid(100);
+  sample_event->set_addr(0x400100);
+  sample_event->set_period(1);
+  sample_event->set_id(file_attr_id);
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  EXPECT_THAT(handler.RenamedMappings(), testing::ElementsAre(0x400000));
+  ASSERT_EQ(1, handler.SeenAddrMappings().size());
+  ASSERT_NE(nullptr, handler.SeenAddrMappings()[0]);
+  EXPECT_EQ("/usr/bin/app", handler.SeenAddrMappings()[0]->filename);
+}
+
 TEST(PerfDataHandlerTest, MappingBuildIdAndSourceAreSet) {
   quipper::PerfDataProto proto;
 
@@ -515,29 +627,10 @@ TEST(PerfDataHandlerTest, LostEventsAreHandledInOlderPerf) {
   }
 }
 
-TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
-  quipper::PerfDataProto proto;
-
-  // File attrs are required for sample event processing.
-  uint64_t file_attr_id = 0;
-  auto* file_attr = proto.add_file_attrs();
-  file_attr->add_ids(file_attr_id);
-
-  // Add a fork and a comm events for tid->pid mapping .
-  auto* fork = proto.add_events()->mutable_fork_event();
-  fork->set_tid(0x5f80);
-  fork->set_pid(0x1);
-  auto* comm = proto.add_events()->mutable_comm_event();
-  comm->set_tid(0xe);
-  comm->set_pid(2);
-
-  // Add an auxtrace info event.
-  proto.add_events()->mutable_auxtrace_info_event()->set_type(
-      quipper::PERF_AUXTRACE_ARM_SPE);
-
-  // Add an auxtrace event.
-  auto* auxtrace_event = proto.add_events()->mutable_auxtrace_event();
-  std::string trace_data = quipper::GenerateBinaryTrace({
+// Returns an SPE trace of two records: a load by tid 0x5f80, and a branch
+// by tid 0xe.
+std::string TwoSpeRecordsTrace() {
+  return quipper::GenerateBinaryTrace({
       ///////////////////////////////// record 0
       "b0 d0 c2 a1 ed 66 ba ff c0",  // PC 0xffba66eda1c2d0 el2 ns=1
       "00 00 00 00 00",              // PAD
@@ -564,6 +657,31 @@ TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
       "00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",  // PAD
       "71 8d 65 2f 6a 0a 00 00 00",                       // TS 44731164045
   });
+}
+
+TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
+  quipper::PerfDataProto proto;
+
+  // File attrs are required for sample event processing.
+  uint64_t file_attr_id = 0;
+  auto* file_attr = proto.add_file_attrs();
+  file_attr->add_ids(file_attr_id);
+
+  // Add a fork and a comm events for tid->pid mapping .
+  auto* fork = proto.add_events()->mutable_fork_event();
+  fork->set_tid(0x5f80);
+  fork->set_pid(0x1);
+  auto* comm = proto.add_events()->mutable_comm_event();
+  comm->set_tid(0xe);
+  comm->set_pid(2);
+
+  // Add an auxtrace info event.
+  proto.add_events()->mutable_auxtrace_info_event()->set_type(
+      quipper::PERF_AUXTRACE_ARM_SPE);
+
+  // Add an auxtrace event.
+  auto* auxtrace_event = proto.add_events()->mutable_auxtrace_event();
+  std::string trace_data = TwoSpeRecordsTrace();
   auxtrace_event->set_trace_data(trace_data);
 
   // There record 1 sample is a branch sample, so expecting one branch stack
@@ -593,6 +711,50 @@ TEST(PerfDataHandlerTest, SpeAuxtraceIntoSamples) {
   EXPECT_EQ(spe_records[1].issue_lat, 16);
 }
 
+TEST(PerfDataHandlerTest, StreamedSpeAuxtraceOnlyKnowsEarlierThreads) {
+  quipper::PerfDataProto proto;
+  uint64_t file_attr_id = 0;
+  proto.add_file_attrs()->add_ids(file_attr_id);
+
+  auto* fork = proto.add_events()->mutable_fork_event();
+  fork->set_tid(0x5f80);
+  fork->set_pid(0x1);
+  proto.add_events()->mutable_auxtrace_info_event()->set_type(
+      quipper::PERF_AUXTRACE_ARM_SPE);
+  proto.add_events()->mutable_auxtrace_event()->set_trace_data(
+      TwoSpeRecordsTrace());
+  // The comm of the thread of the second record comes after its record.
+  auto* comm = proto.add_events()->mutable_comm_event();
+  comm->set_tid(0xe);
+  comm->set_pid(2);
+
+  TestPerfDataHandler handler({},
+                              std::unordered_map<std::string, std::string>{});
+  PerfDataHandler::Process(proto, &handler);
+  TestPerfDataHandler streamed_handler(
+      {}, std::unordered_map<std::string, std::string>{});
+  auto stream = PerfDataHandler::StartStreaming(proto, &streamed_handler);
+  for (const auto& event : proto.events()) {
+    stream->Process(event);
+  }
+  stream->Finish();
+
+  // In memory, the threads of the whole input are known up front. A stream
+  // only knows the threads of the events before the SPE records.
+  const auto& samples = handler.SeenSampleEvents();
+  ASSERT_EQ(2, samples.size());
+  EXPECT_EQ(1, samples[0].pid());
+  EXPECT_EQ(2, samples[1].pid());
+  const auto& streamed_samples = streamed_handler.SeenSampleEvents();
+  ASSERT_EQ(2, streamed_samples.size());
+  EXPECT_EQ(1, streamed_samples[0].pid());
+  EXPECT_EQ(0, streamed_samples[1].pid());
+  for (size_t i = 0; i < samples.size(); ++i) {
+    EXPECT_EQ(samples[i].tid(), streamed_samples[i].tid());
+    EXPECT_EQ(samples[i].ip(), streamed_samples[i].ip());
+  }
+}
+
 TEST(PerfDataHandlerTest, KsymbolIntoMappings) {
   quipper::PerfDataProto proto;
   std::string mock_filename = "bpf_prog_bec4c5629f7c7e2d_netcg_bind4";
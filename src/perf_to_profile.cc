@@ -7,14 +7,72 @@
 
 #include "src/perf_to_profile_lib.h"
 
+#include <chrono>
+#include <ctime>
+#include <iostream>
+
 #include "src/quipper/base/logging.h"
 #include "src/perf_data_converter.h"
 
+namespace {
+
+// Converts the inputs of a batch, and prints the status and timing of each.
+// Returns whether all of them were converted.
+bool RunBatch(const BatchArguments& args) {
+  std::vector<std::string> inputs;
+  if (!ListBatchInputs(args.inputs, &inputs)) {
+    return false;
+  }
+  std::map<std::string, std::string> build_ids;
+  if (!args.build_id_map.empty() &&
+      !ReadBuildIdMap(args.build_id_map, &build_ids)) {
+    return false;
+  }
+  uint32_t options = perftools::kNoOptions;
+  if (args.allow_unaligned_jit_mappings) {
+    options |= perftools::ConversionOptions::kAllowUnalignedJitMappings;
+  }
+  const auto results =
+      ConvertBatch(inputs, args.output_dir, build_ids, perftools::kNoLabels,
+                   options, args.overwrite_output, args.num_threads);
+  size_t num_failed = 0;
+  for (const auto& result : results) {
+    if (result.ok) {
+      std::cout << "OK\t" << result.seconds << "s\t" << result.input << "\t"
+                << result.output << std::endl;
+    } else {
+      ++num_failed;
+      std::cout << "FAILED\t" << result.seconds << "s\t" << result.input
+                << "\t" << result.error << std::endl;
+    }
+  }
+  LOG(INFO) << "Converted " << results.size() - num_failed << " of "
+            << results.size() << " inputs";
+  return num_failed == 0;
+}
+
+}  // namespace
+
 int main(int argc, char** argv) {
-  std::string input, output;
+  const bool print_stats =
+      TakeStatsFlag(&argc, const_cast<const char**>(argv));
+  if (IsBatchInvocation(argc, const_cast<const char**>(argv))) {
+    if (print_stats) {
+      LOG(WARNING) << "--stats only applies to the conversion of one input";
+    }
+    BatchArguments args;
+    if (!ParseBatchArguments(argc, const_cast<const char**>(argv), &args)) {
+      PrintUsage();
+      return EXIT_FAILURE;
+    }
+    return RunBatch(args) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  std::vector<std::string> inputs;
+  std::string output;
   bool overwriteOutput = false;
   bool allowUnalignedJitMappings = false;
-  if (!ParseArguments(argc, const_cast<const char**>(argv), &input, &output,
+  if (!ParseArguments(argc, const_cast<const char**>(argv), &inputs, &output,
                       &overwriteOutput, &allowUnalignedJitMappings)) {
     PrintUsage();
     return EXIT_FAILURE;
@@ -24,8 +82,18 @@ int main(int argc, char** argv) {
   if (allowUnalignedJitMappings) {
     options |= perftools::ConversionOptions::kAllowUnalignedJitMappings;
   }
-  std::string data = ReadFileToString(input);
-  const auto profiles = StringToProfiles(data, perftools::kNoLabels, options);
+  perftools::ConversionStats stats;
+  if (print_stats && inputs.size() > 1) {
+    LOG(WARNING) << "--stats only applies to the conversion of one input";
+  }
+  // A single input is decoded by all the CPUs.
+  perftools::ConversionThreads threads;
+  threads.decode_threads = 0;
+  const auto profiles =
+      inputs.size() == 1
+          ? FileToProfiles(inputs[0], perftools::kNoLabels, options,
+                           print_stats ? &stats : nullptr, threads)
+          : FilesToProfiles(inputs, perftools::kNoLabels, options);
 
   // With kNoOptions, all of the PID profiles should be merged into a
   // single one.
@@ -33,8 +101,22 @@ int main(int argc, char** argv) {
     LOG(FATAL) << "Expected profile vector to have one element.";
   }
   const auto& profile = profiles[0]->data;
+  const auto write_start = std::chrono::steady_clock::now();
+  const std::clock_t write_cpu_start = std::clock();
   std::ofstream outFile;
   CreateFile(output, &outFile, overwriteOutput);
   profile.SerializeToOstream(&outFile);
+  outFile.close();
+  if (print_stats && inputs.size() == 1) {
+    perftools::ConversionStats::Phase write;
+    write.name = "write";
+    write.wall_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - write_start)
+                             .count();
+    write.cpu_seconds =
+        static_cast<double>(std::clock() - write_cpu_start) / CLOCKS_PER_SEC;
+    stats.phases.push_back(write);
+    std::cout << stats.ToString();
+  }
   return EXIT_SUCCESS;
 }
@@ -7,8 +7,19 @@
 
 #include "src/perf_to_profile_lib.h"
 
+#include <dirent.h>
+#include <glob.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <set>
 #include <sstream>
+#include <thread>
+
+#include "src/quipper/mmap_reader.h"
 
 bool FileExists(const std::string& path) {
   struct stat file_stat;
@@ -25,18 +36,292 @@ std::string ReadFileToString(const std::string& path) {
   return ss.str();
 }
 
-perftools::ProcessProfiles StringToProfiles(const std::string& data,
-                                            uint32_t sample_labels,
-                                            uint32_t options) {
+namespace {
+
+// The contents of an input file. Regular files are memory mapped and parsed in
+// place; anything that can't be mapped, like pipes, FIFOs and /dev/stdin, is
+// read into memory instead.
+class InputFile {
+ public:
+  explicit InputFile(const std::string& path) : mapping_(path) {
+    if (mapping_.IsOpen()) {
+      is_open_ = true;
+      return;
+    }
+    std::ifstream file(path);
+    if (!file.is_open()) {
+      return;
+    }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    contents_ = ss.str();
+    is_open_ = true;
+  }
+
+  bool IsOpen() const { return is_open_; }
+  const char* data() const {
+    return mapping_.IsOpen() ? mapping_.data() : contents_.data();
+  }
+  size_t size() const {
+    return mapping_.IsOpen() ? mapping_.size() : contents_.size();
+  }
+
+ private:
+  quipper::MmapReader mapping_;
+  std::string contents_;
+  bool is_open_ = false;
+
+  InputFile(const InputFile&) = delete;
+  InputFile& operator=(const InputFile&) = delete;
+};
+
+// Converts |data| as a PerfDataProto if it parses as one, and as raw perf.data
+// otherwise. The |build_ids| are only used for raw perf.data.
+perftools::ProcessProfiles BufferToProfiles(
+    const char* data, size_t size,
+    const std::map<std::string, std::string>& build_ids,
+    uint32_t sample_labels, uint32_t options,
+    perftools::ConversionStats* stats = nullptr,
+    const perftools::ConversionThreads& threads = {}) {
   // Try to parse it as a PerfDataProto.
   quipper::PerfDataProto perf_data_proto;
-  if (perf_data_proto.ParseFromArray(data.data(), data.length())) {
-    return perftools::PerfDataProtoToProfiles(&perf_data_proto, sample_labels,
-                                              options);
+  if (perf_data_proto.ParseFromArray(data, size)) {
+    auto profiles = perftools::PerfDataProtoToProfiles(
+        &perf_data_proto, sample_labels, options, {}, stats, threads);
+    if (stats != nullptr) {
+      stats->input_bytes = size;
+    }
+    return profiles;
   }
   // Fallback to reading input as a perf.data file.
-  return perftools::RawPerfDataToProfiles(data.data(), data.length(), {},
-                                          sample_labels, options);
+  return perftools::RawPerfDataToProfiles(
+      data, size, build_ids, sample_labels, options, {}, stats, threads);
+}
+
+}  // namespace
+
+perftools::ProcessProfiles StringToProfiles(const std::string& data,
+                                            uint32_t sample_labels,
+                                            uint32_t options) {
+  return BufferToProfiles(data.data(), data.length(), {}, sample_labels,
+                          options);
+}
+
+namespace {
+
+// Converts the file at |input| into a profile written to |output|, and returns
+// the reason if it fails.
+std::string ConvertFile(const std::string& input, const std::string& output,
+                        const std::map<std::string, std::string>& build_ids,
+                        uint32_t sample_labels, uint32_t options,
+                        bool overwrite_output) {
+  if (!overwrite_output && FileExists(output)) {
+    return "output already exists";
+  }
+  InputFile reader(input);
+  if (!reader.IsOpen()) {
+    return "failed to open input";
+  }
+  // The batch already converts one input per thread, so each input is
+  // converted by a single thread.
+  const perftools::ProcessProfiles profiles =
+      BufferToProfiles(reader.data(), reader.size(), build_ids, sample_labels,
+                       options, nullptr, perftools::ConversionThreads());
+  if (profiles.size() != 1) {
+    return profiles.empty() ? "failed to convert input"
+                            : "expected one profile, got " +
+                                  std::to_string(profiles.size());
+  }
+  std::ofstream file(output, std::ios_base::trunc);
+  if (!file.is_open()) {
+    return "failed to open output";
+  }
+  if (!profiles[0]->data.SerializeToOstream(&file)) {
+    return "failed to write output";
+  }
+  return "";
+}
+
+}  // namespace
+
+bool ListBatchInputs(const std::string& source,
+                     std::vector<std::string>* inputs) {
+  inputs->clear();
+  struct stat source_stat;
+  if (stat(source.c_str(), &source_stat) == 0 && S_ISDIR(source_stat.st_mode)) {
+    DIR* dir = opendir(source.c_str());
+    if (dir == nullptr) {
+      PLOG(ERROR) << "Failed to open directory " << source;
+      return false;
+    }
+    while (const struct dirent* entry = readdir(dir)) {
+      const std::string path = source + "/" + entry->d_name;
+      struct stat path_stat;
+      if (stat(path.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode)) {
+        inputs->push_back(path);
+      }
+    }
+    closedir(dir);
+    std::sort(inputs->begin(), inputs->end());
+    return true;
+  }
+  if (source.find_first_of("*?[") != std::string::npos) {
+    glob_t matches;
+    const int ret = glob(source.c_str(), 0, nullptr, &matches);
+    if (ret != 0 && ret != GLOB_NOMATCH) {
+      LOG(ERROR) << "Failed to expand " << source;
+      return false;
+    }
+    for (size_t i = 0; ret == 0 && i < matches.gl_pathc; ++i) {
+      inputs->push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    return true;
+  }
+  std::ifstream manifest(source);
+  if (!manifest.is_open()) {
+    LOG(ERROR) << "Failed to open manifest " << source;
+    return false;
+  }
+  std::string line;
+  while (std::getline(manifest, line)) {
+    // Manifests written on Windows end their lines with "\r\n".
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty() && line[0] != '#') {
+      inputs->push_back(line);
+    }
+  }
+  return true;
+}
+
+bool ReadBuildIdMap(const std::string& path,
+                    std::map<std::string, std::string>* build_ids) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Failed to open build ID map " << path;
+    return false;
+  }
+  const char kWhitespace[] = " \t\r";
+  std::string line;
+  while (std::getline(file, line)) {
+    // The build ID has no whitespace, but the file name may.
+    const size_t begin = line.find_first_not_of(kWhitespace);
+    if (begin == std::string::npos) {
+      continue;
+    }
+    const size_t end = line.find_last_not_of(kWhitespace) + 1;
+    const size_t build_id_end = line.find_first_of(kWhitespace, begin);
+    if (build_id_end >= end) {
+      LOG(ERROR) << "Malformed build ID map line: " << line;
+      return false;
+    }
+    const size_t filename_begin =
+        line.find_first_not_of(kWhitespace, build_id_end);
+    (*build_ids)[line.substr(filename_begin, end - filename_begin)] =
+        line.substr(begin, build_id_end - begin);
+  }
+  return true;
+}
+
+std::vector<BatchResult> ConvertBatch(
+    const std::vector<std::string>& inputs, const std::string& output_dir,
+    const std::map<std::string, std::string>& build_ids,
+    uint32_t sample_labels, uint32_t options, bool overwrite_output,
+    int num_threads) {
+  std::vector<BatchResult> results(inputs.size());
+  std::set<std::string> outputs;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const std::string& input = inputs[i];
+    const size_t slash = input.find_last_of('/');
+    const std::string name =
+        slash == std::string::npos ? input : input.substr(slash + 1);
+    results[i].input = input;
+    results[i].output = output_dir + "/" + name + ".pb";
+    // Inputs with the same base name would overwrite each other's profile.
+    if (!outputs.insert(results[i].output).second) {
+      results[i].error = "duplicate output";
+    }
+  }
+
+  std::atomic<size_t> next_input(0);
+  auto convert = [&]() {
+    for (size_t i = next_input++; i < inputs.size(); i = next_input++) {
+      BatchResult& result = results[i];
+      if (!result.error.empty()) {
+        continue;
+      }
+      const auto start = std::chrono::steady_clock::now();
+      result.error = ConvertFile(result.input, result.output, build_ids,
+                                 sample_labels, options, overwrite_output);
+      result.ok = result.error.empty();
+      result.seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    }
+  };
+  if (num_threads <= 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  std::vector<std::thread> threads;
+  const size_t max_threads = std::max<size_t>(inputs.size(), 1);
+  for (size_t i = 1; i < std::min<size_t>(num_threads, max_threads); ++i) {
+    threads.emplace_back(convert);
+  }
+  convert();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+perftools::ProcessProfiles FileToProfiles(
+    const std::string& path, uint32_t sample_labels, uint32_t options,
+    perftools::ConversionStats* stats,
+    const perftools::ConversionThreads& threads) {
+  InputFile reader(path);
+  if (!reader.IsOpen()) {
+    LOG(FATAL) << "Failed to open file: " << path;
+  }
+  return BufferToProfiles(reader.data(), reader.size(), {}, sample_labels,
+                          options, stats, threads);
+}
+
+perftools::ProcessProfiles FilesToProfiles(
+    const std::vector<std::string>& paths, uint32_t sample_labels,
+    uint32_t options) {
+  std::vector<std::unique_ptr<InputFile>> readers;
+  std::vector<std::unique_ptr<quipper::PerfDataProto>> perf_data_protos;
+  std::vector<perftools::RawPerfData> raw_perf_data;
+  for (const auto& path : paths) {
+    readers.emplace_back(new InputFile(path));
+    const InputFile& reader = *readers.back();
+    if (!reader.IsOpen()) {
+      LOG(FATAL) << "Failed to open file: " << path;
+    }
+    // Try to parse it as a PerfDataProto, and fall back to reading it as a
+    // perf.data file.
+    std::unique_ptr<quipper::PerfDataProto> perf_data_proto(
+        new quipper::PerfDataProto);
+    if (perf_data_proto->ParseFromArray(reader.data(), reader.size())) {
+      perf_data_protos.push_back(std::move(perf_data_proto));
+    } else {
+      raw_perf_data.push_back({reader.data(), reader.size()});
+    }
+  }
+  if (!perf_data_protos.empty() && !raw_perf_data.empty()) {
+    LOG(ERROR) << "Cannot merge perf data protos with perf.data files";
+    return perftools::ProcessProfiles();
+  }
+  if (raw_perf_data.empty()) {
+    std::vector<const quipper::PerfDataProto*> perf_data;
+    for (const auto& perf_data_proto : perf_data_protos) {
+      perf_data.push_back(perf_data_proto.get());
+    }
+    return perftools::MergePerfDataProtosToProfiles(perf_data, sample_labels,
+                                                    options);
+  }
+  return perftools::MergeRawPerfDataToProfiles(raw_perf_data, {},
+                                               sample_labels, options);
 }
 
 void CreateFile(const std::string& path, std::ofstream* file,
@@ -57,12 +342,102 @@ void PrintUsage() {
             << "profile.";
   LOG(INFO) << "If the -j option is given, allow unaligned MMAP events "
             << "required by perf data from VMs with JITs.";
+  LOG(INFO) << "If the -i option is given several times, merge the profiles "
+            << "of all the inputs into one.";
+  LOG(INFO) << "If the --stats option is given, print the time spent in each "
+            << "phase of the conversion of a single input, its throughput "
+            << "and the sizes of the converter's maps.";
+  LOG(INFO) << "perf_to_profile -b <inputs> -o <output directory> "
+            << "[-m <build ID map>] [-t <threads>] [-f] [-j]";
+  LOG(INFO) << "Converts each input to <output directory>/<input name>.pb, "
+            << "where <inputs> is a directory, a glob pattern or a file "
+            << "listing one input per line.";
+  LOG(INFO) << "If the -m option is given, inject the build IDs listed in "
+            << "the file, one '<build ID> <file name>' per line.";
+  LOG(INFO) << "If the -t option is given, convert that many inputs at once "
+            << "rather than one per CPU.";
+}
+
+bool TakeStatsFlag(int* argc, const char* argv[]) {
+  bool found = false;
+  int kept = 0;
+  for (int i = 0; i < *argc; ++i) {
+    if (i > 0 && std::string(argv[i]) == "--stats") {
+      found = true;
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  *argc = kept;
+  return found;
+}
+
+bool IsBatchInvocation(int argc, const char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "-b") {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseBatchArguments(int argc, const char* argv[], BatchArguments* args) {
+  *args = BatchArguments();
+  int opt;
+  while ((opt = getopt(argc, const_cast<char* const*>(argv),
+                       ":jfb:o:m:t:")) != -1) {
+    switch (opt) {
+      case 'b':
+        args->inputs = optarg;
+        break;
+      case 'o':
+        args->output_dir = optarg;
+        break;
+      case 'm':
+        args->build_id_map = optarg;
+        break;
+      case 't':
+        args->num_threads = atoi(optarg);
+        if (args->num_threads <= 0) {
+          LOG(ERROR) << "Invalid number of threads: " << optarg;
+          return false;
+        }
+        break;
+      case 'f':
+        args->overwrite_output = true;
+        break;
+      case 'j':
+        args->allow_unaligned_jit_mappings = true;
+        break;
+      case ':':
+        LOG(ERROR) << "Must provide arguments for flags -b, -o, -m and -t";
+        return false;
+      case '?':
+        LOG(ERROR) << "Invalid option: " << static_cast<char>(optopt);
+        return false;
+      default:
+        LOG(ERROR) << "Invalid option: " << static_cast<char>(opt);
+        return false;
+    }
+  }
+  return !args->inputs.empty() && !args->output_dir.empty();
 }
 
 bool ParseArguments(int argc, const char* argv[], std::string* input,
                     std::string* output, bool* overwrite_output,
                     bool* allow_unaligned_jit_mappings) {
-  *input = "";
+  std::vector<std::string> inputs;
+  const bool ok = ParseArguments(argc, argv, &inputs, output, overwrite_output,
+                                 allow_unaligned_jit_mappings);
+  *input = inputs.empty() ? "" : inputs.back();
+  return ok;
+}
+
+bool ParseArguments(int argc, const char* argv[],
+                    std::vector<std::string>* inputs, std::string* output,
+                    bool* overwrite_output,
+                    bool* allow_unaligned_jit_mappings) {
+  inputs->clear();
   *output = "";
   *overwrite_output = false;
   *allow_unaligned_jit_mappings = false;
@@ -71,7 +446,7 @@ bool ParseArguments(int argc, const char* argv[], std::string* input,
          -1) {
     switch (opt) {
       case 'i':
-        *input = optarg;
+        inputs->push_back(optarg);
         break;
       case 'o':
         *output = optarg;
@@ -93,5 +468,5 @@ bool ParseArguments(int argc, const char* argv[], std::string* input,
         return false;
     }
   }
-  return !input->empty() && !output->empty();
+  return !inputs->empty() && !output->empty();
 }
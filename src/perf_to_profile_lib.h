@@ -10,6 +10,9 @@
 
 #include <unistd.h>
 #include <fstream>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "src/quipper/base/logging.h"
 #include "src/perf_data_converter.h"
@@ -28,6 +31,28 @@ perftools::ProcessProfiles StringToProfiles(
     const std::string& data, uint32_t sample_labels = perftools::kNoLabels,
     uint32_t options = perftools::kNoOptions);
 
+// Generates profiles from the file at the given |path|, which holds either
+// raw perf.data or a serialized perf data proto. A regular file is memory
+// mapped and parsed in place rather than being copied into a string first;
+// pipes and other inputs that can't be mapped are read. If |stats| is
+// not null, the statistics of the conversion are stored in it. |threads| sets
+// the threads used by the conversion, see perftools::ConversionThreads.
+// Returns a vector of process profiles, empty if any error occurs.
+perftools::ProcessProfiles FileToProfiles(
+    const std::string& path, uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions,
+    perftools::ConversionStats* stats = nullptr,
+    const perftools::ConversionThreads& threads = {});
+
+// Generates profiles from the files at the given |paths|, which all hold
+// either raw perf.data or serialized perf data protos, and merges them into a
+// single vector of process profiles, see perftools::MergeRawPerfDataToProfiles.
+// Returns a vector of process profiles, empty if any error occurs.
+perftools::ProcessProfiles FilesToProfiles(
+    const std::vector<std::string>& paths,
+    uint32_t sample_labels = perftools::kNoLabels,
+    uint32_t options = perftools::kNoOptions);
+
 // Creates a file at the given |path|. If |overwrite_output| is set to true,
 // overwrites the file at the given path.
 void CreateFile(const std::string& path, std::ofstream* file,
@@ -40,6 +65,80 @@ bool ParseArguments(int argc, const char* argv[], std::string* input,
                     std::string* output, bool* overwrite_output,
                     bool* allow_unaligned_jit_mappings);
 
+// Same as above, but stores every input given with -i in |inputs|, in order,
+// rather than only the last one.
+bool ParseArguments(int argc, const char* argv[],
+                    std::vector<std::string>* inputs, std::string* output,
+                    bool* overwrite_output,
+                    bool* allow_unaligned_jit_mappings);
+
+// The arguments of a batch conversion, see ParseBatchArguments().
+struct BatchArguments {
+  // A manifest file, a directory or a glob pattern, see ListBatchInputs().
+  std::string inputs;
+  // The directory to write the profiles to.
+  std::string output_dir;
+  // An optional file of build IDs to inject, see ReadBuildIdMap().
+  std::string build_id_map;
+  // The number of inputs to convert at once, 0 for one per CPU.
+  int num_threads = 0;
+  bool overwrite_output = false;
+  bool allow_unaligned_jit_mappings = false;
+};
+
+// Removes the --stats flag from the arguments, and returns whether it was
+// given.
+bool TakeStatsFlag(int* argc, const char* argv[]);
+
+// Returns whether the arguments ask for a batch conversion, i.e. have a -b
+// flag.
+bool IsBatchInvocation(int argc, const char* argv[]);
+
+// Parses the arguments of a batch conversion into |args|: -b <inputs>,
+// -o <output directory>, and optionally -m <build ID map>, -t <threads>, -f
+// and -j. Returns true if arguments parsed successfully and false otherwise.
+bool ParseBatchArguments(int argc, const char* argv[], BatchArguments* args);
+
+// Lists the inputs of a batch conversion in |inputs|, replacing its contents.
+// |source| is either a directory, whose regular files are all inputs, a glob
+// pattern, or a manifest file with one input path per line, where trailing
+// whitespace is dropped and empty lines and lines starting with '#' are
+// ignored. Returns false if |source| cannot be read.
+bool ListBatchInputs(const std::string& source,
+                     std::vector<std::string>* inputs);
+
+// Reads the build IDs to inject into the conversion of raw perf.data files
+// from the file at |path| into |build_ids|, which maps file names to build
+// IDs. Each line holds a build ID and a file name separated by whitespace,
+// as printed by "perf buildid-list"; the file name is the rest of the line, so
+// it may contain spaces. Returns false if the file cannot be read or has a
+// malformed line.
+bool ReadBuildIdMap(const std::string& path,
+                    std::map<std::string, std::string>* build_ids);
+
+// The outcome of the conversion of one input of a batch.
+struct BatchResult {
+  std::string input;
+  std::string output;
+  bool ok = false;
+  // Why the conversion failed, if it did.
+  std::string error;
+  // The wall time the conversion took.
+  double seconds = 0;
+};
+
+// Converts each of |inputs| into a single profile written to |output_dir|,
+// named after the base name of the input with a ".pb" suffix, converting up
+// to |num_threads| inputs at once. The build IDs are shared by all the
+// conversions of raw perf.data inputs. An input that fails to be converted is
+// reported in its result without stopping the others. Returns the results in
+// the order of |inputs|.
+std::vector<BatchResult> ConvertBatch(
+    const std::vector<std::string>& inputs, const std::string& output_dir,
+    const std::map<std::string, std::string>& build_ids,
+    uint32_t sample_labels, uint32_t options, bool overwrite_output,
+    int num_threads);
+
 // Prints the usage of the tool.
 void PrintUsage();
 
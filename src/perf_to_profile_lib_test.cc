@@ -7,6 +7,12 @@
 
 #include "src/perf_to_profile_lib.h"
 
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
 #include "src/quipper/base/logging.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -113,6 +119,196 @@ TEST(PerfToProfileTest, PerfDataProtoStringToProfiles) {
   EXPECT_EQ(profiles.size(), 1);
 }
 
+TEST(PerfToProfileTest, FileToProfiles) {
+  EXPECT_EQ(
+      FileToProfiles(GetResource("multi-event-single-process.perf.data"))
+          .size(),
+      1);
+  EXPECT_EQ(
+      FileToProfiles(GetResource("multi-event-single-process.perf_data.pb"))
+          .size(),
+      1);
+}
+
+TEST(PerfToProfileTest, FileToProfilesFromPipe) {
+  // A FIFO can't be memory mapped, so it has to be read like a stream.
+  const std::string fifo = ::testing::TempDir() + "/perf_data_fifo";
+  std::remove(fifo.c_str());
+  ASSERT_EQ(mkfifo(fifo.c_str(), 0600), 0);
+  const std::string perf_data =
+      ReadFileToString(GetResource("multi-event-single-process.perf.data"));
+  // The writer gets SIGPIPE if the FIFO is ever left without a reader while
+  // it writes more than the pipe buffer holds, as with "perf record -o".
+  ASSERT_GT(perf_data.size(), 64 * 1024);
+  std::thread writer([&fifo, &perf_data]() {
+    std::ofstream file(fifo, std::ios_base::binary);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    file << perf_data;
+  });
+  const auto profiles = FileToProfiles(fifo);
+  writer.join();
+  std::remove(fifo.c_str());
+  EXPECT_EQ(profiles.size(), 1);
+}
+
+TEST(PerfToProfileTest, ParseArgumentsWithSeveralInputs) {
+  std::vector<const char*> argv = {"<exec>", "-i", "first", "-i",
+                                   "second", "-o", "output_profile"};
+  std::vector<std::string> inputs;
+  std::string output;
+  bool overwrite_output;
+  bool allow_unaligned_jit_mappings;
+  EXPECT_TRUE(ParseArguments(argv.size(), argv.data(), &inputs, &output,
+                             &overwrite_output,
+                             &allow_unaligned_jit_mappings));
+  EXPECT_THAT(inputs, Eq(std::vector<std::string>{"first", "second"}));
+  EXPECT_THAT(output, Eq("output_profile"));
+  optind = 1;
+}
+
+TEST(PerfToProfileTest, FilesToProfiles) {
+  for (const char* file : {"multi-event-single-process.perf.data",
+                           "multi-event-single-process.perf_data.pb"}) {
+    const auto want = FileToProfiles(GetResource(file));
+    const auto got =
+        FilesToProfiles({GetResource(file), GetResource(file)});
+    ASSERT_EQ(want.size(), 1) << file;
+    ASSERT_EQ(got.size(), 1) << file;
+    // The same input twice doubles the sample values, without adding
+    // samples, locations or mappings.
+    const auto& want_profile = want[0]->data;
+    const auto& got_profile = got[0]->data;
+    EXPECT_EQ(want_profile.mapping_size(), got_profile.mapping_size()) << file;
+    EXPECT_EQ(want_profile.location_size(), got_profile.location_size())
+        << file;
+    ASSERT_EQ(want_profile.sample_size(), got_profile.sample_size()) << file;
+    for (int i = 0; i < want_profile.sample_size(); ++i) {
+      const auto& want_sample = want_profile.sample(i);
+      const auto& got_sample = got_profile.sample(i);
+      ASSERT_EQ(want_sample.value_size(), got_sample.value_size()) << file;
+      for (int j = 0; j < want_sample.value_size(); ++j) {
+        EXPECT_EQ(2 * want_sample.value(j), got_sample.value(j)) << file;
+      }
+    }
+  }
+}
+
+TEST(PerfToProfileTest, TakeStatsFlag) {
+  std::vector<const char*> argv = {"<exec>", "-i", "input", "--stats", "-o",
+                                   "output"};
+  int argc = argv.size();
+  EXPECT_TRUE(TakeStatsFlag(&argc, argv.data()));
+  argv.resize(argc);
+  EXPECT_THAT(argv, Eq(std::vector<const char*>{"<exec>", "-i", "input", "-o",
+                                                "output"}));
+  EXPECT_FALSE(TakeStatsFlag(&argc, argv.data()));
+  EXPECT_EQ(5, argc);
+}
+
+TEST(PerfToProfileTest, ParseBatchArguments) {
+  std::vector<const char*> argv = {"<exec>", "-b", "inputs", "-o", "out",
+                                   "-t",     "3",  "-m",     "ids", "-f"};
+  EXPECT_TRUE(IsBatchInvocation(argv.size(), argv.data()));
+  BatchArguments args;
+  EXPECT_TRUE(ParseBatchArguments(argv.size(), argv.data(), &args));
+  EXPECT_THAT(args.inputs, Eq("inputs"));
+  EXPECT_THAT(args.output_dir, Eq("out"));
+  EXPECT_THAT(args.build_id_map, Eq("ids"));
+  EXPECT_THAT(args.num_threads, Eq(3));
+  EXPECT_TRUE(args.overwrite_output);
+  EXPECT_FALSE(args.allow_unaligned_jit_mappings);
+  optind = 1;
+
+  std::vector<const char*> single = {"<exec>", "-i", "input", "-o", "output"};
+  EXPECT_FALSE(IsBatchInvocation(single.size(), single.data()));
+  std::vector<const char*> no_output = {"<exec>", "-b", "inputs"};
+  EXPECT_FALSE(ParseBatchArguments(no_output.size(), no_output.data(), &args));
+  optind = 1;
+}
+
+TEST(PerfToProfileTest, ListBatchInputsAndBuildIdMap) {
+  const std::string manifest = ::testing::TempDir() + "/batch_manifest";
+  {
+    std::ofstream file(manifest, std::ios_base::trunc);
+    file << "# comment\n/tmp/first\n\n/tmp/second\n";
+  }
+  std::vector<std::string> inputs;
+  ASSERT_TRUE(ListBatchInputs(manifest, &inputs));
+  EXPECT_THAT(inputs,
+              Eq(std::vector<std::string>{"/tmp/first", "/tmp/second"}));
+
+  {
+    std::ofstream file(manifest, std::ios_base::trunc);
+    file << "# comment\r\n/tmp/first \r\n \r\n/tmp/my second\t\r\n";
+  }
+  ASSERT_TRUE(ListBatchInputs(manifest, &inputs));
+  EXPECT_THAT(inputs,
+              Eq(std::vector<std::string>{"/tmp/first", "/tmp/my second"}));
+
+  ASSERT_TRUE(ListBatchInputs(GetResource("multi-event-single-process.*"),
+                              &inputs));
+  EXPECT_THAT(inputs, Eq(std::vector<std::string>{
+                          GetResource("multi-event-single-process.perf.data"),
+                          GetResource(
+                              "multi-event-single-process.perf_data.pb")}));
+  EXPECT_FALSE(ListBatchInputs(manifest + ".missing", &inputs));
+
+  const std::string build_id_map = ::testing::TempDir() + "/batch_build_ids";
+  {
+    std::ofstream file(build_id_map, std::ios_base::trunc);
+    file << "abcd /usr/lib/libfoo.so\n\n0123 /bin/bar\n"
+         << "  4567\t/opt/My App/lib baz.so \n";
+  }
+  std::map<std::string, std::string> build_ids;
+  ASSERT_TRUE(ReadBuildIdMap(build_id_map, &build_ids));
+  EXPECT_THAT(build_ids, Eq(std::map<std::string, std::string>{
+                             {"/usr/lib/libfoo.so", "abcd"},
+                             {"/bin/bar", "0123"},
+                             {"/opt/My App/lib baz.so", "4567"}}));
+
+  {
+    std::ofstream file(build_id_map, std::ios_base::trunc);
+    file << "abcd\n";
+  }
+  EXPECT_FALSE(ReadBuildIdMap(build_id_map, &build_ids));
+}
+
+TEST(PerfToProfileTest, ConvertBatch) {
+  const std::string output_dir = ::testing::TempDir();
+  const std::vector<std::string> inputs = {
+      GetResource("multi-event-single-process.perf.data"),
+      GetResource("missing.perf.data"),
+      GetResource("multi-event-single-process.perf_data.pb"),
+      GetResource("multi-event-single-process.perf.data")};
+  const auto results =
+      ConvertBatch(inputs, output_dir, {}, perftools::kNoLabels,
+                   perftools::kNoOptions, true, 2);
+  ASSERT_EQ(results.size(), inputs.size());
+  EXPECT_TRUE(results[0].ok) << results[0].error;
+  EXPECT_THAT(results[0].output,
+              Eq(output_dir + "/multi-event-single-process.perf.data.pb"));
+  EXPECT_FALSE(results[1].ok);
+  EXPECT_THAT(results[1].error, Eq("failed to open input"));
+  EXPECT_TRUE(results[2].ok) << results[2].error;
+  EXPECT_FALSE(results[3].ok);
+  EXPECT_THAT(results[3].error, Eq("duplicate output"));
+
+  perftools::profiles::Profile profile;
+  std::ifstream file(results[0].output);
+  ASSERT_TRUE(profile.ParseFromIstream(&file));
+  EXPECT_THAT(profile.SerializeAsString(),
+              Eq(FileToProfiles(inputs[0])[0]->data.SerializeAsString()));
+
+  // An existing output is reported before the input is even read.
+  { std::ofstream existing(output_dir + "/missing.perf.data.pb"); }
+  const auto no_overwrite_results =
+      ConvertBatch({inputs[0], inputs[1]}, output_dir, {},
+                   perftools::kNoLabels, perftools::kNoOptions, false, 1);
+  ASSERT_EQ(no_overwrite_results.size(), 2);
+  EXPECT_THAT(no_overwrite_results[0].error, Eq("output already exists"));
+  EXPECT_THAT(no_overwrite_results[1].error, Eq("output already exists"));
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
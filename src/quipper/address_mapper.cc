@@ -6,23 +6,13 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "base/logging.h"
 
 namespace quipper {
 
-AddressMapper::AddressMapper(const AddressMapper& other) {
-  // Copy over most members naively.
-  mappings_ = other.mappings_;
-  page_alignment_ = other.page_alignment_;
-
-  // Reconstruct mapping of real addresses to mapped ranges.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    real_addr_to_mapped_range_[iter->real_addr] = iter;
-  }
-}
-
 bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
                               const uint64_t id, const uint64_t offset_base,
                               bool remove_existing_mappings,
@@ -57,40 +47,47 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
   // First determine the range of mappings that could overlap with the new
   // mapping in real space.
 
+  auto by_real_addr = [](const MappedRange& range, uint64_t addr) {
+    return range.real_addr < addr;
+  };
   // lower_bound returns the first range with starting addr >= |real_addr|. The
   // preceding range could also possibly overlap with the new range.
-  auto map_iter_start = real_addr_to_mapped_range_.lower_bound(real_addr);
-  if (map_iter_start != real_addr_to_mapped_range_.begin()) --map_iter_start;
+  auto iter_start = std::lower_bound(mappings_.begin(), mappings_.end(),
+                                     real_addr, by_real_addr);
+  if (iter_start != mappings_.begin()) --iter_start;
   // lower_bound returns the first range with starting addr beyond the end of
-  // the new mapping range.
-  auto map_iter_end = real_addr_to_mapped_range_.lower_bound(real_addr + size);
-
-  std::vector<MappingList::iterator> mappings_to_delete;
-  MappingList::iterator old_range_iter = mappings_.end();
-  for (auto map_iter = map_iter_start; map_iter != map_iter_end; ++map_iter) {
-    auto iter = map_iter->second;
+  // the new mapping range. A range that ends at the top of the address space
+  // may overlap every range after |iter_start|.
+  auto iter_end = real_addr + size == 0
+                      ? mappings_.end()
+                      : std::lower_bound(iter_start, mappings_.end(),
+                                         real_addr + size, by_real_addr);
+
+  // Indices into |mappings_|, in increasing order, of the ranges to remove.
+  std::vector<size_t> mappings_to_delete;
+  bool has_old_range = false;
+  MappedRange old_range = {};
+  for (auto iter = iter_start; iter != iter_end; ++iter) {
     if (!iter->Intersects(range)) continue;
     // Quit if existing ranges that collide aren't supposed to be removed.
     if (!remove_existing_mappings) return false;
-    if (old_range_iter == mappings_.end() && iter->Covers(range) &&
-        iter->size > range.size) {
-      old_range_iter = iter;
-      continue;
+    if (!has_old_range && iter->Covers(range) && iter->size > range.size) {
+      // Make a copy of the old mapping before removing it.
+      old_range = *iter;
+      has_old_range = true;
     }
-    mappings_to_delete.push_back(iter);
+    mappings_to_delete.push_back(iter - mappings_.begin());
   }
 
-  for (MappingList::iterator mapping_iter : mappings_to_delete)
-    Unmap(mapping_iter);
-  mappings_to_delete.clear();
+  // Remove from the back so that the remaining indices stay valid.
+  for (auto index = mappings_to_delete.rbegin();
+       index != mappings_to_delete.rend(); ++index) {
+    Unmap(mappings_.begin() + *index);
+  }
 
   // Otherwise check for this range being covered by another range.  If that
   // happens, split or reduce the existing range to make room.
-  if (old_range_iter != mappings_.end()) {
-    // Make a copy of the old mapping before removing it.
-    const MappedRange old_range = *old_range_iter;
-    Unmap(old_range_iter);
-
+  if (has_old_range) {
     uint64_t gap_before = range.real_addr - old_range.real_addr;
     uint64_t gap_after =
         (old_range.real_addr + old_range.size) - (range.real_addr + range.size);
@@ -142,39 +139,56 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
 
   // Now search for a location for the new range.  It should be in the first
   // free block in quipper space.
-
   uint64_t page_offset =
       page_alignment_ ? GetAlignedOffset(range.real_addr) : 0;
+  if (!FindQuipperSpace(range.size, page_offset, &range.mapped_addr)) {
+    // There is no free space in quipper space large enough for a mapping of
+    // this size.
+    DumpToLog();
+    LOG(ERROR) << "Could not find space to map addr=" << std::hex << real_addr
+               << " with size " << std::hex << size;
+    return false;
+  }
 
-  // If there is no existing mapping, add it to the beginning of quipper space.
-  if (IsEmpty()) {
-    range.mapped_addr = page_offset;
-    range.unmapped_space_after = UINT64_MAX - range.size - page_offset;
-    mappings_.push_back(range);
-    real_addr_to_mapped_range_.insert(
-        std::make_pair(range.real_addr, mappings_.begin()));
-    return true;
+  QuipperRange quipper_range = {range.mapped_addr, range.size};
+  auto quipper_iter = quipper_ranges_.insert(
+      std::upper_bound(quipper_ranges_.begin(), quipper_ranges_.end(),
+                       range.mapped_addr,
+                       [](uint64_t addr, const QuipperRange& existing) {
+                         return addr < existing.mapped_addr;
+                       }),
+      quipper_range);
+  first_gap_hint_ = std::min<size_t>(first_gap_hint_,
+                                     quipper_iter - quipper_ranges_.begin());
+  while (first_gap_hint_ < quipper_ranges_.size() &&
+         UnmappedSpaceAfter(first_gap_hint_) == 0) {
+    ++first_gap_hint_;
   }
+  mappings_.insert(std::lower_bound(mappings_.begin(), mappings_.end(),
+                                    range.real_addr, by_real_addr),
+                   range);
+  return true;
+}
 
-  // If there is space before the first mapped range in quipper space, use it.
-  if (mappings_.begin()->mapped_addr >= range.size + page_offset) {
-    range.mapped_addr = page_offset;
-    range.unmapped_space_after =
-        mappings_.begin()->mapped_addr - range.size - page_offset;
-    mappings_.push_front(range);
-    MappingList::iterator iter = mappings_.begin();
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
+bool AddressMapper::FindQuipperSpace(uint64_t size, uint64_t page_offset,
+                                     uint64_t* mapped_addr) const {
+  // If there is no existing mapping, or there is space before the first mapped
+  // range in quipper space, use the beginning of quipper space.
+  if (quipper_ranges_.empty() ||
+      quipper_ranges_.front().mapped_addr >= size + page_offset) {
+    *mapped_addr = page_offset;
     return true;
   }
 
   // Otherwise, search through the existing mappings for a free block after one
-  // of them.
-  for (auto iter = mappings_.begin(); iter != mappings_.end(); ++iter) {
-    MappedRange& existing_mapping = *iter;
+  // of them, skipping those known to have none.
+  for (size_t i = first_gap_hint_; i < quipper_ranges_.size(); ++i) {
+    const QuipperRange& existing_mapping = quipper_ranges_[i];
+    uint64_t end_of_existing_mapping =
+        existing_mapping.mapped_addr + existing_mapping.size;
+    uint64_t end_of_unmapped_space_after =
+        end_of_existing_mapping + UnmappedSpaceAfter(i);
     if (page_alignment_) {
-      uint64_t end_of_existing_mapping =
-          existing_mapping.mapped_addr + existing_mapping.size;
-
       // Find next page boundary after end of this existing mapping.
       uint64_t existing_page_offset = GetAlignedOffset(end_of_existing_mapping);
       uint64_t next_page_boundary =
@@ -183,41 +197,22 @@ bool AddressMapper::MapWithID(const uint64_t real_addr, const uint64_t size,
               : end_of_existing_mapping;
       // Compute where the new mapping would end if it were aligned to this
       // page boundary.
-      uint64_t mapping_offset = GetAlignedOffset(range.real_addr);
-      uint64_t end_of_new_mapping =
-          next_page_boundary + mapping_offset + range.size;
-      uint64_t end_of_unmapped_space_after =
-          end_of_existing_mapping + existing_mapping.unmapped_space_after;
+      uint64_t end_of_new_mapping = next_page_boundary + page_offset + size;
 
       // Check if there's enough room in the unmapped space following the
       // current existing mapping for the page-aligned mapping.
       if (end_of_new_mapping > end_of_unmapped_space_after) continue;
 
-      range.mapped_addr = next_page_boundary + mapping_offset;
-      range.unmapped_space_after =
-          end_of_unmapped_space_after - end_of_new_mapping;
-      existing_mapping.unmapped_space_after =
-          range.mapped_addr - end_of_existing_mapping;
+      *mapped_addr = next_page_boundary + page_offset;
     } else {
-      if (existing_mapping.unmapped_space_after < range.size) continue;
+      if (end_of_unmapped_space_after - end_of_existing_mapping < size) {
+        continue;
+      }
       // Insert the new mapping range immediately after the existing one.
-      range.mapped_addr = existing_mapping.mapped_addr + existing_mapping.size;
-      range.unmapped_space_after =
-          existing_mapping.unmapped_space_after - range.size;
-      existing_mapping.unmapped_space_after = 0;
+      *mapped_addr = end_of_existing_mapping;
     }
-
-    mappings_.insert(++iter, range);
-    --iter;
-    real_addr_to_mapped_range_.insert(std::make_pair(range.real_addr, iter));
     return true;
   }
-
-  // If it still hasn't succeeded in mapping, it means there is no free space in
-  // quipper space large enough for a mapping of this size.
-  DumpToLog();
-  LOG(ERROR) << "Could not find space to map addr=" << std::hex << real_addr
-             << " with size " << std::hex << size;
   return false;
 }
 
@@ -257,46 +252,47 @@ void AddressMapper::GetMappedIDAndOffset(
 uint64_t AddressMapper::GetMaxMappedLength() const {
   if (IsEmpty()) return 0;
 
-  uint64_t min = mappings_.begin()->mapped_addr;
-
-  MappingList::const_iterator iter = mappings_.end();
-  --iter;
-  uint64_t max = iter->mapped_addr + iter->size;
+  uint64_t min = quipper_ranges_.front().mapped_addr;
+  uint64_t max =
+      quipper_ranges_.back().mapped_addr + quipper_ranges_.back().size;
 
   return max - min;
 }
 
 void AddressMapper::Unmap(MappingList::iterator mapping_iter) {
-  // Add the freed up space to the free space counter of the previous
-  // mapped region, if it exists.
-  if (mapping_iter != mappings_.begin()) {
-    const MappedRange& range = *mapping_iter;
-    MappingList::iterator previous_range_iter = std::prev(mapping_iter);
-    previous_range_iter->unmapped_space_after +=
-        range.size + range.unmapped_space_after;
-  }
-  real_addr_to_mapped_range_.erase(mapping_iter->real_addr);
+  // The freed up space joins the unmapped space after the previous mapped
+  // region in quipper space, if it exists.
+  auto quipper_iter = std::lower_bound(
+      quipper_ranges_.begin(), quipper_ranges_.end(), mapping_iter->mapped_addr,
+      [](const QuipperRange& existing, uint64_t addr) {
+        return existing.mapped_addr < addr;
+      });
+  size_t index = quipper_iter - quipper_ranges_.begin();
+  first_gap_hint_ = std::min(first_gap_hint_, index > 0 ? index - 1 : 0);
+  quipper_ranges_.erase(quipper_iter);
   mappings_.erase(mapping_iter);
 }
 
 AddressMapper::MappingList::const_iterator
 AddressMapper::GetRangeContainingAddress(uint64_t real_addr) const {
   // Find the first range that has a higher real address than the given one.
-  MappingMap::const_iterator target_map_iter =
-      real_addr_to_mapped_range_.upper_bound(real_addr);
+  MappingList::const_iterator iter = std::upper_bound(
+      mappings_.begin(), mappings_.end(), real_addr,
+      [](uint64_t addr, const MappedRange& range) {
+        return addr < range.real_addr;
+      });
 
-  if (target_map_iter == real_addr_to_mapped_range_.begin()) {
+  if (iter == mappings_.begin()) {
     // The lowest real address in existing mappings is higher than the new
     // mapping address, so |real_addr| does not fall into any mapping.
     return mappings_.end();
   }
 
   // Otherwise, the previous mapping could possibly contain |real_addr|.
-  --target_map_iter;
-  MappingList::const_iterator list_iter = target_map_iter->second;
-  if (!list_iter->ContainsAddress(real_addr)) return mappings_.end();
+  --iter;
+  if (!iter->ContainsAddress(real_addr)) return mappings_.end();
 
-  return list_iter;
+  return iter;
 }
 
 }  // namespace quipper
@@ -8,8 +8,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <list>
-#include <map>
+#include <vector>
 
 namespace quipper {
 
@@ -18,14 +17,17 @@ class AddressMapper {
   struct MappedRange;
 
  public:
-  AddressMapper() : page_alignment_(0) {}
+  AddressMapper() : first_gap_hint_(0), page_alignment_(0) {}
 
   // Copy constructor: copies mappings from |source| to this AddressMapper. This
   // is useful for copying mappings from parent to child process upon fork(). It
   // is also useful to copy kernel mappings to any process that is created.
-  AddressMapper(const AddressMapper& other);
+  // The mappings are stored in flat arrays, so this is a pair of copies.
+  AddressMapper(const AddressMapper& other) = default;
 
-  typedef std::list<MappedRange> MappingList;
+  // The mappings, sorted by real address. Iterators into it are invalidated by
+  // MapWithID().
+  typedef std::vector<MappedRange> MappingList;
 
   // Maps a new address range [real_addr, real_addr + length) to quipper space.
   // |id| is an identifier value to be stored along with the mapping.
@@ -51,7 +53,7 @@ class AddressMapper {
                  bool allow_unaligned_jit_mappings);
 
   // Looks up |real_addr| and returns the mapped address and MappingList
-  // iterator.
+  // iterator. The iterator is valid until the next call to MapWithID().
   bool GetMappedAddressAndListIterator(const uint64_t real_addr,
                                        uint64_t* mapped_addr,
                                        MappingList::const_iterator* iter) const;
@@ -88,8 +90,6 @@ class AddressMapper {
   void DumpToLog() const;
 
  private:
-  typedef std::map<uint64_t, MappingList::iterator> MappingMap;
-
   struct MappedRange {
     uint64_t real_addr;
     uint64_t mapped_addr;
@@ -98,9 +98,6 @@ class AddressMapper {
     uint64_t id;
     uint64_t offset_base;
 
-    // Length of unmapped space after this range.
-    uint64_t unmapped_space_after;
-
     // Determines if this range intersects another range in real space.
     inline bool Intersects(const MappedRange& range) const {
       return (real_addr <= range.real_addr + range.size - 1) &&
@@ -126,6 +123,13 @@ class AddressMapper {
     }
   };
 
+  // A mapped range in quipper space. The unmapped space after a range extends
+  // to the start of the next one, or to the end of quipper space.
+  struct QuipperRange {
+    uint64_t mapped_addr;
+    uint64_t size;
+  };
+
   // Returns an iterator to a MappedRange in |mappings_| that contains
   // |real_addr|. Returns |mappings_.end()| if no range contains |real_addr|.
   MappingList::const_iterator GetRangeContainingAddress(
@@ -135,6 +139,22 @@ class AddressMapper {
   // element of |mappings_|.
   void Unmap(MappingList::iterator mapping_iter);
 
+  // Finds room in quipper space for a range of |size| bytes whose real address
+  // is |page_offset| bytes into its page: before the first mapped range if
+  // there is room there, or else in the first large enough gap after a mapped
+  // range. Returns false if there is no room.
+  bool FindQuipperSpace(uint64_t size, uint64_t page_offset,
+                        uint64_t* mapped_addr) const;
+
+  // Returns the length of unmapped quipper space after |quipper_ranges_[i]|.
+  uint64_t UnmappedSpaceAfter(size_t i) const {
+    uint64_t end_of_unmapped_space = i + 1 < quipper_ranges_.size()
+                                         ? quipper_ranges_[i + 1].mapped_addr
+                                         : UINT64_MAX;
+    return end_of_unmapped_space -
+           (quipper_ranges_[i].mapped_addr + quipper_ranges_[i].size);
+  }
+
   // Given an address, and a nonzero, power-of-two |page_alignment_| value,
   // returns the offset of the address from the start of the page it is on.
   // Equivalent to |addr % page_alignment_|. Should not be called if
@@ -143,12 +163,19 @@ class AddressMapper {
     return addr & (page_alignment_ - 1);
   }
 
-  // Container for all the existing mappings.
+  // Container for all the existing mappings, sorted by real address, which
+  // lookups binary search.
   MappingList mappings_;
 
-  // Maps real addresses to iterators pointing to entries within |mappings_|.
-  // Must maintain a 1:1 entry correspondence with |mappings_|.
-  MappingMap real_addr_to_mapped_range_;
+  // The ranges of |mappings_| in quipper space, sorted by mapped address. The
+  // gaps between them are the free quipper space new mappings are allocated
+  // from. Must maintain a 1:1 entry correspondence with |mappings_|.
+  std::vector<QuipperRange> quipper_ranges_;
+
+  // None of the ranges in |quipper_ranges_| before this index are followed by
+  // unmapped space, so the search for free space can start here. Mappings tend
+  // to be packed, which would otherwise make that search quadratic.
+  size_t first_gap_hint_;
 
   // If set to nonzero, use this as a mapping page boundary. If a mapping does
   // not begin at a multiple of this value, the remapped address should be given
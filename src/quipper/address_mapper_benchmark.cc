@@ -0,0 +1,84 @@
+// Copyright 2024 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the AddressMapper operations PerfParser leans on: mapping the
+// MMAP events of a process, looking up the address of every sample, and
+// copying all the mappings of a parent process on fork.
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "address_mapper.h"
+#include "benchmark/benchmark.h"
+
+namespace quipper {
+namespace {
+
+constexpr uint64_t kPageSize = 0x1000;
+constexpr uint64_t kBaseAddress = 0x7f0000000000ULL;
+constexpr int kNumLookups = 1 << 14;
+
+// Returns a page-aligned mapper with |num_mappings| mappings of a few pages
+// each, separated by unmapped pages the way shared libraries are.
+AddressMapper MakeMapper(int num_mappings) {
+  AddressMapper mapper;
+  mapper.set_page_alignment(kPageSize);
+  for (int i = 0; i < num_mappings; ++i) {
+    const uint64_t size = (1 + i % 4) * kPageSize;
+    mapper.MapWithID(kBaseAddress + i * 8 * kPageSize, size, i, 0, true, false);
+  }
+  return mapper;
+}
+
+// Returns kNumLookups addresses scattered over the mappings of MakeMapper().
+std::vector<uint64_t> MakeAddresses(int num_mappings) {
+  std::vector<uint64_t> addresses;
+  uint64_t state = 1;
+  for (int i = 0; i < kNumLookups; ++i) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    const uint64_t mapping = (state >> 33) % num_mappings;
+    addresses.push_back(kBaseAddress + mapping * 8 * kPageSize +
+                        (state >> 20) % kPageSize);
+  }
+  return addresses;
+}
+
+void BM_MapWithID(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(MakeMapper(state.range(0)));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MapWithID)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_Lookup(benchmark::State& state) {
+  const AddressMapper mapper = MakeMapper(state.range(0));
+  const std::vector<uint64_t> addresses = MakeAddresses(state.range(0));
+  uint64_t mapped_addr;
+  AddressMapper::MappingList::const_iterator iter;
+  for (auto _ : state) {
+    for (uint64_t address : addresses) {
+      benchmark::DoNotOptimize(
+          mapper.GetMappedAddressAndListIterator(address, &mapped_addr, &iter));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * addresses.size());
+}
+BENCHMARK(BM_Lookup)->Arg(64)->Arg(1024)->Arg(8192);
+
+void BM_Copy(benchmark::State& state) {
+  const AddressMapper mapper = MakeMapper(state.range(0));
+  for (auto _ : state) {
+    AddressMapper copy(mapper);
+    benchmark::DoNotOptimize(copy);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Copy)->Arg(64)->Arg(1024)->Arg(8192);
+
+}  // namespace
+}  // namespace quipper
+
+BENCHMARK_MAIN();
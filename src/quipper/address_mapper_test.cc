@@ -473,4 +473,50 @@ TEST_F(AddressMapperTest, MisalignedSplitRangeWithJitSupport) {
   TestMappedRange(kRange0Tail, 0x5800);
 }
 
+// Remaps a range in the middle of quipper space, and makes sure the space it
+// frees is reused.
+TEST_F(AddressMapperTest, ReuseUnmappedSpace) {
+  for (const Range& range : kMapRanges) {
+    ASSERT_TRUE(MapRange(range, false, false));
+  }
+
+  const Range kRemappedRange(kMapRanges[1].addr, kMapRanges[1].size, 0x1234,
+                             0x5678);
+  ASSERT_TRUE(MapRange(kRemappedRange, true, false));
+  EXPECT_EQ(arraysize(kMapRanges), mapper_->GetNumMappedRanges());
+  TestMappedRange(kMapRanges[0], 0);
+  TestMappedRange(kRemappedRange, kMapRanges[0].size);
+  TestMappedRange(kMapRanges[3], kMapRanges[0].size + kMapRanges[1].size +
+                                     kMapRanges[2].size);
+
+  // A range that doesn't fit in any gap goes at the end.
+  const Range kNewRange(0x40000000, 0x2000000, 0xabcd, 0);
+  ASSERT_TRUE(MapRange(kNewRange, false, false));
+  TestMappedRange(kNewRange, mapper_->GetMaxMappedLength() - kNewRange.size);
+}
+
+// Makes sure a copy of a mapper has the same mappings, and is independent.
+TEST_F(AddressMapperTest, Copy) {
+  for (const Range& range : kMapRanges) {
+    ASSERT_TRUE(MapRange(range, false, false));
+  }
+
+  AddressMapper copy(*mapper_);
+  EXPECT_EQ(mapper_->GetNumMappedRanges(), copy.GetNumMappedRanges());
+  EXPECT_EQ(mapper_->GetMaxMappedLength(), copy.GetMaxMappedLength());
+  for (const Range& range : kMapRanges) {
+    uint64_t mapped_addr, copy_mapped_addr;
+    AddressMapper::MappingList::const_iterator iter, copy_iter;
+    ASSERT_TRUE(mapper_->GetMappedAddressAndListIterator(range.addr,
+                                                         &mapped_addr, &iter));
+    ASSERT_TRUE(copy.GetMappedAddressAndListIterator(
+        range.addr, &copy_mapped_addr, &copy_iter));
+    EXPECT_EQ(mapped_addr, copy_mapped_addr);
+  }
+
+  ASSERT_TRUE(copy.MapWithID(0x40000000, 0x1000, 0xabcd, 0, false, false));
+  EXPECT_EQ(arraysize(kMapRanges) + 1, copy.GetNumMappedRanges());
+  EXPECT_EQ(arraysize(kMapRanges), mapper_->GetNumMappedRanges());
+}
+
 }  // namespace quipper
@@ -1,9 +1,11 @@
 #include "arm_spe_decoder.h"
 
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <ios>
 #include <string_view>
+#include <vector>
 
 #include "base/logging.h"
 #include "binary_data_utils.h"
@@ -40,6 +42,50 @@ const uint64_t kAddrPktHdrIndexDataVirt = 0x2;
 const uint64_t kAddrPktHdrIndexDataPhys = 0x3;
 const uint64_t kAddrPktHdrIndexPrevBr = 0x4;
 
+// The type of packet a header byte starts.
+enum PacketType : uint8_t {
+  kPacketUnknown,
+  kPacketPadding,
+  kPacketEnd,
+  kPacketTimestamp,
+  kPacketEvent,
+  kPacketDataSource,
+  kPacketContext,
+  kPacketOperation,
+  // The first byte of a two byte header, or of alignment padding.
+  kPacketExtended,
+  kPacketAddress,
+  kPacketCounter,
+};
+
+// Returns the type of packet |header| starts. The checks are in order of
+// precedence, as some of the masks overlap.
+constexpr PacketType ClassifyHeader(uint8_t header) {
+  if (header == 0x0) return kPacketPadding;
+  if (header == 0x1) return kPacketEnd;
+  if (header == 0x71) return kPacketTimestamp;
+  if ((header & HdrMaskEvSrc()) == 0x42) return kPacketEvent;
+  if ((header & HdrMaskEvSrc()) == 0x43) return kPacketDataSource;
+  if ((header & HdrMaskCtxOpExt()) == 0x64) return kPacketContext;
+  if ((header & HdrMaskCtxOpExt()) == 0x48) return kPacketOperation;
+  if ((header & HdrMaskCtxOpExt()) == 0x20) return kPacketExtended;
+  if ((header & HdrMaskAddrCtr()) == 0xb0) return kPacketAddress;
+  if ((header & HdrMaskAddrCtr()) == 0x98) return kPacketCounter;
+  return kPacketUnknown;
+}
+
+constexpr std::array<PacketType, 256> MakePacketTypes() {
+  std::array<PacketType, 256> types{};
+  for (int header = 0; header < 256; ++header) {
+    types[header] = ClassifyHeader(header);
+  }
+  return types;
+}
+
+// The packet type of every header byte, so that a packet is dispatched with a
+// single lookup instead of a chain of masked comparisons.
+constexpr std::array<PacketType, 256> kPacketTypes = MakePacketTypes();
+
 // Returns the payload size according to the given header.
 inline size_t GetPayloadSize(uint8_t header) {
   return 1U << ((header & Mask(5, 4)) >> 4);
@@ -64,66 +110,11 @@ bool ArmSpeDecoder::NextRecord(struct Record* ret_record) {
   for (Packet p{}; !p.is_end_type && buf_i_ < buf_.size(); buf_i_ += p.size) {
     p = Packet{};
     p.header = buf_[buf_i_];
-
-    // Padding packet
-    if (p.header == 0x0) {
-      if (!HandlePacketPadding(&p)) {
-        return false;
-      }
-      continue;
-    }
-
-    // End packet
-    if (p.header == 0x1) {
-      if (!HandlePacketEnd(&p)) {
-        return false;
-      }
-      continue;
-    }
-
-    // Timestamp packet
-    if (p.header == 0x71) {
-      if (!HandlePacketTimestamp(&p, &record)) {
-        return false;
-      }
-      continue;
-    }
-
-    // Event packet
-    if ((p.header & HdrMaskEvSrc()) == 0x42) {
-      if (!HandlePacketEvent(&p, &record)) {
-        return false;
-      }
-      continue;
-    }
-
-    // Data source packet
-    if ((p.header & HdrMaskEvSrc()) == 0x43) {
-      if (!HandlePacketDataSource(&p, &record)) {
-        return false;
-      }
-      continue;
-    }
-
-    // Context packet
-    if ((p.header & HdrMaskCtxOpExt()) == 0x64) {
-      if (!HandlePacketContext(&p, &record)) {
-        return false;
-      }
-      continue;
-    }
-
-    // Operation packet
-    if ((p.header & HdrMaskCtxOpExt()) == 0x48) {
-      if (!HandlePacketOperation(&p, &record)) {
-        return false;
-      }
-      continue;
-    }
+    PacketType type = kPacketTypes[p.header];
 
     // Check if the header is an extended header, it has effect to later types
     // of packets.
-    if ((p.header & HdrMaskCtxOpExt()) == 0x20) {
+    if (type == kPacketExtended) {
       if (buf_.size() - buf_i_ == 1) {
         LOG(ERROR) << "Bad binary trace for extended header";
         return false;
@@ -144,37 +135,83 @@ bool ArmSpeDecoder::NextRecord(struct Record* ret_record) {
             alignment - (((uintptr_t)(buf_.data() + buf_i_)) & (alignment - 1));
         continue;
       }
-    }
-
-    // Address packet
-    if ((GetCorrectHeader(p) & HdrMaskAddrCtr()) == 0xb0) {
-      if (!HandlePacketAddress(&p, &record)) {
-        return false;
+      // Only address and counter packets have extended headers.
+      type = kPacketTypes[p.ext_header];
+      if (type != kPacketAddress && type != kPacketCounter) {
+        type = kPacketUnknown;
       }
-      continue;
     }
 
-    // Counter packet.
-    if ((GetCorrectHeader(p) & HdrMaskAddrCtr()) == 0x98) {
-      if (!HandlePacketCounter(&p, &record)) {
+    bool ok;
+    switch (type) {
+      case kPacketPadding:
+        ok = HandlePacketPadding(&p);
+        break;
+      case kPacketEnd:
+        ok = HandlePacketEnd(&p);
+        break;
+      case kPacketTimestamp:
+        ok = HandlePacketTimestamp(&p, &record);
+        break;
+      case kPacketEvent:
+        ok = HandlePacketEvent(&p, &record);
+        break;
+      case kPacketDataSource:
+        ok = HandlePacketDataSource(&p, &record);
+        break;
+      case kPacketContext:
+        ok = HandlePacketContext(&p, &record);
+        break;
+      case kPacketOperation:
+        ok = HandlePacketOperation(&p, &record);
+        break;
+      case kPacketAddress:
+        ok = HandlePacketAddress(&p, &record);
+        break;
+      case kPacketCounter:
+        ok = HandlePacketCounter(&p, &record);
+        break;
+      default:
+        // Reaching here means the header does not match any known packet. So
+        // report an error.
+        LOG(ERROR) << "Unknown SPE packet header " << std::hex << (int)p.header
+                   << std::dec;
         return false;
-      }
-      continue;
     }
-
-    // Reaching here means the header does not match any known packet. So report
-    // an error.
-    LOG(ERROR) << "Unknown SPE packet header " << std::hex << (int)p.header
-               << std::dec;
-    return false;
+    if (!ok) {
+      return false;
+    }
   }
 
   *ret_record = record;
   return true;
 }
 
+bool ArmSpeDecoder::NextRecords(size_t max_records,
+                                std::vector<Record>* records) {
+  records->resize(max_records);
+  size_t num_records = 0;
+  while (num_records < max_records && NextRecord(&(*records)[num_records])) {
+    ++num_records;
+  }
+  records->resize(num_records);
+  return num_records > 0;
+}
+
 bool ArmSpeDecoder::HandlePacketPadding(struct Packet* p) {
-  p->size = 1;
+  // Padding comes in runs, e.g. to align records or to fill the rest of an
+  // aux buffer, so skip the whole run, a word at a time while it lasts.
+  size_t i = buf_i_ + 1;
+  for (uint64_t word; buf_.size() - i >= sizeof(word); i += sizeof(word)) {
+    memcpy(&word, buf_.data() + i, sizeof(word));
+    if (word != 0) {
+      break;
+    }
+  }
+  while (i < buf_.size() && buf_[i] == 0x0) {
+    ++i;
+  }
+  p->size = i - buf_i_;
   return true;
 }
 
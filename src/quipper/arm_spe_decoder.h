@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <optional>
 #include <string_view>
+#include <vector>
 
 namespace quipper {
 
@@ -121,6 +122,12 @@ class ArmSpeDecoder {
   // data or reaching the end of the trace.
   bool NextRecord(struct Record* record);
 
+  // Replaces the contents of |records| with up to |max_records| records parsed
+  // from the trace, reusing its storage, so that a trace can be decoded in
+  // batches. Returns false if no record could be parsed, because of invalid
+  // data or reaching the end of the trace.
+  bool NextRecords(size_t max_records, std::vector<Record>* records);
+
  private:
   struct Packet {
     uint8_t header;
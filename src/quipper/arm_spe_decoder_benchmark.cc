@@ -0,0 +1,80 @@
+// Copyright 2024 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures decoding an Arm SPE trace made of the two records of
+// arm_spe_decoder_test.cc over and over, padding included.
+
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "arm_spe_decoder.h"
+#include "benchmark/benchmark.h"
+
+namespace quipper {
+namespace {
+
+constexpr const char* kRecordPackets[] = {
+    // A load.
+    "b0 d0 c2 a1 ed 66 ba ff c0", "00 00 00 00 00", "65 80 5f 00 00", "49 00",
+    "52 16 00", "99 04 00", "98 0c 00", "b2 28 6b 09 03 37 0e ff 00",
+    "9a 01 00", "00 00 00 00 00 00 00 00 00", "43 00", "00 00",
+    "71 2e 65 2f 6a 0a 00 00 00",
+    // A conditional branch.
+    "b0 e0 b0 ef ed 66 ba ff c0", "00 00 00 00 00", "65 0e 00 00 00", "4a 01",
+    "52 42 00", "99 10 00", "98 11 00", "b1 e4 b0 ef ed 66 ba ff c0",
+    "00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00",
+    "71 8d 65 2f 6a 0a 00 00 00",
+};
+
+constexpr int kNumRecordPairs = 1 << 14;
+
+// Returns kNumRecordPairs copies of the two records of kRecordPackets.
+std::string MakeTrace() {
+  std::string records;
+  for (const char* packet : kRecordPackets) {
+    for (const char* p = packet; *p != '\0';) {
+      char* end;
+      records.push_back(static_cast<char>(std::strtoul(p, &end, 16)));
+      p = end;
+    }
+  }
+  std::string trace;
+  for (int i = 0; i < kNumRecordPairs; ++i) trace += records;
+  return trace;
+}
+
+void BM_NextRecord(benchmark::State& state) {
+  const std::string trace = MakeTrace();
+  ArmSpeDecoder::Record record;
+  for (auto _ : state) {
+    ArmSpeDecoder decoder(trace, false);
+    while (decoder.NextRecord(&record)) {
+      benchmark::DoNotOptimize(record);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * kNumRecordPairs);
+  state.SetBytesProcessed(state.iterations() * trace.size());
+}
+BENCHMARK(BM_NextRecord);
+
+void BM_NextRecords(benchmark::State& state) {
+  const std::string trace = MakeTrace();
+  std::vector<ArmSpeDecoder::Record> records;
+  for (auto _ : state) {
+    ArmSpeDecoder decoder(trace, false);
+    while (decoder.NextRecords(state.range(0), &records)) {
+      benchmark::DoNotOptimize(records.data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * kNumRecordPairs);
+  state.SetBytesProcessed(state.iterations() * trace.size());
+}
+BENCHMARK(BM_NextRecords)->Arg(256);
+
+}  // namespace
+}  // namespace quipper
+
+BENCHMARK_MAIN();
@@ -172,4 +172,47 @@ TEST(ArmSpeDecoderTest, ReturnFalseUponInvalidData) {
   EXPECT_FALSE(decoder.NextRecord(&tmp));
 }
 
+TEST(ArmSpeDecoderTest, NextRecordsMatchesNextRecord) {
+  std::string trace = GenerateBinaryTrace(SampleSPEPackets);
+  ArmSpeDecoder decoder(trace, false);
+  ArmSpeDecoder::Record record[2];
+  ASSERT_TRUE(decoder.NextRecord(&record[0]));
+  ASSERT_TRUE(decoder.NextRecord(&record[1]));
+
+  for (size_t batch_size : {1, 2, 256}) {
+    ArmSpeDecoder batch_decoder(trace, false);
+    std::vector<ArmSpeDecoder::Record> records;
+    std::vector<ArmSpeDecoder::Record> all_records;
+    while (batch_decoder.NextRecords(batch_size, &records)) {
+      EXPECT_LE(records.size(), batch_size);
+      all_records.insert(all_records.end(), records.begin(), records.end());
+    }
+    EXPECT_TRUE(records.empty());
+    ASSERT_EQ(2, all_records.size()) << "batch size " << batch_size;
+    EXPECT_TRUE(CheckEqual(all_records[0], record[0]));
+    EXPECT_TRUE(CheckEqual(all_records[1], record[1]));
+  }
+}
+
+TEST(ArmSpeDecoderTest, SkipsLongPadding) {
+  std::vector<std::string> packets = SampleSPEPackets;
+  // Pad the first record with more than a word of padding at a time.
+  std::string padding;
+  for (int i = 0; i < 21; ++i) padding += "00 ";
+  packets.insert(packets.begin() + 1, padding);
+  std::string trace = GenerateBinaryTrace(SampleSPEPackets);
+  std::string padded_trace = GenerateBinaryTrace(packets);
+  ASSERT_EQ(trace.size() + 21, padded_trace.size());
+
+  ArmSpeDecoder decoder(trace, false);
+  ArmSpeDecoder padded_decoder(padded_trace, false);
+  ArmSpeDecoder::Record record, padded_record;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(decoder.NextRecord(&record));
+    ASSERT_TRUE(padded_decoder.NextRecord(&padded_record));
+    EXPECT_TRUE(CheckEqual(padded_record, record));
+  }
+  EXPECT_FALSE(padded_decoder.NextRecord(&padded_record));
+}
+
 }  // namespace quipper
@@ -13,6 +13,8 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>  
+#include <functional>
+#include <memory>
 
 #include "base/logging.h"
 
@@ -25,16 +27,26 @@ const int kNumHexDigitsInByte = 2;
 
 namespace quipper {
 
+namespace {
+
+struct EvpMdCtxDeleter {
+  void operator()(EVP_MD_CTX* ctx) const { EVP_MD_CTX_free(ctx); }
+};
+
+}  // namespace
+
 static uint64_t Md5Prefix(const unsigned char* data,
                           unsigned long length) {  
   uint64_t digest_prefix = 0;
   unsigned char digest[MD5_DIGEST_LENGTH + 1];
 
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
-  EVP_DigestUpdate(ctx, data, length);
-  EVP_DigestFinal(ctx, digest, NULL);
-  EVP_MD_CTX_free(ctx);
+  // The digest context is reused by the calls on each thread, rather than
+  // being allocated for every digest. EVP_DigestInit_ex() resets it.
+  thread_local std::unique_ptr<EVP_MD_CTX, EvpMdCtxDeleter> ctx(
+      EVP_MD_CTX_new());
+  EVP_DigestInit_ex(ctx.get(), EVP_md5(), NULL);
+  EVP_DigestUpdate(ctx.get(), data, length);
+  EVP_DigestFinal_ex(ctx.get(), digest, NULL);
   // We need 64-bits / # of bits in a byte.
   for (size_t i = 0; i < sizeof(uint64_t); i++) {
     digest_prefix = (digest_prefix << 8) | digest[i];
@@ -52,6 +64,29 @@ uint64_t Md5Prefix(const std::vector<char>& input) {
   return Md5Prefix(data, input.size());
 }
 
+uint64_t Md5PrefixCache::Get(std::string_view input) {
+  Shard& shard = shards_[std::hash<std::string_view>()(input) % kNumShards];
+  std::lock_guard<std::mutex> lock(shard.mu);
+  auto it = shard.prefixes.find(input);
+  if (it != shard.prefixes.end()) return it->second;
+  const uint64_t prefix = Md5Prefix(
+      reinterpret_cast<const unsigned char*>(input.data()), input.size());
+  if (shard.strings.size() < kMaxStringsPerShard) {
+    shard.strings.emplace_back(input);
+    shard.prefixes.emplace(shard.strings.back(), prefix);
+  }
+  return prefix;
+}
+
+size_t Md5PrefixCache::size() const {
+  size_t size = 0;
+  for (const Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    size += shard.strings.size();
+  }
+  return size;
+}
+
 std::string RawDataToHexString(const u8* array, size_t length) {
   // Convert the bytes to hex digits one at a time.
   // There will be kNumHexDigitsInByte hex digits, and 1 char for NUL.
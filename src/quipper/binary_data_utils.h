@@ -10,7 +10,12 @@
 #include <stdint.h>
 
 #include <bitset>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "kernel/perf_internals.h"
@@ -39,6 +44,40 @@ size_t GetNumBits(const T& value) {
 uint64_t Md5Prefix(const std::string& input);
 uint64_t Md5Prefix(const std::vector<char>& input);
 
+// Memoizes Md5Prefix() of strings that repeat many times within a perf.data
+// file, such as the file names of MMAP events and the comms of COMM events.
+// The strings are interned, so each distinct string is hashed with MD5 once.
+// It is safe to use from several threads at once.
+class Md5PrefixCache {
+ public:
+  Md5PrefixCache() = default;
+  Md5PrefixCache(const Md5PrefixCache&) = delete;
+  Md5PrefixCache& operator=(const Md5PrefixCache&) = delete;
+
+  // Returns Md5Prefix(input).
+  uint64_t Get(std::string_view input);
+
+  // Returns the number of strings cached.
+  size_t size() const;
+
+ private:
+  // The cache is split into shards with their own locks, so that threads
+  // looking up different strings rarely wait for each other.
+  static constexpr size_t kNumShards = 16;
+  // The most strings a shard holds. Inputs with more distinct strings than
+  // that, e.g. with a unique file name per JIT dump, get the prefixes of the
+  // other strings computed on every lookup, which bounds the memory used.
+  static constexpr size_t kMaxStringsPerShard = 1 << 16;
+
+  struct Shard {
+    mutable std::mutex mu;
+    // The interned strings, which the keys of |prefixes| point into.
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, uint64_t> prefixes;
+  };
+  Shard shards_[kNumShards];
+};
+
 // Returns a string that represents |array| in hexadecimal.
 std::string RawDataToHexString(const u8* array, size_t length);
 
@@ -4,6 +4,10 @@
 
 #include "binary_data_utils.h"
 
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "compat/test.h"
 #include "test_utils.h"
 
@@ -22,6 +26,34 @@ TEST(BinaryDataUtilsTest, MD5) {
             0xe4d909c290d0fb1cLL);
 }
 
+TEST(BinaryDataUtilsTest, Md5PrefixCache) {
+  Md5PrefixCache cache;
+  EXPECT_EQ(cache.Get(""), 0xd41d8cd98f00b204LL);
+  EXPECT_EQ(cache.Get("jk8ssl"), 0x0000000018e6137aLL);
+  EXPECT_EQ(cache.Get("jk8ssl"), 0x0000000018e6137aLL);
+  EXPECT_EQ(2, cache.size());
+
+  // Look the same strings up from several threads.
+  std::vector<std::string> names;
+  for (int i = 0; i < 100; ++i) {
+    names.push_back("/tmp/perf-" + std::to_string(i) + ".map");
+  }
+  std::vector<std::thread> threads;
+  std::vector<bool> matches(4, true);
+  for (size_t t = 0; t < matches.size(); ++t) {
+    threads.emplace_back([&, t] {
+      for (int round = 0; round < 10; ++round) {
+        for (const std::string& name : names) {
+          if (cache.Get(name) != Md5Prefix(name)) matches[t] = false;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (bool match : matches) EXPECT_TRUE(match);
+  EXPECT_EQ(2 + names.size(), cache.size());
+}
+
 TEST(BinaryDataUtilsTest, Align) {
   EXPECT_EQ(12, Align<4>(10));
   EXPECT_EQ(12, Align<4>(12));
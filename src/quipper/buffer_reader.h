@@ -22,6 +22,8 @@ class BufferReader : public DataReader {
 
   size_t Tell() const override { return offset_; }
 
+  const char* data() const override { return buffer_; }
+
   bool ReadData(const size_t size, void* dest) override;
 
   // Reads |size| bytes of the buffer as a null-terminated string into |str|.
@@ -70,6 +70,13 @@ TEST(BufferReaderTest, ReadSingleChunk) {
   EXPECT_EQ(kInputData, std::string(output.begin(), output.end()));
 }
 
+// The buffer can be parsed in place.
+TEST(BufferReaderTest, ExposesData) {
+  const std::string kInputData = "abcdefghijklmnopqrstuvwxyz";
+  BufferReader reader(kInputData.data(), kInputData.size());
+  EXPECT_EQ(kInputData.data(), reader.data());
+}
+
 // Test the ReadDataValue() function, which is a wrapper around ReadData().
 TEST(BufferReaderTest, ReadDataValue) {
   const std::string kInputData = "abcdefghijklmnopqrstuvwxyz";
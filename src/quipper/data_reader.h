@@ -27,6 +27,10 @@ class DataReader {
 
   virtual size_t size() const { return size_; }
 
+  // Returns all the data if it is held in memory, so that it can be parsed in
+  // place, or nullptr if it can only be read through ReadData().
+  virtual const char* data() const { return nullptr; }
+
   // Reads raw data into |dest|. Returns true if it managed to read |size|
   // bytes.
   virtual bool ReadData(const size_t size, void* dest) = 0;
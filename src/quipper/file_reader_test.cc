@@ -39,6 +39,17 @@ TEST(FileReaderTest, MoveOffset) {
   EXPECT_EQ(500, reader.Tell());
 }
 
+// The file contents are only available through ReadData().
+TEST(FileReaderTest, DoesNotExposeData) {
+  std::vector<uint8_t> input_data(10);
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_data));
+
+  FileReader reader(input_file.path());
+  EXPECT_EQ(nullptr, reader.data());
+}
+
 // Make sure that the reader can handle a read size of zero.
 TEST(FileReaderTest, ReadZeroBytes) {
   std::vector<uint8_t> input_data(10);
@@ -416,7 +416,8 @@ enum perf_user_event_type {
   PERF_RECORD_EVENT_UPDATE = 78,
   PERF_RECORD_TIME_CONV = 79,
   PERF_RECORD_HEADER_FEATURE = 80,
-  PERF_RECORD_HEADER_MAX = 81,
+  PERF_RECORD_COMPRESSED = 81,
+  PERF_RECORD_HEADER_MAX = 82,
 };
 
 enum auxtrace_error_type {
@@ -609,6 +610,18 @@ struct feature_event {
   char data[];
 };
 
+struct compressed_event {
+  struct perf_event_header header;
+  char data[];
+};
+
+// Compression algorithms recorded in the HEADER_COMPRESSED feature.
+enum perf_compress_type {
+  PERF_COMP_NONE = 0,
+  PERF_COMP_ZSTD,
+  PERF_COMP_MAX
+};
+
 union perf_event {
   struct perf_event_header header;
   struct mmap_event mmap;
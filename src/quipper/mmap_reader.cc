@@ -0,0 +1,97 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mmap_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+#include "base/logging.h"
+
+namespace quipper {
+
+MmapReader::MmapReader(const std::string& filename)
+    : is_open_(false), data_(nullptr), offset_(0) {
+  size_ = 0;
+  // Only regular files can be mapped. Anything else, like a FIFO, isn't even
+  // opened: closing it again would leave a FIFO without a reader until the
+  // caller reopens it, and kill a writer with SIGPIPE in the meantime.
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+  if (st.st_size == 0) {
+    // mmap() rejects empty mappings; an empty file is still a valid input.
+    close(fd);
+    is_open_ = true;
+    return;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (addr == MAP_FAILED) {
+    PLOG(WARNING) << "mmap failure for file " << filename;
+    return;
+  }
+  // perf.data files are mostly read front to back, so let the kernel read
+  // ahead aggressively and drop pages behind the read position.
+  if (madvise(addr, st.st_size, MADV_SEQUENTIAL) != 0) {
+    PLOG(WARNING) << "madvise failure for file " << filename;
+  }
+  data_ = static_cast<const char*>(addr);
+  size_ = st.st_size;
+  is_open_ = true;
+}
+
+MmapReader::~MmapReader() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+bool MmapReader::SeekSet(size_t offset) {
+  if (offset > size_) {
+    LOG(ERROR) << "Illegal offset " << offset << " in file of size " << size_;
+    return false;
+  }
+  offset_ = offset;
+  return true;
+}
+
+bool MmapReader::ReadData(const size_t size, void* dest) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+  if (size == 0) return true;
+
+  memcpy(dest, data_ + offset_, size);
+  offset_ += size;
+  return true;
+}
+
+bool MmapReader::ReadString(size_t size, std::string* str) {
+  if (offset_ > SIZE_MAX - size || offset_ + size > size_) return false;
+  if (size == 0) {
+    str->clear();
+    return true;
+  }
+
+  size_t actual_length = strnlen(data_ + offset_, size);
+  *str = std::string(data_ + offset_, actual_length);
+  offset_ += size;
+  return true;
+}
+
+}  // namespace quipper
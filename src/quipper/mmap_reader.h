@@ -0,0 +1,59 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_MMAP_READER_H_
+#define CHROMIUMOS_WIDE_PROFILING_MMAP_READER_H_
+
+#include <string>
+
+#include "data_reader.h"
+
+namespace quipper {
+
+// Read from an input file by mapping it into memory. Must be a normal file;
+// other files, like FIFOs, aren't opened, and IsOpen() returns false.
+// Unlike FileReader, reads are served straight from the page cache, without
+// going through stdio buffers, and the whole contents are available through
+// data() so callers can parse the file in place.
+class MmapReader : public DataReader {
+ public:
+  explicit MmapReader(const std::string& filename);
+  virtual ~MmapReader();
+
+  bool IsOpen() const { return is_open_; }
+
+  // Returns the mapped contents of the file, which remain valid for the
+  // lifetime of the reader. Returns nullptr if the file is empty or could not
+  // be mapped.
+  const char* data() const override { return data_; }
+
+  bool SeekSet(size_t offset) override;
+
+  size_t Tell() const override { return offset_; }
+
+  bool ReadData(const size_t size, void* dest) override;
+
+  // Reads |size| bytes of the file as a null-terminated string into |str|.
+  // Trailing nulls, if any, are not added to the string, but they are skipped
+  // over. If there is no null terminator within these |size| bytes, then the
+  // string is automatically terminated after |size| bytes.
+  bool ReadString(const size_t size, std::string* str) override;
+
+ private:
+  // Whether the file was opened and mapped successfully.
+  bool is_open_;
+
+  // The mapped file contents.
+  const char* data_;
+
+  // Data read offset from the start of |data_|.
+  size_t offset_;
+
+  MmapReader(const MmapReader&) = delete;
+  MmapReader& operator=(const MmapReader&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_MMAP_READER_H_
@@ -0,0 +1,158 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mmap_reader.h"
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "compat/test.h"
+#include "file_utils.h"
+#include "scoped_temp_path.h"
+#include "test_utils.h"
+
+namespace quipper {
+
+// Opening a missing file should fail cleanly.
+TEST(MmapReaderTest, MissingFile) {
+  ScopedTempDir temp_dir;
+  MmapReader reader(temp_dir.path() + "does_not_exist");
+  EXPECT_FALSE(reader.IsOpen());
+  EXPECT_EQ(0, reader.size());
+  EXPECT_EQ(nullptr, reader.data());
+}
+
+// A FIFO can't be mapped, and isn't opened at all: opening it would block
+// until a writer shows up.
+TEST(MmapReaderTest, Fifo) {
+  ScopedTempDir temp_dir;
+  const std::string fifo = temp_dir.path() + "fifo";
+  ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600));
+  MmapReader reader(fifo);
+  EXPECT_FALSE(reader.IsOpen());
+  EXPECT_EQ(nullptr, reader.data());
+}
+
+// An empty file can be opened, but there is nothing to read.
+TEST(MmapReaderTest, EmptyFile) {
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), std::string()));
+
+  MmapReader reader(input_file.path());
+  EXPECT_TRUE(reader.IsOpen());
+  EXPECT_EQ(0, reader.size());
+  EXPECT_TRUE(reader.ReadData(0, nullptr));
+  uint8_t byte;
+  EXPECT_FALSE(reader.ReadData(1, &byte));
+}
+
+// Move the cursor around and make sure the offset is properly set each time.
+TEST(MmapReaderTest, MoveOffset) {
+  std::vector<uint8_t> input_data(1000);
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_data));
+
+  MmapReader reader(input_file.path());
+  EXPECT_EQ(input_data.size(), reader.size());
+  EXPECT_EQ(0, reader.Tell());
+
+  EXPECT_TRUE(reader.SeekSet(100));
+  EXPECT_EQ(100, reader.Tell());
+  EXPECT_TRUE(reader.SeekSet(900));
+  EXPECT_EQ(900, reader.Tell());
+
+  // The cursor can't be set to past the end of the file.
+  EXPECT_FALSE(reader.SeekSet(1200));
+  EXPECT_EQ(900, reader.Tell());
+}
+
+// The mapped contents are exposed directly.
+TEST(MmapReaderTest, ExposesMappedData) {
+  const std::string kInputData = "abcdefghijklmnopqrstuvwxyz";
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), kInputData));
+  MmapReader reader(input_file.path());
+
+  ASSERT_TRUE(reader.IsOpen());
+  ASSERT_NE(nullptr, reader.data());
+  EXPECT_EQ(kInputData, std::string(reader.data(), reader.size()));
+}
+
+// Read in all data from the input file in multiple chunks, but not in order.
+TEST(MmapReaderTest, ReadWithJumps) {
+  // This string contains four parts, each 10 characters long.
+  const std::string kInputData =
+      "0:abcdefg;"
+      "1:hijklmn;"
+      "2:opqrstu;"
+      "3:vwxyzABC";
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), kInputData));
+  MmapReader reader(input_file.path());
+
+  std::vector<uint8_t> output(10);
+
+  EXPECT_TRUE(reader.SeekSet(10));
+  EXPECT_TRUE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(20, reader.Tell());
+  EXPECT_EQ("1:hijklmn;", std::string(output.begin(), output.end()));
+
+  EXPECT_TRUE(reader.SeekSet(30));
+  EXPECT_TRUE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(40, reader.Tell());
+  EXPECT_EQ("3:vwxyzABC", std::string(output.begin(), output.end()));
+
+  EXPECT_TRUE(reader.SeekSet(0));
+  EXPECT_TRUE(reader.ReadData(10, output.data()));
+  EXPECT_EQ(10, reader.Tell());
+  EXPECT_EQ("0:abcdefg;", std::string(output.begin(), output.end()));
+}
+
+// Test reading past the end of the file.
+TEST(MmapReaderTest, ReadPastEndOfData) {
+  const std::string kInputData = "abcdefghijklmnopqrstuvwxyz";
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), kInputData));
+  MmapReader reader(input_file.path());
+
+  std::vector<uint8_t> output(kInputData.size());
+  EXPECT_FALSE(reader.ReadData(30, output.data()));
+  // The read pointer should not have moved.
+  EXPECT_EQ(0, reader.Tell());
+  EXPECT_TRUE(reader.SeekSet(5));
+  EXPECT_FALSE(reader.ReadData(SIZE_MAX, output.data()));
+  EXPECT_EQ(5, reader.Tell());
+}
+
+// Test string reads.
+TEST(MmapReaderTest, ReadString) {
+  std::string input_string("The quick brown fox jumps over the lazy dog.");
+  std::string input_string_with_padding(input_string);
+  input_string_with_padding.resize(input_string.size() + 10, '\0');
+
+  ScopedTempFile input_file;
+  ASSERT_TRUE(BufferToFile(input_file.path(), input_string_with_padding));
+  MmapReader reader(input_file.path());
+
+  // Attempt to read past the end of the string.
+  std::string output = "previous string value";
+  EXPECT_FALSE(reader.ReadString(input_string_with_padding.size() + 1,
+                                 &output));
+  EXPECT_EQ("previous string value", output);
+
+  // Read everything including the padding.
+  EXPECT_TRUE(reader.ReadString(input_string_with_padding.size(), &output));
+  // The reader should have read past the padding too.
+  EXPECT_EQ(input_string_with_padding.size(), reader.Tell());
+  // However, the output string itself should not have padding.
+  EXPECT_EQ(input_string, output);
+}
+
+}  // namespace quipper
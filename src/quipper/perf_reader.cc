@@ -10,11 +10,13 @@
 #include <sys/time.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <limits>
 #include <map>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -27,6 +29,7 @@
 #include "file_utils.h"
 #include "kernel/perf_event.h"
 #include "kernel/perf_internals.h"
+#include "mmap_reader.h"
 #include "perf_buildid.h"
 #include "perf_data_structures.h"
 #include "perf_data_utils.h"
@@ -210,11 +213,11 @@ bool ReadPerfFileSection(DataReader* data, struct perf_file_section* section) {
   return true;
 }
 
-// Returns true if |e1| has an earlier timestamp than |e2|. Used to sort an
-// array of events.
-static bool CompareEventTimes(const PerfEvent* e1, const PerfEvent* e2) {
-  return e1->timestamp() < e2->timestamp();
-}
+// A round with more ascending runs of events than this, and fewer than
+// |kMinEventsPerRun| events per run on average, is sorted before the runs of
+// all the rounds are merged.
+const size_t kMaxEventRunsPerRound = 256;
+const size_t kMinEventsPerRun = 16;
 
 // Returns true if the mmap was generated when parsing the /proc/PID/maps timed
 // out.
@@ -444,7 +447,16 @@ bool ByteSwapEventDataVariablePayloadFields(event_t* event) {
 }  // namespace
 
 PerfReader::PerfReader()
-    : proto_(Arena::Create<PerfDataProto>(&arena_)), is_cross_endian_(false) {
+    : proto_(Arena::Create<PerfDataProto>(&arena_)),
+      is_cross_endian_(false),
+      order_streamed_events_(false),
+      max_streamed_timestamp_(0),
+      round_flush_timestamp_(0),
+      num_threads_(1),
+      num_piped_headers_(0),
+      num_piped_event_types_(0),
+      compression_type_(PERF_COMP_NONE),
+      compression_mmap_len_(0) {
   // The metadata mask is stored in |proto_|. It should be initialized to 0
   // since it is used heavily.
   proto_->add_metadata_mask(0);
@@ -480,6 +492,12 @@ bool PerfReader::Deserialize(const PerfDataProto& perf_data_proto) {
 }
 
 bool PerfReader::ReadFile(const std::string& filename) {
+  // Prefer reading the file in place from a memory mapping, and fall back to
+  // stdio for inputs that cannot be mapped.
+  MmapReader mmap_reader(filename);
+  if (mmap_reader.IsOpen()) {
+    return ReadFromData(&mmap_reader);
+  }
   FileReader reader(filename);
   if (!reader.IsOpen()) {
     LOG(ERROR) << "Unable to open file " << filename;
@@ -781,21 +799,113 @@ void PerfReader::GetFilenamesToBuildIDs(
   }
 }
 
-void PerfReader::MaybeSortEventsByTime() {
+bool PerfReader::EventsHaveTimestamps() const {
   // Events can not be sorted by time if PERF_SAMPLE_TIME is not set in
   // attr.sample_type for all attrs.
   for (const auto& attr : attrs()) {
     if (!(attr.attr().sample_type() & PERF_SAMPLE_TIME)) {
-      return;
+      return false;
     }
   }
+  return true;
+}
+
+void PerfReader::MaybeSortEventsByTime() {
+  if (!EventsHaveTimestamps()) return;
 
   // Sort the events based on timestamp.
 
-  // This sorts the pointers in the proto-internal vector, which
-  // requires no copying and less external space.
-  std::stable_sort(proto_->mutable_events()->pointer_begin(),
-                   proto_->mutable_events()->pointer_end(), CompareEventTimes);
+  // Perf writes events in rounds: at each PERF_RECORD_FINISHED_ROUND, the
+  // events of the ring buffers so far have been written. Within a round, the
+  // events of each ring buffer are in order, so a round consists of a few
+  // ascending runs. Rounds that don't (e.g. with timestamps from clocks that
+  // aren't monotonic) are stable sorted. Then all the ascending runs are
+  // merged, which takes O(n log runs) rather than O(n log n) time. This sorts
+  // the pointers in the proto-internal vector, which requires no copying of
+  // the events. The timestamps are copied next to the pointers so that
+  // comparisons don't have to chase them.
+  using TimedEvent = std::pair<uint64_t, PerfEvent*>;
+  auto earlier = [](const TimedEvent& a, const TimedEvent& b) {
+    return a.first < b.first;
+  };
+  const auto events = proto_->mutable_events()->pointer_begin();
+  const size_t num_events = proto_->events_size();
+  std::vector<TimedEvent> timed_events(num_events);
+  std::vector<size_t> round_ends;
+  for (size_t i = 0; i < num_events; ++i) {
+    timed_events[i] = {events[i]->timestamp(), events[i]};
+    if (events[i]->header().type() == PERF_RECORD_FINISHED_ROUND)
+      round_ends.push_back(i + 1);
+  }
+  if (round_ends.empty() || round_ends.back() != num_events)
+    round_ends.push_back(num_events);
+
+  std::atomic<size_t> next_round(0);
+  auto sort_rounds = [&]() {
+    for (size_t i = next_round++; i < round_ends.size(); i = next_round++) {
+      auto begin = timed_events.begin() + (i == 0 ? 0 : round_ends[i - 1]);
+      auto end = timed_events.begin() + round_ends[i];
+      size_t num_runs = 1;
+      for (auto it = begin; it + 1 < end; ++it) {
+        if (earlier(*(it + 1), *it)) ++num_runs;
+      }
+      if (num_runs > kMaxEventRunsPerRound &&
+          num_runs > (end - begin) / kMinEventsPerRun) {
+        std::stable_sort(begin, end, earlier);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(num_threads_, round_ends.size());
+       ++i) {
+    threads.emplace_back(sort_rounds);
+  }
+  sort_rounds();
+  for (std::thread& thread : threads) thread.join();
+
+  // Merge the ascending runs. Ties go to the earlier run, so the order is the
+  // same as that of a stable sort of all the events.
+  struct Run {
+    size_t index;
+    const TimedEvent* next;
+    const TimedEvent* end;
+  };
+  std::vector<Run> heap;
+  const TimedEvent* run_begin = timed_events.data();
+  for (size_t i = 0; i < num_events; ++i) {
+    if (i + 1 == num_events || earlier(timed_events[i + 1], timed_events[i])) {
+      heap.push_back({heap.size(), run_begin, &timed_events[i + 1]});
+      run_begin = &timed_events[i + 1];
+    }
+  }
+  if (heap.size() <= 1) {
+    // The events are in order, unless rounds were sorted above.
+    for (size_t i = 0; i < num_events; ++i) events[i] = timed_events[i].second;
+    return;
+  }
+
+  auto later = [](const Run& a, const Run& b) {
+    if (a.next->first != b.next->first) return a.next->first > b.next->first;
+    return a.index > b.index;
+  };
+  std::make_heap(heap.begin(), heap.end(), later);
+  auto out = events;
+  while (heap.size() > 1) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    Run& run = heap.back();
+    // Take events from the run for as long as it stays ahead of all others.
+    const Run& top = heap.front();
+    do {
+      *out++ = (run.next++)->second;
+    } while (run.next != run.end && !later(run, top));
+    if (run.next == run.end) {
+      heap.pop_back();
+    } else {
+      std::push_heap(heap.begin(), heap.end(), later);
+    }
+  }
+  for (const TimedEvent* it = heap.front().next; it != heap.front().end; ++it)
+    *out++ = it->second;
 }
 
 bool PerfReader::ReadHeader(DataReader* data) {
@@ -1065,6 +1175,12 @@ bool PerfReader::ReadEventType(DataReader* data, int attr_idx,
 }
 
 bool PerfReader::ReadDataSection(DataReader* data) {
+  if (num_threads_ > 1 && !event_callback_ && !sample_event_callback_) {
+    bool decoded = false;
+    if (!ReadDataSectionInParallel(data, &decoded)) return false;
+    if (decoded) return true;
+  }
+
   u64 data_remaining_bytes = header_.data.size;
   if (!data->SeekSet(header_.data.offset)) return false;
   while (data_remaining_bytes != 0) {
@@ -1076,7 +1192,11 @@ bool PerfReader::ReadDataSection(DataReader* data) {
     }
 
     size_t read_size = 0;
-    if (!ReadNonHeaderEventDataWithoutHeader(data, header, &read_size)) {
+    if (header.type == PERF_RECORD_COMPRESSED) {
+      if (!ReadCompressedEvent(data, header)) return false;
+      read_size = header.size - sizeof(header);
+    } else if (!ReadNonHeaderEventDataWithoutHeader(data, header,
+                                                    &read_size)) {
       LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
       return false;
     }
@@ -1084,12 +1204,204 @@ bool PerfReader::ReadDataSection(DataReader* data) {
     data_remaining_bytes -= sizeof(header) + read_size;
   }
 
+  if (!decompressed_events_.empty()) {
+    LOG(WARNING) << "Skipping " << decompressed_events_.size()
+                 << " bytes of incomplete compressed event data";
+  }
+
+  if (event_callback_) {
+    FlushStreamedEvents(std::numeric_limits<uint64_t>::max());
+  }
+
   DLOG(INFO) << "Number of events stored: " << proto_->events_size();
   return true;
 }
 
-bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
-    DataReader* data, const perf_event_header& header, size_t* read_size) {
+bool PerfReader::ReadDataSectionInParallel(DataReader* data, bool* decoded) {
+  *decoded = false;
+  const size_t section_size = header_.data.size;
+  // Leave a data section that doesn't fit in the input to the serial reader,
+  // which reports the error.
+  if (header_.data.offset > data->size() ||
+      section_size > data->size() - header_.data.offset) {
+    return true;
+  }
+  // Data that is already in memory is decoded in place.
+  const char* section_data =
+      data->data() != nullptr ? data->data() + header_.data.offset : nullptr;
+  auto read_header = [&](size_t offset, perf_event_header* header) {
+    if (section_data != nullptr) {
+      memcpy(header, section_data + offset, sizeof(*header));
+      return true;
+    }
+    return data->SeekSet(header_.data.offset + offset) &&
+           data->ReadData(sizeof(*header), header);
+  };
+
+  // Find the chunks of events to decode by walking the event headers, before
+  // reading any event data. Each thread gets several chunks to even out the
+  // work.
+  const size_t kChunksPerThread = 4;
+  const size_t kMinChunkSize = 64 * 1024;
+  const size_t target_chunk_size = std::max(
+      section_size / (num_threads_ * kChunksPerThread), kMinChunkSize);
+  std::vector<size_t> chunk_offsets = {0};
+  size_t offset = 0;
+  while (offset < section_size) {
+    perf_event_header header;
+    if (section_size - offset < sizeof(header)) return true;
+    if (!read_header(offset, &header)) return true;
+    if (data->is_cross_endian()) {
+      ByteSwap(&header.type);
+      ByteSwap(&header.size);
+      ByteSwap(&header.misc);
+    }
+    // Leave malformed data to the serial reader, which reports the error.
+    if (header.size < sizeof(header) || header.size > section_size - offset)
+      return true;
+    if (header.type == PERF_RECORD_AUXTRACE ||
+        header.type == PERF_RECORD_COMPRESSED ||
+        (header.type == PERF_RECORD_MMAP2 &&
+         header.misc & PERF_RECORD_MISC_MMAP_BUILD_ID)) {
+      return true;
+    }
+    offset += header.size;
+    if (offset - chunk_offsets.back() >= target_chunk_size)
+      chunk_offsets.push_back(offset);
+  }
+  if (chunk_offsets.back() != section_size)
+    chunk_offsets.push_back(section_size);
+
+  std::vector<char> section;
+  if (section_data == nullptr) {
+    section.resize(section_size);
+    if (!data->SeekSet(header_.data.offset) ||
+        !data->ReadData(section.size(), section.data())) {
+      LOG(ERROR) << "Error reading data section.";
+      return false;
+    }
+    section_data = section.data();
+  }
+
+  const size_t num_chunks = chunk_offsets.size() - 1;
+  std::vector<std::vector<PerfEvent*>> chunk_events(num_chunks);
+  std::unique_ptr<bool[]> chunk_decoded(new bool[num_chunks]());
+  std::atomic<size_t> next_chunk(0);
+  auto decode_chunks = [&]() {
+    for (size_t i = next_chunk++; i < num_chunks; i = next_chunk++) {
+      chunk_decoded[i] = DecodeEvents(
+          section_data + chunk_offsets[i],
+          chunk_offsets[i + 1] - chunk_offsets[i],
+          data->is_cross_endian(), &chunk_events[i]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(num_threads_, num_chunks); ++i) {
+    threads.emplace_back(decode_chunks);
+  }
+  decode_chunks();
+  for (std::thread& thread : threads) thread.join();
+
+  size_t num_events = 0;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    if (!chunk_decoded[i]) return false;
+    num_events += chunk_events[i].size();
+  }
+  RepeatedPtrField<PerfEvent>* events = proto_->mutable_events();
+  events->Reserve(events->size() + num_events);
+  for (const std::vector<PerfEvent*>& chunk : chunk_events) {
+    for (PerfEvent* event : chunk) events->AddAllocated(event);
+  }
+
+  *decoded = true;
+  DLOG(INFO) << "Number of events stored: " << proto_->events_size();
+  return true;
+}
+
+bool PerfReader::DecodeEvents(const char* events_data, size_t size,
+                              bool is_cross_endian,
+                              std::vector<PerfEvent*>* events) const {
+  BufferReader reader(events_data, size);
+  reader.set_is_cross_endian(is_cross_endian);
+  while (reader.Tell() < size) {
+    perf_event_header header;
+    if (!ReadPerfEventHeader(&reader, &header)) {
+      LOG(ERROR) << "Error reading event header from data section.";
+      return false;
+    }
+
+    size_t read_size = 0;
+    malloced_unique_ptr<event_t> event;
+    if (!ReadEventWithoutHeader(&reader, header, &read_size, &event)) {
+      LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+      return false;
+    }
+    if (event == nullptr ||
+        event_types_to_skip_when_serializing_.find(header.type) !=
+            event_types_to_skip_when_serializing_.end()) {
+      continue;
+    }
+
+    // The arena allows concurrent allocations.
+    PerfEvent* proto_event = Arena::Create<PerfEvent>(proto_->GetArena());
+    if (!serializer_.SerializeEvent(event, proto_event)) return false;
+    events->push_back(proto_event);
+  }
+  return true;
+}
+
+bool PerfReader::ReadCompressedEvent(DataReader* data,
+                                     const perf_event_header& header) {
+  if (compression_type_ != PERF_COMP_NONE &&
+      compression_type_ != PERF_COMP_ZSTD) {
+    LOG(ERROR) << "Unsupported compression type " << compression_type_;
+    return false;
+  }
+  size_t payload_size = header.size - sizeof(header);
+  compressed_payload_.resize(payload_size);
+  if (!data->ReadDataValue(payload_size, "compressed event payload",
+                           compressed_payload_.data())) {
+    return false;
+  }
+  if (!decompressor_.Decompress(compressed_payload_.data(), payload_size,
+                                compression_mmap_len_,
+                                &decompressed_events_)) {
+    LOG(ERROR) << "Couldn't decompress event " << GetEventName(header.type);
+    return false;
+  }
+
+  // The decompressed data is a sequence of regular events, the last of which
+  // may continue in the next PERF_RECORD_COMPRESSED event.
+  BufferReader events(decompressed_events_.data(), decompressed_events_.size());
+  events.set_is_cross_endian(data->is_cross_endian());
+  size_t consumed_size = 0;
+  while (events.size() - consumed_size >= sizeof(perf_event_header)) {
+    perf_event_header event_header;
+    memcpy(&event_header, &decompressed_events_[consumed_size],
+           sizeof(event_header));
+    if (MaybeSwap(event_header.size, data->is_cross_endian()) >
+        events.size() - consumed_size) {
+      break;
+    }
+    if (!ReadPerfEventHeader(&events, &event_header)) return false;
+
+    size_t read_size = 0;
+    if (!ReadNonHeaderEventDataWithoutHeader(&events, event_header,
+                                             &read_size)) {
+      LOG(ERROR) << "Couldn't read compressed event "
+                 << GetEventName(event_header.type);
+      return false;
+    }
+    consumed_size += sizeof(event_header) + read_size;
+  }
+  decompressed_events_.erase(decompressed_events_.begin(),
+                             decompressed_events_.begin() + consumed_size);
+  return true;
+}
+
+bool PerfReader::ReadEventWithoutHeader(
+    DataReader* data, const perf_event_header& header, size_t* read_size,
+    malloced_unique_ptr<event_t>* event_out) const {
   size_t skip_or_read_size = header.size - sizeof(header);
   if (!PerfSerializer::IsSupportedKernelEventType(header.type) &&
       !PerfSerializer::IsSupportedUserEventType(header.type)) {
@@ -1169,49 +1481,59 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     return false;
   }
 
-  if (event->header.type == PERF_RECORD_MMAP ||
-      event->header.type == PERF_RECORD_MMAP2) {
-    if (proto_->file_attrs_size() > 0 && proto_->file_attrs(0).has_attr() &&
-        proto_->file_attrs(0).attr().exclude_kernel() &&
-        event->header.misc & PERF_RECORD_MISC_KERNEL && event->mmap.len == 0) {
-      // A buggy version of perf emits zero-length MMAP records for the kernel
-      // when run as non-root on a system with the kernel.kptr_restrict > 0
-      // sysctl. Since kptr_restrict replaces the symbol map addresses with 0,
-      // perf thinks all kernel symbols are zero-length and synthesizes a
-      // zero-length MMAP to cover all kernel symbols. These MMAPs are clearly
-      // wrong, making it impossible to map samples to the kernel. Non-kernel
-      // MMAPs, however, are still valid, and thus the perf.data can still be
-      // used to profile userspace code. Thus, we'll ignore zero-length kernel
-      // MMAPs.
-      LOG(WARNING) << "Skipping zero length kernel mmap event from a perf.data "
-                   << "collected in userspace";
-      return true;
-    }
+  if ((event->header.type == PERF_RECORD_MMAP ||
+       event->header.type == PERF_RECORD_MMAP2) &&
+      proto_->file_attrs_size() > 0 && proto_->file_attrs(0).has_attr() &&
+      proto_->file_attrs(0).attr().exclude_kernel() &&
+      event->header.misc & PERF_RECORD_MISC_KERNEL && event->mmap.len == 0) {
+    // A buggy version of perf emits zero-length MMAP records for the kernel
+    // when run as non-root on a system with the kernel.kptr_restrict > 0
+    // sysctl. Since kptr_restrict replaces the symbol map addresses with 0,
+    // perf thinks all kernel symbols are zero-length and synthesizes a
+    // zero-length MMAP to cover all kernel symbols. These MMAPs are clearly
+    // wrong, making it impossible to map samples to the kernel. Non-kernel
+    // MMAPs, however, are still valid, and thus the perf.data can still be
+    // used to profile userspace code. Thus, we'll ignore zero-length kernel
+    // MMAPs.
+    LOG(WARNING) << "Skipping zero length kernel mmap event from a perf.data "
+                 << "collected in userspace";
+    return true;
+  }
 
-    if (event->header.type == PERF_RECORD_MMAP2 &&
-        event->header.misc & PERF_RECORD_MISC_MMAP_BUILD_ID) {
-      std::string filename(event->mmap2.filename);
+  *event_out = std::move(event);
+  return true;
+}
 
-      if (filenames_with_build_id_.find(filename) ==
-          filenames_with_build_id_.end()) {
-        // Serialize a build-id event for a new filename
-        if (event->mmap2.build_id_size > kMaxBuildIdSize) {
-          LOG(ERROR) << "Build-id size is too big: "
-                     << event->mmap2.build_id_size;
-          return false;
-        }
-        std::string build_id_str = RawDataToHexString(
-            event->mmap2.build_id, event->mmap2.build_id_size);
-        malloced_unique_ptr<build_id_event> build_id_event = CreateBuildIDEvent(
-            build_id_str, event->mmap2.filename, event->header.misc);
-        if (!serializer_.SerializeBuildIDEvent(build_id_event,
-                                               proto_->add_build_ids())) {
-          LOG(ERROR) << "Could not serialize build ID event in MMAP2 for "
-                     << filename << " with ID " << event->mmap2.build_id;
-          return false;
-        }
-        filenames_with_build_id_.insert(std::move(filename));
+bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
+    DataReader* data, const perf_event_header& header, size_t* read_size) {
+  malloced_unique_ptr<event_t> event;
+  if (!ReadEventWithoutHeader(data, header, read_size, &event)) return false;
+  // The event was skipped.
+  if (event == nullptr) return true;
+
+  if (event->header.type == PERF_RECORD_MMAP2 &&
+      event->header.misc & PERF_RECORD_MISC_MMAP_BUILD_ID) {
+    std::string filename(event->mmap2.filename);
+
+    if (filenames_with_build_id_.find(filename) ==
+        filenames_with_build_id_.end()) {
+      // Serialize a build-id event for a new filename
+      if (event->mmap2.build_id_size > kMaxBuildIdSize) {
+        LOG(ERROR) << "Build-id size is too big: "
+                   << event->mmap2.build_id_size;
+        return false;
       }
+      std::string build_id_str =
+          RawDataToHexString(event->mmap2.build_id, event->mmap2.build_id_size);
+      malloced_unique_ptr<build_id_event> build_id_event = CreateBuildIDEvent(
+          build_id_str, event->mmap2.filename, event->header.misc);
+      if (!serializer_.SerializeBuildIDEvent(build_id_event,
+                                             proto_->add_build_ids())) {
+        LOG(ERROR) << "Could not serialize build ID event in MMAP2 for "
+                   << filename << " with ID " << event->mmap2.build_id;
+        return false;
+      }
+      filenames_with_build_id_.insert(std::move(filename));
     }
   }
 
@@ -1227,8 +1549,15 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     return true;
   }
 
-  // Serialize the event to protobuf form.
-  PerfEvent* proto_event = proto_->add_events();
+  // Serialize the event to protobuf form. When streaming events, reuse the
+  // scratch event rather than growing the output proto.
+  PerfEvent* proto_event = nullptr;
+  if (event_callback_) {
+    streamed_event_.Clear();
+    proto_event = &streamed_event_;
+  } else {
+    proto_event = proto_->add_events();
+  }
   if (!serializer_.SerializeEvent(event, proto_event)) return false;
 
   if (proto_event->header().type() == PERF_RECORD_AUXTRACE) {
@@ -1240,9 +1569,52 @@ bool PerfReader::ReadNonHeaderEventDataWithoutHeader(
     sample_event_callback_(proto_event->sample_event());
   }
 
+  if (event_callback_) StreamEvent();
+
   return true;
 }
 
+void PerfReader::StreamEvent() {
+  if (!order_streamed_events_ || !EventsHaveTimestamps()) {
+    FlushStreamedEvents(std::numeric_limits<uint64_t>::max());
+    event_callback_(streamed_event_);
+    return;
+  }
+
+  if (streamed_event_.header().type() == PERF_RECORD_FINISHED_ROUND) {
+    FlushStreamedEvents(round_flush_timestamp_);
+    round_flush_timestamp_ = max_streamed_timestamp_;
+    event_callback_(streamed_event_);
+    return;
+  }
+
+  // Move the event into the queue rather than copying it.
+  std::unique_ptr<PerfEvent> event;
+  if (free_events_.empty()) {
+    event.reset(new PerfEvent);
+  } else {
+    event = std::move(free_events_.back());
+    free_events_.pop_back();
+  }
+  event->Swap(&streamed_event_);
+  const uint64_t timestamp = event->timestamp();
+  max_streamed_timestamp_ = std::max(max_streamed_timestamp_, timestamp);
+  // Inserting at the end keeps ties in file order, and is fast for events
+  // that are already in order.
+  queued_events_.emplace_hint(queued_events_.end(), timestamp,
+                              std::move(event));
+}
+
+void PerfReader::FlushStreamedEvents(uint64_t timestamp) {
+  auto it = queued_events_.begin();
+  for (; it != queued_events_.end() && it->first <= timestamp; ++it) {
+    event_callback_(*it->second);
+    it->second->Clear();
+    free_events_.push_back(std::move(it->second));
+  }
+  queued_events_.erase(queued_events_.begin(), it);
+}
+
 bool PerfReader::ReadMetadata(DataReader* data) {
   // Metadata comes after the event data.
   if (!data->SeekSet(header_.data.offset + header_.data.size)) return false;
@@ -1335,6 +1707,8 @@ bool PerfReader::ReadMetadataWithoutHeader(DataReader* data, u32 type,
         return ReadGroupDescMetadata(data);
       case HEADER_HYBRID_TOPOLOGY:
         return ReadHybridTopologyMetadata(data, size);
+      case HEADER_COMPRESSED:
+        return ReadCompressedMetadata(data, size);
       default:
         is_supported_metadata = false;
         LOG(INFO) << "Unsupported metadata type, skipping: "
@@ -1773,6 +2147,24 @@ bool PerfReader::ReadHybridTopologyMetadata(DataReader* data, size_t size) {
   return true;
 }
 
+bool PerfReader::ReadCompressedMetadata(DataReader* data, size_t size) {
+  // Structure:
+  // u32 version;
+  // u32 type;
+  // u32 level;
+  // u32 ratio;
+  // u32 mmap_len;
+
+  u32 version, level, ratio;
+  if (!data->ReadUint32(&version) || !data->ReadUint32(&compression_type_) ||
+      !data->ReadUint32(&level) || !data->ReadUint32(&ratio) ||
+      !data->ReadUint32(&compression_mmap_len_)) {
+    LOG(ERROR) << "Error reading compression metadata.";
+    return false;
+  }
+  return true;
+}
+
 bool PerfReader::ReadFileData(DataReader* data) {
   // Make sure sections are within the size of the file. This check prevents
   // more obscure messages later when attempting to read from one of these
@@ -1818,71 +2210,172 @@ bool PerfReader::ReadFileData(DataReader* data) {
 bool PerfReader::ReadPipedData(DataReader* data) {
   // The piped data comes right after the file header.
   CHECK_EQ(piped_header_.size, data->Tell());
-  bool result = true;
-  int num_event_types = 0;
 
   CheckNoEventHeaderPadding();
 
-  while (result && data->Tell() < data->size()) {
+  while (data->Tell() < data->size()) {
     perf_event_header header;
     if (!ReadPerfEventHeader(data, &header)) {
       LOG(ERROR) << "Error reading event header.";
       return false;
     }
-
-    // Compute the size of the post-header part of the event data.
-    size_t size_without_header = header.size - sizeof(header);
-
-    if (PerfSerializer::IsSupportedHeaderEventType(header.type)) {
-      result = [&] {
-        switch (header.type) {
-          case PERF_RECORD_HEADER_ATTR:
-            return ReadAttrEventBlock(data, size_without_header);
-          case PERF_RECORD_HEADER_EVENT_TYPE:
-            return ReadEventType(data, num_event_types++, header.size);
-          case PERF_RECORD_HEADER_TRACING_DATA:
-            set_metadata_mask_bit(HEADER_TRACING_DATA);
-            {
-              // TRACING_DATA's header.size is a lie. It is the size of only the
-              // event struct. The size of the data is in the event struct, and
-              // followed immediately by the tracing header data.
-              decltype(tracing_data_event::size) size = 0;
-              if (!data->ReadUint32(&size)) {
-                LOG(ERROR) << "Error reading tracing data size.";
-                return false;
-              }
-              return ReadTracingMetadata(data, size);
-            }
-          case PERF_RECORD_HEADER_BUILD_ID:
-            set_metadata_mask_bit(HEADER_BUILD_ID);
-            return ReadBuildIDMetadataWithoutHeader(data, header);
-          case PERF_RECORD_HEADER_FEATURE:
-            return ReadHeaderFeature(data, header);
+    if (!ReadPipedEvent(data, header)) return false;
+  }
+
+  return FinishPipedData();
+}
+
+bool PerfReader::ReadPipedEvent(DataReader* data,
+                                const perf_event_header& header) {
+  // Compute the size of the post-header part of the event data.
+  size_t size_without_header = header.size - sizeof(header);
+
+  if (PerfSerializer::IsSupportedHeaderEventType(header.type)) {
+    switch (header.type) {
+      case PERF_RECORD_HEADER_ATTR:
+        return ReadAttrEventBlock(data, size_without_header);
+      case PERF_RECORD_HEADER_EVENT_TYPE:
+        return ReadEventType(data, num_piped_event_types_++, header.size);
+      case PERF_RECORD_HEADER_TRACING_DATA:
+        set_metadata_mask_bit(HEADER_TRACING_DATA);
+        {
+          // TRACING_DATA's header.size is a lie. It is the size of only the
+          // event struct. The size of the data is in the event struct, and
+          // followed immediately by the tracing header data.
+          decltype(tracing_data_event::size) size = 0;
+          if (!data->ReadUint32(&size)) {
+            LOG(ERROR) << "Error reading tracing data size.";
+            return false;
+          }
+          return ReadTracingMetadata(data, size);
         }
+      case PERF_RECORD_HEADER_BUILD_ID:
+        set_metadata_mask_bit(HEADER_BUILD_ID);
+        return ReadBuildIDMetadataWithoutHeader(data, header);
+      case PERF_RECORD_HEADER_FEATURE:
+        return ReadHeaderFeature(data, header);
+    }
+    return false;
+  }
+
+  if (header.type == PERF_RECORD_COMPRESSED) {
+    return ReadCompressedEvent(data, header);
+  }
+
+  size_t read_size = 0;
+  if (!ReadNonHeaderEventDataWithoutHeader(data, header, &read_size)) {
+    LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+    return false;
+  }
+  return true;
+}
+
+bool PerfReader::ReadPipedDataChunk(const char* data, size_t size) {
+  CheckNoEventHeaderPadding();
+  piped_chunk_.insert(piped_chunk_.end(), data, data + size);
+
+  size_t offset = 0;
+  while (offset < piped_chunk_.size()) {
+    const char* begin = piped_chunk_.data() + offset;
+    size_t remaining = piped_chunk_.size() - offset;
+
+    // Each piped file starts with a header, which is also where the first
+    // chunk has to start.
+    uint64_t magic = 0;
+    if (remaining >= sizeof(magic)) memcpy(&magic, begin, sizeof(magic));
+    if (num_piped_headers_ == 0 || magic == kPerfMagic ||
+        magic == bswap_64(kPerfMagic)) {
+      if (remaining < sizeof(piped_header_)) break;
+      BufferReader reader(begin, sizeof(piped_header_));
+      if (!ReadHeader(&reader)) return false;
+      if (piped_header_.size != sizeof(piped_header_)) {
+        LOG(ERROR) << "Expecting piped data format, but header size "
+                   << piped_header_.size << " does not match expected size "
+                   << sizeof(piped_header_);
         return false;
-      }();
+      }
+      ++num_piped_headers_;
+      offset += sizeof(piped_header_);
       continue;
     }
 
-    size_t read_size = 0;
-    if (!ReadNonHeaderEventDataWithoutHeader(data, header, &read_size)) {
-      LOG(ERROR) << "Couldn't read event " << GetEventName(header.type);
+    // Only read complete events. The trace data of AUXTRACE events and the
+    // tracing data of TRACING_DATA events follow the event itself.
+    if (remaining < sizeof(perf_event_header)) break;
+    BufferReader reader(begin, remaining);
+    reader.set_is_cross_endian(is_cross_endian_);
+    perf_event_header header;
+    reader.ReadData(sizeof(header), &header);
+    if (is_cross_endian_) {
+      ByteSwap(&header.type);
+      ByteSwap(&header.size);
+    }
+    if (header.size < sizeof(header)) {
+      LOG(ERROR) << "Event size " << header.size << " of event "
+                 << GetEventName(header.type) << " is less than header size "
+                 << sizeof(header);
+      return false;
+    }
+    size_t event_size = header.size;
+    if (header.type == PERF_RECORD_HEADER_TRACING_DATA) {
+      decltype(tracing_data_event::size) size = 0;
+      if (!reader.ReadUint32(&size)) break;
+      event_size = sizeof(header) + sizeof(size) + size;
+    } else if (header.type == PERF_RECORD_AUXTRACE) {
+      decltype(auxtrace_event::size) size = 0;
+      if (!reader.ReadUint64(&size)) break;
+      event_size += size;
+    }
+    if (remaining < event_size) break;
+    offset += event_size;
+
+    // Later piped files repeat the metadata of the first one. Their attrs and
+    // build IDs are read, to learn the new attr IDs and build IDs.
+    if (num_piped_headers_ > 1 &&
+        (header.type == PERF_RECORD_HEADER_EVENT_TYPE ||
+         header.type == PERF_RECORD_HEADER_TRACING_DATA ||
+         header.type == PERF_RECORD_HEADER_FEATURE)) {
+      continue;
+    }
+
+    BufferReader event_reader(begin, event_size);
+    event_reader.set_is_cross_endian(is_cross_endian_);
+    if (!ReadPerfEventHeader(&event_reader, &header) ||
+        !ReadPipedEvent(&event_reader, header)) {
       return false;
     }
   }
 
-  if (!result) return false;
+  piped_chunk_.erase(piped_chunk_.begin(), piped_chunk_.begin() + offset);
+  return true;
+}
+
+bool PerfReader::FinishPipedData() {
+  if (!piped_chunk_.empty()) {
+    LOG(ERROR) << "Piped data ends with an incomplete event of "
+               << piped_chunk_.size() << " bytes";
+    return false;
+  }
+
+  if (event_callback_) {
+    FlushStreamedEvents(std::numeric_limits<uint64_t>::max());
+  }
+
+  if (!decompressed_events_.empty()) {
+    LOG(WARNING) << "Skipping " << decompressed_events_.size()
+                 << " bytes of incomplete compressed event data";
+  }
 
   // The PERF_RECORD_HEADER_EVENT_TYPE events are obsolete, but if present
   // and PERF_RECORD_HEADER_EVENT_DESC metadata events are not, we should use
   // them. Otherwise, we should use prefer the _EVENT_DESC data.
   if (!get_metadata_mask_bit(HEADER_EVENT_DESC) &&
-      num_event_types == proto_->file_attrs().size()) {
+      num_piped_event_types_ == proto_->file_attrs().size()) {
     // We can construct HEADER_EVENT_DESC:
     set_metadata_mask_bit(HEADER_EVENT_DESC);
   }
 
-  return result;
+  return true;
 }
 
 bool PerfReader::ReadAuxtraceTraceData(DataReader* data,
@@ -2593,7 +3086,26 @@ bool PerfReader::LocalizeMMapFilenames(
 }
 
 bool PerfReader::AddPerfFileAttr(const PerfFileAttr& attr) {
-  serializer_.SerializePerfFileAttr(attr, proto_->add_file_attrs());
+  if (num_piped_headers_ > 1) {
+    // A later piped file has the same attrs as the first one, with new IDs.
+    // Add the IDs to the matching attr, so that the attr indices are kept.
+    PerfDataProto_PerfFileAttr file_attr;
+    serializer_.SerializePerfFileAttr(attr, &file_attr);
+    const std::string serialized_attr = file_attr.attr().SerializeAsString();
+    auto* file_attrs = proto_->mutable_file_attrs();
+    auto it = std::find_if(file_attrs->begin(), file_attrs->end(),
+                           [&](const PerfDataProto_PerfFileAttr& existing) {
+                             return existing.attr().SerializeAsString() ==
+                                    serialized_attr;
+                           });
+    if (it == file_attrs->end()) {
+      LOG(ERROR) << "Piped file has an attr that the first one doesn't have";
+      return false;
+    }
+    for (u64 id : attr.ids) it->add_ids(id);
+  } else {
+    serializer_.SerializePerfFileAttr(attr, proto_->add_file_attrs());
+  }
 
   // Generate a new SampleInfoReader with the new attr.
   if (!serializer_.CreateSampleInfoReader(attr, is_cross_endian_)) {
@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
 #include <set>
@@ -20,6 +21,7 @@
 #include "kernel/perf_event.h"
 #include "perf_serializer.h"
 #include "sample_info_reader.h"
+#include "zstd_decompressor.h"
 
 namespace quipper {
 
@@ -50,6 +52,19 @@ class PerfReader {
   bool ReadFromPointer(const char* data, size_t size);
   bool ReadFromData(DataReader* data);
 
+  // Reads piped perf data that arrives in chunks, such as the output of
+  // "perf record -o -" while it is still being written. Each call reads the
+  // complete events so far and keeps a trailing partial event for the next
+  // call, so chunks may be split anywhere. Another piped file may follow the
+  // first one, e.g. after the output was rotated: its attrs are matched to
+  // those of the first file by content, and its events are read as if they
+  // were part of the first file. Returns true on success.
+  bool ReadPipedDataChunk(const char* data, size_t size);
+
+  // Finishes reading piped data passed to ReadPipedDataChunk(). Returns false
+  // if the data ended with an incomplete event.
+  bool FinishPipedData();
+
   bool WriteFile(const std::string& filename);
   bool WriteToVector(std::vector<char>* data);
   bool WriteToString(std::string* str);
@@ -95,7 +110,9 @@ class PerfReader {
       std::map<std::string, std::string>* filenames_to_build_ids) const;
 
   // Sort all events in |proto_| by timestamps if they are available. Otherwise
-  // event order is unchanged.
+  // event order is unchanged. Events are sorted within each round, as ended
+  // by PERF_RECORD_FINISHED_ROUND events, and the sorted rounds are then
+  // merged. The order is the same as that of a stable sort of all events.
   void MaybeSortEventsByTime();
 
   // Accessors and mutators.
@@ -155,6 +172,16 @@ class PerfReader {
         std::move(event_types_to_skip_when_serializing);
   }
 
+  // Sets the fields of sample events to serialize, as a bitfield of enum
+  // perf_event_sample_format. This is useful when the consumer of the output
+  // only needs some of the fields: the others, such as raw data, are skipped
+  // over when decoding instead of being parsed and stored. Events with missing
+  // fields can't be written back to a perf data file. Must be called before
+  // reading.
+  void SetSampleFieldsToSerialize(uint64_t sample_fields) {
+    serializer_.SetSampleFieldsToSerialize(sample_fields);
+  }
+
   // Sets the callback to be called for each sample event in the perf data file.
   // It will be called even if PERF_RECORD_SAMPLE is in the set of event types
   // passed to |SetEventTypesToSkipWhenSerializing|. This is useful when SAMPLE
@@ -165,6 +192,47 @@ class PerfReader {
     sample_event_callback_ = callback;
   }
 
+  // Sets the callback to be called for each non-header event in the perf data
+  // file, in file order. When set, events are handed to the callback instead
+  // of being stored in the output proto, so events() stays empty and the
+  // memory used for reading is bounded by the metadata rather than by the
+  // number of events. The event passed to the callback is only valid for the
+  // duration of the call. Events whose types are in the set passed to
+  // |SetEventTypesToSkipWhenSerializing| are not passed to the callback.
+  void SetEventCallback(
+      std::function<void(const PerfDataProto_PerfEvent&)> callback) {
+    event_callback_ = callback;
+  }
+
+  // Sets whether the events passed to the callback set with |SetEventCallback|
+  // are ordered by time, if timestamps are available. Events are held back
+  // until the PERF_RECORD_FINISHED_ROUND event that follows the next one,
+  // since perf guarantees that no later event is older than the newest event
+  // written before that round. This keeps only about two rounds of events in
+  // memory. Ties are passed in file order. Events that arrive after events
+  // newer than them have been passed, which happens when perf lost or didn't
+  // write rounds, are passed at the next round.
+  void SetOrderStreamedEventsByTime(bool order) {
+    order_streamed_events_ = order;
+  }
+
+  // Passes the events held back for ordering by time to the callback set with
+  // |SetEventCallback| now, e.g. to look at all the data read so far. Events
+  // read later that are older than them are passed out of order.
+  void FlushQueuedStreamedEvents() {
+    FlushStreamedEvents(std::numeric_limits<uint64_t>::max());
+  }
+
+  // Sets the number of threads used to decode the events of a perf.data file
+  // and to sort them by time. The default is 1. With more threads, the data
+  // section is split into chunks of events which are decoded concurrently and
+  // stored in file order, as they would be by a single thread. The chunks are
+  // decoded in place when the input is already in memory. Piped data,
+  // data read with a callback, and data with events that the reader has to
+  // decode in order (AUXTRACE, COMPRESSED, and MMAP2 with a build ID) are
+  // always decoded by a single thread.
+  void SetNumThreads(int num_threads) { num_threads_ = num_threads; }
+
  private:
   bool ReadHeader(DataReader* data);
   bool ReadAttrsSection(DataReader* data);
@@ -172,12 +240,43 @@ class PerfReader {
   bool ReadEventAttr(DataReader* data, perf_event_attr* attr);
   bool ReadUniqueIDs(DataReader* data, size_t num_ids, std::vector<u64>* ids);
 
+  // Returns true if all attrs have PERF_SAMPLE_TIME, so that the events can be
+  // ordered by time.
+  bool EventsHaveTimestamps() const;
+
+  // Passes |streamed_event_| to |event_callback_|, or queues it to be passed
+  // in time order if |order_streamed_events_| is set.
+  void StreamEvent();
+
+  // Passes the queued events with timestamps up to |timestamp| to
+  // |event_callback_|, in time order.
+  void FlushStreamedEvents(uint64_t timestamp);
+
   bool ReadEventTypesSection(DataReader* data);
   // if event_size == 0, then not in an event.
   bool ReadEventType(DataReader* data, int attr_idx, size_t event_size);
 
   bool ReadDataSection(DataReader* data);
 
+  // Reads the data section with |num_threads_| threads, see SetNumThreads().
+  // The event headers are scanned first, and |decoded| is set to false,
+  // without reading any event data, if the data section has to be decoded by
+  // a single thread. Returns false on error.
+  bool ReadDataSectionInParallel(DataReader* data, bool* decoded);
+
+  // Decodes the |size| bytes of events at |events_data|, a chunk of the data
+  // section, into new events allocated on |arena_|, and appends them to
+  // |events|. Can be called concurrently. Returns false on error.
+  bool DecodeEvents(const char* events_data, size_t size,
+                    bool is_cross_endian,
+                    std::vector<PerfDataProto_PerfEvent*>* events) const;
+
+  // Reads a PERF_RECORD_COMPRESSED event, from both file and pipe mode perf
+  // outputs: decompresses its payload and reads the events in it. An event
+  // that is cut off at the end of the payload is completed by the next
+  // PERF_RECORD_COMPRESSED event.
+  bool ReadCompressedEvent(DataReader* data, const perf_event_header& header);
+
   // Reads the event data of non-header events from both file and pipe mode
   // perf outputs. Returns true on success. Otherwise, returns false. On
   // success, updates the |read_size| with the size of the read non-header event
@@ -187,6 +286,14 @@ class PerfReader {
                                            const perf_event_header& header,
                                            size_t* read_size);
 
+  // Reads and validates the event data that follows |header|, the part of
+  // ReadNonHeaderEventDataWithoutHeader() that doesn't depend on previous
+  // events. On success, updates |read_size| like it and stores the event in
+  // |event|, which is left null if the event is to be skipped.
+  bool ReadEventWithoutHeader(DataReader* data, const perf_event_header& header,
+                              size_t* read_size,
+                              malloced_unique_ptr<event_t>* event) const;
+
   // Reads metadata in normal mode.
   bool ReadMetadata(DataReader* data);
 
@@ -232,6 +339,7 @@ class PerfReader {
   bool ReadGroupDescMetadata(DataReader* data);
   bool ReadEventDescMetadata(DataReader* data);
   bool ReadHybridTopologyMetadata(DataReader* data, size_t size);
+  bool ReadCompressedMetadata(DataReader* data, size_t size);
 
   // Read perf data from file perf output data.
   bool ReadFileData(DataReader* data);
@@ -239,6 +347,9 @@ class PerfReader {
   // Read perf data from piped perf output data.
   bool ReadPipedData(DataReader* data);
 
+  // Reads one piped event, whose header has been read from |data|.
+  bool ReadPipedEvent(DataReader* data, const perf_event_header& header);
+
   // Processes the remaining piped-mode header events, introduced after
   // perf-4.13.
   bool ProcessPipedModeHeaderEvents(DataReader* data,
@@ -375,6 +486,49 @@ class PerfReader {
   // even if PERF_RECORD_SAMPLE is in |event_types_to_skip_when_serializing|.
   std::function<void(const PerfDataProto_SampleEvent&)> sample_event_callback_;
 
+  // Callback to be called for each event instead of storing it in |proto_|.
+  std::function<void(const PerfDataProto_PerfEvent&)> event_callback_;
+
+  // Scratch event reused across events when |event_callback_| is set.
+  PerfDataProto_PerfEvent streamed_event_;
+
+  // Set by |SetOrderStreamedEventsByTime|.
+  bool order_streamed_events_;
+
+  // Streamed events that haven't been passed to |event_callback_| yet, by
+  // timestamp, and events that can be reused for the queue.
+  std::multimap<uint64_t, std::unique_ptr<PerfDataProto_PerfEvent>>
+      queued_events_;
+  std::vector<std::unique_ptr<PerfDataProto_PerfEvent>> free_events_;
+
+  // The newest timestamp of the streamed events so far, and the one as of the
+  // last PERF_RECORD_FINISHED_ROUND. Queued events up to the latter are
+  // passed to |event_callback_| at the next round.
+  uint64_t max_streamed_timestamp_;
+  uint64_t round_flush_timestamp_;
+
+  // The number of threads used to decode and sort events.
+  int num_threads_;
+
+  // Piped data passed to ReadPipedDataChunk() that doesn't make up a complete
+  // event yet, the number of piped file headers read from the chunks, and the
+  // number of PERF_RECORD_HEADER_EVENT_TYPE events read from piped data.
+  std::vector<char> piped_chunk_;
+  int num_piped_headers_;
+  int num_piped_event_types_;
+
+  // From HEADER_COMPRESSED: the compression algorithm, and the size of the
+  // buffers perf compressed, which is used as the decompression chunk size.
+  u32 compression_type_;
+  u32 compression_mmap_len_;
+
+  // Decompresses the payloads of PERF_RECORD_COMPRESSED events. The buffers
+  // are reused across events; |decompressed_events_| holds the decompressed
+  // data that hasn't been read yet.
+  ZstdDecompressor decompressor_;
+  std::vector<char> compressed_payload_;
+  std::vector<char> decompressed_events_;
+
   PerfReader(const PerfReader&) = delete;
   PerfReader& operator=(const PerfReader&) = delete;
 };
@@ -6,17 +6,20 @@
 
 #include <byteswap.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include "base/logging.h"
+#include "file_reader.h"
 #include "file_utils.h"
 #include "kernel/perf_internals.h"
 #include "perf_test_files.h"
 #include "test_perf_data.h"
 #include "test_utils.h"
+#include "zstd_decompressor.h"
 
 namespace quipper {
 
@@ -208,6 +211,314 @@ TEST(PerfReaderTest, CorruptedFiles) {
   }
 }
 
+TEST(PerfReaderTest, InvokesEventCallbackInsteadOfStoringEvents) {
+  std::vector<const char*> test_files = perf_test_files::GetPerfDataFiles();
+  for (const char* test_file : perf_test_files::GetPerfPipedDataFiles()) {
+    test_files.push_back(test_file);
+  }
+  for (const char* test_file : test_files) {
+    std::string input_perf_data = GetTestInputFilePath(test_file);
+    LOG(INFO) << "Testing " << input_perf_data;
+    PerfReader expected;
+    ASSERT_TRUE(expected.ReadFile(input_perf_data));
+
+    std::vector<std::string> streamed_events;
+    PerfReader pr;
+    pr.SetEventCallback([&streamed_events](const PerfEvent& event) {
+      streamed_events.push_back(event.SerializeAsString());
+    });
+    ASSERT_TRUE(pr.ReadFile(input_perf_data));
+
+    EXPECT_EQ(0, pr.events().size());
+    EXPECT_EQ(expected.attrs().size(), pr.attrs().size());
+    EXPECT_EQ(expected.build_ids().size(), pr.build_ids().size());
+    ASSERT_EQ(expected.events().size(), streamed_events.size());
+    for (int i = 0; i < expected.events().size(); ++i) {
+      EXPECT_EQ(expected.events().Get(i).SerializeAsString(),
+                streamed_events[i])
+          << "event " << i;
+    }
+  }
+}
+
+TEST(PerfReaderTest, SerializesSelectedSampleFields) {
+  const std::string input_perf_data =
+      GetTestInputFilePath("perf.data.callgraph_and_branch-3.8");
+  PerfReader expected;
+  ASSERT_TRUE(expected.ReadFile(input_perf_data));
+
+  PerfReader pr;
+  pr.SetSampleFieldsToSerialize(PERF_SAMPLE_IP | PERF_SAMPLE_TID);
+  ASSERT_TRUE(pr.ReadFile(input_perf_data));
+
+  ASSERT_EQ(expected.events().size(), pr.events().size());
+  int num_samples = 0;
+  for (int i = 0; i < pr.events().size(); ++i) {
+    const PerfEvent& expected_event = expected.events().Get(i);
+    const PerfEvent& event = pr.events().Get(i);
+    if (!event.has_sample_event()) {
+      EXPECT_EQ(expected_event.SerializeAsString(), event.SerializeAsString());
+      continue;
+    }
+    ++num_samples;
+    const auto& expected_sample = expected_event.sample_event();
+    const auto& sample = event.sample_event();
+    EXPECT_EQ(expected_sample.ip(), sample.ip());
+    EXPECT_EQ(expected_sample.pid(), sample.pid());
+    EXPECT_EQ(expected_sample.tid(), sample.tid());
+    EXPECT_FALSE(sample.has_sample_time_ns());
+    EXPECT_FALSE(sample.has_period());
+    EXPECT_EQ(0, sample.callchain_size());
+    EXPECT_EQ(0, sample.branch_stack_size());
+  }
+  EXPECT_GT(num_samples, 0);
+}
+
+TEST(PerfReaderTest, ReadsEventsWithMultipleThreads) {
+  std::vector<const char*> test_files = perf_test_files::GetPerfDataFiles();
+  for (const char* test_file : perf_test_files::GetPerfPipedDataFiles()) {
+    test_files.push_back(test_file);
+  }
+  for (const char* test_file : test_files) {
+    std::string input_perf_data = GetTestInputFilePath(test_file);
+    LOG(INFO) << "Testing " << input_perf_data;
+    PerfReader expected;
+    ASSERT_TRUE(expected.ReadFile(input_perf_data));
+
+    // The events are decoded in place from a memory mapping, and from a
+    // copy of the data section when the file is read through stdio.
+    PerfReader mapped;
+    mapped.SetNumThreads(4);
+    ASSERT_TRUE(mapped.ReadFile(input_perf_data));
+    FileReader file_reader(input_perf_data);
+    ASSERT_TRUE(file_reader.IsOpen());
+    PerfReader read;
+    read.SetNumThreads(4);
+    ASSERT_TRUE(read.ReadFromData(&file_reader));
+
+    for (const PerfReader* pr : {&mapped, &read}) {
+      ASSERT_EQ(expected.events().size(), pr->events().size());
+      for (int i = 0; i < expected.events().size(); ++i) {
+        EXPECT_EQ(expected.events().Get(i).SerializeAsString(),
+                  pr->events().Get(i).SerializeAsString())
+            << "event " << i;
+      }
+      EXPECT_EQ(expected.proto().SerializeAsString(),
+                pr->proto().SerializeAsString());
+    }
+  }
+}
+
+TEST(PerfReaderTest, ReadsPipedDataInChunks) {
+  for (const char* test_file : perf_test_files::GetPerfPipedDataFiles()) {
+    std::string input_perf_data = GetTestInputFilePath(test_file);
+    LOG(INFO) << "Testing " << input_perf_data;
+    PerfReader expected;
+    ASSERT_TRUE(expected.ReadFile(input_perf_data));
+    std::vector<char> data;
+    ASSERT_TRUE(FileToBuffer(input_perf_data, &data));
+
+    for (size_t chunk_size : {7, 4096}) {
+      PerfReader pr;
+      for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+        ASSERT_TRUE(pr.ReadPipedDataChunk(
+            data.data() + offset, std::min(chunk_size, data.size() - offset)))
+            << "offset " << offset;
+      }
+      ASSERT_TRUE(pr.FinishPipedData());
+      EXPECT_EQ(expected.proto().SerializeAsString(),
+                pr.proto().SerializeAsString())
+          << "chunk size " << chunk_size;
+    }
+  }
+}
+
+TEST(PerfReaderTest, ReadsRotatedPipedDataChunks) {
+  const u64 sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_ID;
+  std::string data;
+  for (u64 id : {1, 2}) {
+    std::stringstream input;
+    testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+    testing::ExamplePerfEventAttrEvent_Hardware(sample_type,
+                                                true /*sample_id_all*/)
+        .WithConfig(123)
+        .WithId(id)
+        .WriteTo(&input);
+    testing::ExamplePerfSampleEvent(
+        testing::SampleInfo().Ip(0x1000 + id).Tid(1001).Id(id))
+        .WriteTo(&input);
+    data += input.str();
+  }
+
+  PerfReader pr;
+  // Split the data in the middle of the second header.
+  const size_t split = data.size() / 2 + 4;
+  ASSERT_TRUE(pr.ReadPipedDataChunk(data.data(), split));
+  ASSERT_TRUE(pr.ReadPipedDataChunk(data.data() + split, data.size() - split));
+  ASSERT_TRUE(pr.FinishPipedData());
+
+  // The attr of the second file is merged into that of the first one.
+  ASSERT_EQ(1, pr.attrs().size());
+  ASSERT_EQ(2, pr.attrs().Get(0).ids().size());
+  EXPECT_EQ(1, pr.attrs().Get(0).ids(0));
+  EXPECT_EQ(2, pr.attrs().Get(0).ids(1));
+  ASSERT_EQ(2, pr.events().size());
+  EXPECT_EQ(0x1001, pr.events().Get(0).sample_event().ip());
+  EXPECT_EQ(0x1002, pr.events().Get(1).sample_event().ip());
+  EXPECT_EQ(2, pr.events().Get(1).sample_event().id());
+
+  // A file with an attr that the first file doesn't have can't be merged.
+  std::stringstream other;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&other);
+  testing::ExamplePerfEventAttrEvent_Hardware(sample_type,
+                                              true /*sample_id_all*/)
+      .WithConfig(456)
+      .WithId(3)
+      .WriteTo(&other);
+  EXPECT_FALSE(pr.ReadPipedDataChunk(other.str().data(), other.str().size()));
+}
+
+TEST(PerfReaderTest, FailsToFinishIncompletePipedDataChunks) {
+  std::stringstream input;
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_IP,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+  testing::ExamplePerfSampleEvent(testing::SampleInfo().Ip(0x1000))
+      .WriteTo(&input);
+  const std::string data = input.str();
+
+  PerfReader pr;
+  ASSERT_TRUE(pr.ReadPipedDataChunk(data.data(), data.size() - 1));
+  EXPECT_EQ(0, pr.events().size());
+  EXPECT_FALSE(pr.FinishPipedData());
+}
+
+TEST(PerfReaderTest, SortsEventsByTimeWithinAndAcrossRounds) {
+  // Each round is out of order, and the second and third rounds overlap.
+  const struct {
+    u32 type;
+    u64 timestamp;
+  } kEvents[] = {
+      {PERF_RECORD_SAMPLE, 30},  {PERF_RECORD_SAMPLE, 10},
+      {PERF_RECORD_COMM, 20},    {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_SAMPLE, 50},  {PERF_RECORD_SAMPLE, 40},
+      {PERF_RECORD_SAMPLE, 70},  {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_MMAP, 40},    {PERF_RECORD_SAMPLE, 60},
+      {PERF_RECORD_SAMPLE, 80},
+  };
+
+  for (int num_threads : {1, 4}) {
+    PerfReader pr;
+    pr.SetNumThreads(num_threads);
+    pr.mutable_proto()->add_file_attrs()->mutable_attr()->set_sample_type(
+        PERF_SAMPLE_TIME);
+    for (const auto& e : kEvents) {
+      PerfEvent* event = pr.mutable_events()->Add();
+      event->mutable_header()->set_type(e.type);
+      event->set_timestamp(e.timestamp);
+    }
+
+    pr.MaybeSortEventsByTime();
+
+    // Events with equal timestamps keep their file order.
+    const std::vector<std::pair<u32, u64>> expected = {
+        {PERF_RECORD_FINISHED_ROUND, 0}, {PERF_RECORD_FINISHED_ROUND, 0},
+        {PERF_RECORD_SAMPLE, 10},        {PERF_RECORD_COMM, 20},
+        {PERF_RECORD_SAMPLE, 30},        {PERF_RECORD_SAMPLE, 40},
+        {PERF_RECORD_MMAP, 40},          {PERF_RECORD_SAMPLE, 50},
+        {PERF_RECORD_SAMPLE, 60},        {PERF_RECORD_SAMPLE, 70},
+        {PERF_RECORD_SAMPLE, 80},
+    };
+    std::vector<std::pair<u32, u64>> actual;
+    for (const PerfEvent& event : pr.events()) {
+      actual.emplace_back(event.header().type(), event.timestamp());
+    }
+    EXPECT_EQ(expected, actual) << num_threads << " threads";
+  }
+}
+
+TEST(PerfReaderTest, SortsEventsInManyRunsByTime) {
+  // Timestamps in a scrambled order, with ties, so that the round has to be
+  // sorted rather than merged.
+  const int kNumEvents = 10000;
+  PerfReader pr;
+  pr.mutable_proto()->add_file_attrs()->mutable_attr()->set_sample_type(
+      PERF_SAMPLE_TIME);
+  std::vector<std::pair<u64, int>> expected;
+  for (int i = 0; i < kNumEvents; ++i) {
+    const u64 timestamp = (i * 7919) % kNumEvents / 3;
+    PerfEvent* event = pr.mutable_events()->Add();
+    event->mutable_header()->set_type(PERF_RECORD_SAMPLE);
+    event->mutable_header()->set_size(i);
+    event->set_timestamp(timestamp);
+    expected.emplace_back(timestamp, i);
+  }
+  std::stable_sort(
+      expected.begin(), expected.end(),
+      [](const std::pair<u64, int>& a, const std::pair<u64, int>& b) {
+        return a.first < b.first;
+      });
+
+  pr.MaybeSortEventsByTime();
+
+  std::vector<std::pair<u64, int>> actual;
+  for (const PerfEvent& event : pr.events()) {
+    actual.emplace_back(event.timestamp(), event.header().size());
+  }
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(PerfReaderTest, OrdersStreamedEventsByTime) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(
+      PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME,
+      true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // Events of a round may be older than the newest event of the previous
+  // round, but not older than those of the rounds before it.
+  const u64 kRounds[][2] = {{30, 10}, {50, 20}, {40, 60}};
+  for (const auto& round : kRounds) {
+    for (u64 time : round) {
+      testing::ExamplePerfSampleEvent(
+          testing::SampleInfo().Ip(0x1c1000).Tid(1001).Time(time))
+          .WriteTo(&input);
+    }
+    // PERF_RECORD_FINISHED_ROUND
+    testing::FinishedRoundEvent().WriteTo(&input);
+  }
+  // Events of the final, unfinished round.
+  testing::ExamplePerfSampleEvent(
+      testing::SampleInfo().Ip(0x1c1000).Tid(1001).Time(55))
+      .WriteTo(&input);
+
+  std::vector<std::pair<u32, u64>> streamed_events;
+  PerfReader pr;
+  pr.SetOrderStreamedEventsByTime(true);
+  pr.SetEventCallback([&streamed_events](const PerfEvent& event) {
+    streamed_events.emplace_back(event.header().type(),
+                                 event.sample_event().sample_time_ns());
+  });
+  ASSERT_TRUE(pr.ReadFromString(input.str()));
+
+  const std::vector<std::pair<u32, u64>> expected = {
+      {PERF_RECORD_FINISHED_ROUND, 0}, {PERF_RECORD_SAMPLE, 10},
+      {PERF_RECORD_SAMPLE, 20},        {PERF_RECORD_SAMPLE, 30},
+      {PERF_RECORD_FINISHED_ROUND, 0}, {PERF_RECORD_SAMPLE, 40},
+      {PERF_RECORD_SAMPLE, 50},        {PERF_RECORD_FINISHED_ROUND, 0},
+      {PERF_RECORD_SAMPLE, 55},        {PERF_RECORD_SAMPLE, 60},
+  };
+  EXPECT_EQ(expected, streamed_events);
+}
+
 TEST(PerfReaderTest, ReadsAndWritesPipedModeAuxEvents) {
   std::stringstream input;
 
@@ -2866,4 +3177,189 @@ TEST(PerfReaderTest, MMap2EventWithBuildId) {
   ASSERT_EQ(mmap2.ino_generation(), 0);
 }
 
+namespace {
+
+// Wraps |data| in a zstd frame holding a single raw (stored) block, which any
+// zstd decoder accepts without the test needing a zstd compressor.
+std::string RawZstdFrame(const std::string& data) {
+  CHECK_LT(data.size(), 256);
+  std::string frame = {
+      '\x28', '\xb5', '\x2f', '\xfd',  // Magic number.
+      '\x20',                          // Single segment, 1-byte content size.
+      static_cast<char>(data.size()),  // Frame content size.
+  };
+  // Block header: last block, raw block type, and the block size.
+  u32 block_header = 1 | (data.size() << 3);
+  frame.append({static_cast<char>(block_header & 0xff),
+                static_cast<char>((block_header >> 8) & 0xff),
+                static_cast<char>((block_header >> 16) & 0xff)});
+  return frame + data;
+}
+
+// Writes two PERF_RECORD_MMAP events to |out|, compressed into two
+// PERF_RECORD_COMPRESSED events. The second mmap event is split across both
+// of them.
+void WriteCompressedMmapEvents(std::ostream* out) {
+  std::stringstream events;
+  testing::ExampleMmapEvent(1001, 0x1c1000, 0x1000, 0, "/usr/lib/foo.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&events);
+  testing::ExampleMmapEvent(1001, 0x1c3000, 0x2000, 0x2000, "/usr/lib/bar.so",
+                            testing::SampleInfo().Tid(1001))
+      .WriteTo(&events);
+  const std::string events_data = events.str();
+  const size_t split = events_data.size() - 16;
+  for (const std::string& chunk :
+       {events_data.substr(0, split), events_data.substr(split)}) {
+    const std::string frame = RawZstdFrame(chunk);
+    const perf_event_header compressed_header = {
+        .type = PERF_RECORD_COMPRESSED,
+        .misc = 0,
+        .size = static_cast<u16>(sizeof(perf_event_header) + frame.size()),
+    };
+    out->write(reinterpret_cast<const char*>(&compressed_header),
+               sizeof(compressed_header));
+    *out << frame;
+  }
+}
+
+// Checks that |pr| holds the events written by WriteCompressedMmapEvents().
+void ExpectDecompressedMmapEvents(const PerfReader& pr) {
+  ASSERT_EQ(2, pr.events().size());
+
+  const PerfEvent& foo = pr.events().Get(0);
+  EXPECT_EQ(PERF_RECORD_MMAP, foo.header().type());
+  EXPECT_EQ("/usr/lib/foo.so", foo.mmap_event().filename());
+  EXPECT_EQ(0x1c1000, foo.mmap_event().start());
+  EXPECT_EQ(1001, foo.mmap_event().sample_info().tid());
+
+  const PerfEvent& bar = pr.events().Get(1);
+  EXPECT_EQ(PERF_RECORD_MMAP, bar.header().type());
+  EXPECT_EQ("/usr/lib/bar.so", bar.mmap_event().filename());
+  EXPECT_EQ(0x1c3000, bar.mmap_event().start());
+  EXPECT_EQ(0x2000, bar.mmap_event().len());
+  EXPECT_EQ(0x2000, bar.mmap_event().pgoff());
+  EXPECT_EQ(1001, bar.mmap_event().sample_info().tid());
+}
+
+}  // namespace
+
+TEST(PerfReaderTest, ReadsPipedModeCompressedEvents) {
+  std::stringstream input;
+
+  // header
+  testing::ExamplePipedPerfDataFileHeader().WriteTo(&input);
+
+  // data
+
+  // PERF_RECORD_HEADER_ATTR
+  testing::ExamplePerfEventAttrEvent_Hardware(PERF_SAMPLE_TID,
+                                              true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // PERF_RECORD_HEADER_FEATURE with HEADER_COMPRESSED. A small mmap_len makes
+  // the decompressor produce its output in several chunks.
+  const u32 compressed_metadata[] = {
+      1,               // version
+      PERF_COMP_ZSTD,  // type
+      1,               // level
+      3,               // ratio
+      64,              // mmap_len
+  };
+  const perf_event_header feature_header = {
+      .type = PERF_RECORD_HEADER_FEATURE,
+      .misc = 0,
+      .size = sizeof(perf_event_header) + sizeof(u64) +
+              sizeof(compressed_metadata),
+  };
+  const u64 feature_id = HEADER_COMPRESSED;
+  input.write(reinterpret_cast<const char*>(&feature_header),
+              sizeof(feature_header));
+  input.write(reinterpret_cast<const char*>(&feature_id), sizeof(feature_id));
+  input.write(reinterpret_cast<const char*>(compressed_metadata),
+              sizeof(compressed_metadata));
+
+  // Two PERF_RECORD_MMAP events, compressed into two PERF_RECORD_COMPRESSED
+  // events.
+  WriteCompressedMmapEvents(&input);
+
+  //
+  // Parse input.
+  //
+
+  PerfReader pr1;
+  if (!ZstdDecompressor::IsSupported()) {
+    EXPECT_FALSE(pr1.ReadFromString(input.str()));
+    return;
+  }
+  ASSERT_TRUE(pr1.ReadFromString(input.str()));
+  // The events are written back uncompressed, and read in again.
+  std::vector<char> output_perf_data;
+  ASSERT_TRUE(pr1.WriteToVector(&output_perf_data));
+  PerfReader pr2;
+  ASSERT_TRUE(pr2.ReadFromVector(output_perf_data));
+
+  for (PerfReader* pr : {&pr1, &pr2}) {
+    ExpectDecompressedMmapEvents(*pr);
+  }
+}
+
+
+TEST(PerfReaderTest, ReadsCompressedEvents) {
+  std::stringstream data_section;
+  WriteCompressedMmapEvents(&data_section);
+
+  std::stringstream input;
+
+  // header
+  testing::ExamplePerfDataFileHeader file_header(1 << HEADER_COMPRESSED);
+  file_header.WithAttrCount(1).WithDataSize(data_section.str().size());
+  file_header.WriteTo(&input);
+
+  // attrs
+  ASSERT_EQ(file_header.header().attrs.offset, input.tellp());
+  testing::ExamplePerfFileAttr_Hardware(PERF_SAMPLE_TID,
+                                        true /*sample_id_all*/)
+      .WriteTo(&input);
+
+  // data
+  ASSERT_EQ(file_header.header().data.offset, input.tellp());
+  input << data_section.str();
+  ASSERT_EQ(file_header.data_end(), input.tellp());
+
+  // metadata
+  const u32 compressed_metadata[] = {
+      1,               // version
+      PERF_COMP_ZSTD,  // type
+      1,               // level
+      3,               // ratio
+      64,              // mmap_len
+  };
+  const perf_file_section compressed_section = {
+      .offset = file_header.data_end_offset() + sizeof(perf_file_section),
+      .size = sizeof(compressed_metadata),
+  };
+  input.write(reinterpret_cast<const char*>(&compressed_section),
+              sizeof(compressed_section));
+  input.write(reinterpret_cast<const char*>(compressed_metadata),
+              sizeof(compressed_metadata));
+
+  //
+  // Parse input.
+  //
+
+  // The parallel reader can't decode PERF_RECORD_COMPRESSED events, and must
+  // hand the data section to the serial reader.
+  for (int num_threads : {1, 4}) {
+    PerfReader pr;
+    pr.SetNumThreads(num_threads);
+    if (!ZstdDecompressor::IsSupported()) {
+      EXPECT_FALSE(pr.ReadFromString(input.str()));
+      continue;
+    }
+    ASSERT_TRUE(pr.ReadFromString(input.str())) << num_threads;
+    ExpectDecompressedMmapEvents(pr);
+  }
+}
+
 }  // namespace quipper
@@ -290,7 +290,7 @@ bool PerfSerializer::SerializePerfEventType(
     quipper::PerfDataProto_PerfEventType* event_type_proto) const {
   event_type_proto->set_id(event_attr.attr.config);
   event_type_proto->set_name(event_attr.name);
-  event_type_proto->set_name_md5_prefix(Md5Prefix(event_attr.name));
+  event_type_proto->set_name_md5_prefix(md5_prefix_cache_.Get(event_attr.name));
   return true;
 }
 
@@ -556,6 +556,7 @@ bool PerfSerializer::SerializeSampleEvent(
   uint64_t sample_type = 0;
   if (!ReadPerfSampleInfoAndType(event, &sample_info, &sample_type))
     return false;
+  sample_type &= sample_fields_to_serialize_;
 
   if (sample_type & PERF_SAMPLE_IP) sample->set_ip(sample_info.ip);
   if (sample_type & PERF_SAMPLE_TID) {
@@ -676,12 +677,12 @@ bool PerfSerializer::SerializeMMapEvent(const event_t& event,
   sample->set_len(mmap.len);
   sample->set_pgoff(mmap.pgoff);
   sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
+  sample->set_filename_md5_prefix(md5_prefix_cache_.Get(mmap.filename));
   std::string root_path = RootPath(mmap.filename);
   if (!root_path.empty()) {
     sample->set_root_path(root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(md5_prefix_cache_.Get(root_path));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -724,12 +725,12 @@ bool PerfSerializer::SerializeMMap2Event(
   sample->set_prot(mmap.prot);
   sample->set_flags(mmap.flags);
   sample->set_filename(mmap.filename);
-  sample->set_filename_md5_prefix(Md5Prefix(mmap.filename));
+  sample->set_filename_md5_prefix(md5_prefix_cache_.Get(mmap.filename));
   std::string root_path = RootPath(mmap.filename);
   if (!root_path.empty()) {
     sample->set_root_path(root_path);
   }
-  sample->set_root_path_md5_prefix(Md5Prefix(root_path));
+  sample->set_root_path_md5_prefix(md5_prefix_cache_.Get(root_path));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -774,7 +775,7 @@ bool PerfSerializer::SerializeCommEvent(const event_t& event,
   sample->set_pid(comm.pid);
   sample->set_tid(comm.tid);
   sample->set_comm(comm.comm);
-  sample->set_comm_md5_prefix(Md5Prefix(comm.comm));
+  sample->set_comm_md5_prefix(md5_prefix_cache_.Get(comm.comm));
 
   return SerializeSampleInfo(event, sample->mutable_sample_info());
 }
@@ -1064,7 +1065,7 @@ bool PerfSerializer::SerializeBuildIDEvent(
   to->set_misc(from->header.misc);
   to->set_pid(from->pid);
   to->set_filename(from->filename);
-  to->set_filename_md5_prefix(Md5Prefix(from->filename));
+  to->set_filename_md5_prefix(md5_prefix_cache_.Get(from->filename));
   if (from->header.misc & PERF_RECORD_MISC_BUILD_ID_SIZE)
     to->set_size(from->size);
 
@@ -1252,7 +1253,8 @@ bool PerfSerializer::SerializeThreadMapEvent(
     auto entry = sample->add_entries();
     entry->set_pid(thread_map.entries[i].pid);
     entry->set_comm(thread_map.entries[i].comm);
-    entry->set_comm_md5_prefix(Md5Prefix(thread_map.entries[i].comm));
+    entry->set_comm_md5_prefix(
+        md5_prefix_cache_.Get(thread_map.entries[i].comm));
   }
   return true;
 }
@@ -1561,7 +1563,8 @@ bool PerfSerializer::CreateSampleInfoReader(const PerfFileAttr& attr,
   for (const auto& id :
        (attr.ids.empty() ? std::initializer_list<u64>({0}) : attr.ids)) {
     sample_info_reader_map_[id].reset(
-        new SampleInfoReader(attr.attr, read_cross_endian));
+        new SampleInfoReader(attr.attr, read_cross_endian,
+                             sample_fields_to_serialize_));
   }
   return UpdateEventIdPositions(attr.attr);
 }
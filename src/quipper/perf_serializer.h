@@ -12,6 +12,7 @@
 #include <memory>
 #include <vector>
 
+#include "binary_data_utils.h"
 #include "compat/proto.h"
 #include "perf_data_utils.h"
 
@@ -268,6 +269,17 @@ class PerfSerializer {
   static void DeserializeParserStats(const PerfDataProto& perf_data_proto,
                                      PerfEventStats* stats);
 
+  // Sets the fields of PERF_RECORD_SAMPLE events to serialize, as a bitfield of
+  // enum perf_event_sample_format. Other fields are skipped when reading the
+  // events where possible, and are left unset in the output, so such events
+  // can't be deserialized. PERF_SAMPLE_ID and PERF_SAMPLE_IDENTIFIER are always
+  // serialized. Applies to the SampleInfoReaders created afterwards. By
+  // default, all fields are serialized.
+  void SetSampleFieldsToSerialize(uint64_t sample_fields) {
+    sample_fields_to_serialize_ =
+        sample_fields | PERF_SAMPLE_ID | PERF_SAMPLE_IDENTIFIER;
+  }
+
   // Instantiate a new PerfSampleReader with the given attr type. If an old one
   // exists for that attr type, it is discarded.
   bool CreateSampleInfoReader(const PerfFileAttr& event_attr,
@@ -339,6 +351,13 @@ class PerfSerializer {
   // For each perf event attr ID, there is a SampleInfoReader to read events of
   // the associated perf attr type.
   std::map<uint64_t, std::unique_ptr<SampleInfoReader>> sample_info_reader_map_;
+
+  // Set by SetSampleFieldsToSerialize().
+  uint64_t sample_fields_to_serialize_ = ~0ULL;
+
+  // The MD5 prefixes of the file names, comms and event names serialized so
+  // far. Events may be serialized concurrently, hence mutable and locked.
+  mutable Md5PrefixCache md5_prefix_cache_;
 };
 
 }  // namespace quipper
@@ -0,0 +1,99 @@
+// Copyright 2024 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the serialization of MMAP2 events, whose file names are hashed with
+// MD5 for the proto. Captures of JIT-heavy processes repeat a few thousand
+// file names over and over, which is what the distinct file name counts below
+// model.
+
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "binary_data_utils.h"
+#include "compat/proto.h"
+#include "kernel/perf_internals.h"
+#include "perf_data_utils.h"
+#include "perf_serializer.h"
+
+namespace quipper {
+namespace {
+
+constexpr int kNumEvents = 1 << 14;
+
+// Returns |num_filenames| distinct file names, shaped like the ones of JIT
+// code and shared libraries.
+std::vector<std::string> MakeFilenames(int num_filenames) {
+  std::vector<std::string> filenames;
+  for (int i = 0; i < num_filenames; ++i) {
+    filenames.push_back("/usr/lib/jvm/java-17/lib/server/jit-" +
+                        std::to_string(i) + ".so");
+  }
+  return filenames;
+}
+
+// Returns kNumEvents MMAP2 events cycling through |num_filenames| file names.
+std::vector<malloced_unique_ptr<event_t>> MakeMmapEvents(int num_filenames) {
+  const std::vector<std::string> filenames = MakeFilenames(num_filenames);
+  std::vector<malloced_unique_ptr<event_t>> events;
+  for (int i = 0; i < kNumEvents; ++i) {
+    const std::string& filename = filenames[i % filenames.size()];
+    const size_t size = offsetof(struct mmap2_event, filename) +
+                        GetUint64AlignedStringLength(filename.size());
+    malloced_unique_ptr<event_t> event(CallocMemoryForEvent(size));
+    event->header.type = PERF_RECORD_MMAP2;
+    event->header.size = size;
+    event->mmap2.pid = event->mmap2.tid = 1000 + i % 16;
+    event->mmap2.start = 0x7f0000000000ULL + i * 0x1000ULL;
+    event->mmap2.len = 0x1000;
+    memcpy(event->mmap2.filename, filename.c_str(), filename.size() + 1);
+    events.push_back(std::move(event));
+  }
+  return events;
+}
+
+void BM_SerializeMmapEvents(benchmark::State& state) {
+  const auto events = MakeMmapEvents(state.range(0));
+  PerfSerializer serializer;
+  PerfDataProto_PerfEvent proto;
+  for (auto _ : state) {
+    for (const auto& event : events) {
+      proto.Clear();
+      benchmark::DoNotOptimize(serializer.SerializeEvent(event, &proto));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * events.size());
+}
+BENCHMARK(BM_SerializeMmapEvents)->Arg(16)->Arg(4096)->Arg(kNumEvents);
+
+void BM_Md5Prefix(benchmark::State& state) {
+  const std::vector<std::string> filenames = MakeFilenames(state.range(0));
+  for (auto _ : state) {
+    for (int i = 0; i < kNumEvents; ++i) {
+      benchmark::DoNotOptimize(Md5Prefix(filenames[i % filenames.size()]));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kNumEvents);
+}
+BENCHMARK(BM_Md5Prefix)->Arg(16)->Arg(4096);
+
+void BM_Md5PrefixCache(benchmark::State& state) {
+  const std::vector<std::string> filenames = MakeFilenames(state.range(0));
+  Md5PrefixCache cache;
+  for (auto _ : state) {
+    for (int i = 0; i < kNumEvents; ++i) {
+      benchmark::DoNotOptimize(cache.Get(filenames[i % filenames.size()]));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kNumEvents);
+}
+BENCHMARK(BM_Md5PrefixCache)->Arg(16)->Arg(4096);
+
+}  // namespace
+}  // namespace quipper
+
+BENCHMARK_MAIN();
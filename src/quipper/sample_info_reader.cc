@@ -821,8 +821,269 @@ size_t PerfSampleDataWriter::Write(const struct perf_sample& sample,
   return GetWrittenSize();
 }
 
+// The sample info fields that a SampleInfoReader decoding plan can describe.
+const uint64_t kPlannedSampleFields =
+    PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+    PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR | PERF_SAMPLE_ID |
+    PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+    PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_WEIGHT |
+    PERF_SAMPLE_WEIGHT_STRUCT | PERF_SAMPLE_DATA_SRC |
+    PERF_SAMPLE_TRANSACTION | PERF_SAMPLE_PHYS_ADDR | PERF_SAMPLE_CGROUP |
+    PERF_SAMPLE_DATA_PAGE_SIZE | PERF_SAMPLE_CODE_PAGE_SIZE;
+
+// The sample info fields that a SampleInfoReader decoding plan can only skip.
+const uint64_t kSkippableSampleFields = PERF_SAMPLE_READ | PERF_SAMPLE_RAW;
+
 }  // namespace
 
+SampleInfoReader::SampleInfoReader(struct perf_event_attr event_attr,
+                                   bool read_cross_endian)
+    : SampleInfoReader(event_attr, read_cross_endian, ~0ULL) {}
+
+SampleInfoReader::SampleInfoReader(struct perf_event_attr event_attr,
+                                   bool read_cross_endian,
+                                   uint64_t sample_fields)
+    : event_attr_(event_attr),
+      read_cross_endian_(read_cross_endian),
+      sample_fields_(sample_fields | PERF_SAMPLE_ID | PERF_SAMPLE_IDENTIFIER),
+      has_decode_plans_(false) {
+  BuildDecodePlans();
+}
+
+void SampleInfoReader::BuildDecodePlans() {
+  const uint64_t sample_type = event_attr_.sample_type;
+  const uint64_t plannable_fields =
+      kPlannedSampleFields | (kSkippableSampleFields & ~sample_fields_);
+  if (read_cross_endian_ || (sample_type & ~plannable_fields) ||
+      ((sample_type & PERF_SAMPLE_WEIGHT) &&
+       (sample_type & PERF_SAMPLE_WEIGHT_STRUCT))) {
+    return;
+  }
+
+  auto add_step = [sample_type](std::vector<DecodeStep>* plan, uint64_t bit,
+                                DecodeStep::Kind kind,
+                                uint64_t perf_sample::*field = nullptr) {
+    if (sample_type & bit) plan->push_back({kind, field});
+  };
+  // Adds a step for a field of PERF_RECORD_SAMPLE events, which skips the
+  // field if it isn't in |sample_fields_|.
+  auto add_sample_step = [this, &add_step](uint64_t bit, DecodeStep::Kind kind,
+                                           uint64_t perf_sample::*field =
+                                               nullptr) {
+    if (!(sample_fields_ & bit)) {
+      switch (kind) {
+        case DecodeStep::kCallchain:
+          kind = DecodeStep::kSkipCallchain;
+          break;
+        case DecodeStep::kBranchStack:
+          kind = DecodeStep::kSkipBranchStack;
+          break;
+        default:
+          kind = DecodeStep::kSkipUint64;
+          break;
+      }
+    }
+    add_step(&sample_plan_, bit, kind, field);
+  };
+
+  // Same order as in ReadPerfSampleFromData().
+  add_sample_step(PERF_SAMPLE_IDENTIFIER, DecodeStep::kUint64,
+                  &perf_sample::id);
+  add_sample_step(PERF_SAMPLE_IP, DecodeStep::kUint64, &perf_sample::ip);
+  add_sample_step(PERF_SAMPLE_TID, DecodeStep::kPidTid);
+  add_sample_step(PERF_SAMPLE_TIME, DecodeStep::kUint64, &perf_sample::time);
+  add_sample_step(PERF_SAMPLE_ADDR, DecodeStep::kUint64, &perf_sample::addr);
+  add_sample_step(PERF_SAMPLE_ID, DecodeStep::kUint64, &perf_sample::id);
+  add_sample_step(PERF_SAMPLE_STREAM_ID, DecodeStep::kUint64,
+                  &perf_sample::stream_id);
+  add_sample_step(PERF_SAMPLE_CPU, DecodeStep::kCpu);
+  add_sample_step(PERF_SAMPLE_PERIOD, DecodeStep::kUint64,
+                  &perf_sample::period);
+  add_step(&sample_plan_, PERF_SAMPLE_READ, DecodeStep::kSkipRead);
+  add_sample_step(PERF_SAMPLE_CALLCHAIN, DecodeStep::kCallchain);
+  add_step(&sample_plan_, PERF_SAMPLE_RAW, DecodeStep::kSkipRaw);
+  add_sample_step(PERF_SAMPLE_BRANCH_STACK, DecodeStep::kBranchStack);
+  add_sample_step(PERF_SAMPLE_WEIGHT, DecodeStep::kWeight);
+  add_sample_step(PERF_SAMPLE_WEIGHT_STRUCT, DecodeStep::kWeightStruct);
+  add_sample_step(PERF_SAMPLE_DATA_SRC, DecodeStep::kUint64,
+                  &perf_sample::data_src);
+  add_sample_step(PERF_SAMPLE_TRANSACTION, DecodeStep::kUint64,
+                  &perf_sample::transaction);
+  add_sample_step(PERF_SAMPLE_PHYS_ADDR, DecodeStep::kUint64,
+                  &perf_sample::physical_addr);
+  add_sample_step(PERF_SAMPLE_CGROUP, DecodeStep::kUint64,
+                  &perf_sample::cgroup);
+  add_sample_step(PERF_SAMPLE_DATA_PAGE_SIZE, DecodeStep::kUint64,
+                  &perf_sample::data_page_size);
+  add_sample_step(PERF_SAMPLE_CODE_PAGE_SIZE, DecodeStep::kUint64,
+                  &perf_sample::code_page_size);
+
+  // See struct sample_id in kernel/perf_event.h.
+  if (event_attr_.sample_id_all) {
+    std::vector<DecodeStep>* plan = &sample_id_plan_;
+    add_step(plan, PERF_SAMPLE_TID, DecodeStep::kPidTid);
+    add_step(plan, PERF_SAMPLE_TIME, DecodeStep::kUint64, &perf_sample::time);
+    add_step(plan, PERF_SAMPLE_ID, DecodeStep::kUint64, &perf_sample::id);
+    add_step(plan, PERF_SAMPLE_STREAM_ID, DecodeStep::kUint64,
+             &perf_sample::stream_id);
+    add_step(plan, PERF_SAMPLE_CPU, DecodeStep::kCpu);
+    add_step(plan, PERF_SAMPLE_IDENTIFIER, DecodeStep::kUint64,
+             &perf_sample::id);
+  }
+  has_decode_plans_ = true;
+}
+
+bool SampleInfoReader::ReadPerfSampleInfoWithPlan(
+    const event_t& event, const std::vector<DecodeStep>& plan,
+    struct perf_sample* sample, size_t* read_size) const {
+  size_t offset = GetEventDataSize(event);
+  if (offset == 0 || offset > event.header.size) return false;
+  const char* const begin = reinterpret_cast<const char*>(&event);
+  const char* data = begin + offset;
+  const char* const end = begin + event.header.size;
+  // |data| never moves past |end|.
+  auto remaining = [&data, end]() -> size_t { return end - data; };
+
+  for (const DecodeStep& step : plan) {
+    switch (step.kind) {
+      case DecodeStep::kUint64:
+        if (remaining() < sizeof(u64)) return false;
+        memcpy(&(sample->*step.field), data, sizeof(u64));
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kPidTid:
+        if (remaining() < sizeof(u64)) return false;
+        memcpy(&sample->pid, data, sizeof(u32));
+        memcpy(&sample->tid, data + sizeof(u32), sizeof(u32));
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kCpu:
+        // The CPU number is followed by 32 bits of reserved padding.
+        if (remaining() < sizeof(u64)) return false;
+        memcpy(&sample->cpu, data, sizeof(u32));
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kWeight:
+        if (remaining() < sizeof(u64)) return false;
+        memcpy(&sample->weight.full, data, sizeof(u64));
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kWeightStruct:
+        if (remaining() < sizeof(u64)) return false;
+        memcpy(&sample->weight.var1_dw, data, sizeof(u32));
+        memcpy(&sample->weight.var2_w, data + sizeof(u32), sizeof(u16));
+        memcpy(&sample->weight.var3_w, data + sizeof(u32) + sizeof(u16),
+               sizeof(u16));
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kCallchain: {
+        CHECK_EQ(static_cast<void*>(NULL), sample->callchain);
+        uint64_t nr = 0;
+        if (remaining() < sizeof(nr)) return false;
+        memcpy(&nr, data, sizeof(nr));
+        data += sizeof(nr);
+        if (nr > remaining() / sizeof(u64)) return false;
+        sample->callchain =
+            reinterpret_cast<struct ip_callchain*>(new uint64_t[nr + 1]);
+        sample->callchain->nr = nr;
+        memcpy(sample->callchain->ips, data, nr * sizeof(u64));
+        data += nr * sizeof(u64);
+        break;
+      }
+      case DecodeStep::kBranchStack: {
+        CHECK_EQ(static_cast<void*>(NULL), sample->branch_stack);
+        sample->no_hw_idx =
+            !(event_attr_.branch_sample_type & PERF_SAMPLE_BRANCH_HW_INDEX);
+        uint64_t nr = 0;
+        uint64_t hw_idx = 0;
+        if (remaining() < sizeof(nr)) return false;
+        memcpy(&nr, data, sizeof(nr));
+        data += sizeof(nr);
+        if (!sample->no_hw_idx) {
+          if (remaining() < sizeof(hw_idx)) return false;
+          memcpy(&hw_idx, data, sizeof(hw_idx));
+          data += sizeof(hw_idx);
+        }
+        if (nr > remaining() / sizeof(struct branch_entry)) return false;
+        struct branch_stack* branch_stack =
+            reinterpret_cast<struct branch_stack*>(
+                new uint8_t[sizeof(uint64_t) + sizeof(uint64_t) +
+                            nr * sizeof(struct branch_entry)]);
+        branch_stack->nr = nr;
+        branch_stack->hw_idx = hw_idx;
+        memcpy(branch_stack->entries, data, nr * sizeof(struct branch_entry));
+        sample->branch_stack = branch_stack;
+        data += nr * sizeof(struct branch_entry);
+        break;
+      }
+      case DecodeStep::kSkipUint64:
+        if (remaining() < sizeof(u64)) return false;
+        data += sizeof(u64);
+        break;
+      case DecodeStep::kSkipRead: {
+        // A group is a number of values followed by the times and the
+        // values. Otherwise, there is a single value, of the same total size
+        // as a group of one without its number.
+        const uint64_t read_format = event_attr_.read_format;
+        uint64_t nr = 1;
+        size_t header_size = 0;
+        if (read_format & PERF_FORMAT_GROUP) {
+          if (remaining() < sizeof(nr)) return false;
+          memcpy(&nr, data, sizeof(nr));
+          header_size += sizeof(nr);
+        }
+        if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+          header_size += sizeof(u64);
+        if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+          header_size += sizeof(u64);
+        size_t entry_size = sizeof(u64);
+        if (read_format & PERF_FORMAT_ID) entry_size += sizeof(u64);
+        if (read_format & PERF_FORMAT_LOST) entry_size += sizeof(u64);
+        if (remaining() < header_size) return false;
+        data += header_size;
+        if (nr > remaining() / entry_size) return false;
+        data += nr * entry_size;
+        break;
+      }
+      case DecodeStep::kSkipCallchain: {
+        uint64_t nr = 0;
+        if (remaining() < sizeof(nr)) return false;
+        memcpy(&nr, data, sizeof(nr));
+        data += sizeof(nr);
+        if (nr > remaining() / sizeof(u64)) return false;
+        data += nr * sizeof(u64);
+        break;
+      }
+      case DecodeStep::kSkipRaw: {
+        u32 size = 0;
+        if (remaining() < sizeof(size)) return false;
+        memcpy(&size, data, sizeof(size));
+        // The size and data are padded to 64 bits.
+        const uint64_t padded_size = Align<uint64_t>(sizeof(size) + size);
+        if (padded_size > remaining()) return false;
+        data += padded_size;
+        break;
+      }
+      case DecodeStep::kSkipBranchStack: {
+        uint64_t nr = 0;
+        if (remaining() < sizeof(nr)) return false;
+        memcpy(&nr, data, sizeof(nr));
+        data += sizeof(nr);
+        if (event_attr_.branch_sample_type & PERF_SAMPLE_BRANCH_HW_INDEX) {
+          if (remaining() < sizeof(u64)) return false;
+          data += sizeof(u64);
+        }
+        if (nr > remaining() / sizeof(struct branch_entry)) return false;
+        data += nr * sizeof(struct branch_entry);
+        break;
+      }
+    }
+  }
+
+  *read_size = data - begin;
+  return true;
+}
+
 bool SampleInfoReader::IsSupportedEventType(uint32_t type) {
   switch (type) {
     case PERF_RECORD_SAMPLE:
@@ -857,9 +1118,21 @@ bool SampleInfoReader::ReadPerfSampleInfo(const event_t& event,
   }
 
   size_t size_read_or_skipped = 0;
-  if (!ReadPerfSampleFromData(event, event_attr_, read_cross_endian_, sample,
-                              &size_read_or_skipped)) {
-    return false;
+  const std::vector<DecodeStep>& plan =
+      event.header.type == PERF_RECORD_SAMPLE ? sample_plan_ : sample_id_plan_;
+  if (!has_decode_plans_ ||
+      !ReadPerfSampleInfoWithPlan(event, plan, sample,
+                                  &size_read_or_skipped)) {
+    // Either the sample info can't be decoded with a plan, or the event is
+    // malformed. Read it field by field, which also reports what is wrong.
+    delete[] sample->callchain;
+    sample->callchain = nullptr;
+    delete[] sample->branch_stack;
+    sample->branch_stack = nullptr;
+    if (!ReadPerfSampleFromData(event, event_attr_, read_cross_endian_, sample,
+                                &size_read_or_skipped)) {
+      return false;
+    }
   }
 
   if (size_read_or_skipped != event.header.size) {
@@ -8,6 +8,8 @@
 #include <stddef.h>  // for size_t
 #include <stdint.h>
 
+#include <vector>
+
 #include "compat/proto.h"
 #include "kernel/perf_event.h"
 
@@ -20,8 +22,15 @@ struct perf_sample;
 
 class SampleInfoReader {
  public:
-  SampleInfoReader(struct perf_event_attr event_attr, bool read_cross_endian)
-      : event_attr_(event_attr), read_cross_endian_(read_cross_endian) {}
+  SampleInfoReader(struct perf_event_attr event_attr, bool read_cross_endian);
+
+  // Like the above, but the fields of PERF_RECORD_SAMPLE events that are not
+  // in |sample_fields|, a bitfield of enum perf_event_sample_format, are
+  // skipped rather than read when possible, and so may be left unset.
+  // PERF_SAMPLE_ID and PERF_SAMPLE_IDENTIFIER are always read. The sample_id
+  // of other events is always read in full.
+  SampleInfoReader(struct perf_event_attr event_attr, bool read_cross_endian,
+                   uint64_t sample_fields);
 
   // Returns true if the given event type is supported by the SampleInfoReader.
   static bool IsSupportedEventType(uint32_t type);
@@ -59,6 +68,39 @@ class SampleInfoReader {
   const perf_event_attr& event_attr() const { return event_attr_; }
 
  private:
+  // One step of a decoding plan: which sample info field to copy out of the
+  // raw event data next.
+  struct DecodeStep {
+    enum Kind {
+      kUint64,  // A u64 stored in |field|.
+      kPidTid,
+      kCpu,
+      kWeight,
+      kWeightStruct,
+      kCallchain,
+      kBranchStack,
+      // Fields that are skipped over without being read.
+      kSkipUint64,
+      kSkipRead,
+      kSkipCallchain,
+      kSkipRaw,
+      kSkipBranchStack,
+    };
+    Kind kind;
+    uint64_t perf_sample::*field;
+  };
+
+  // Precomputes |sample_plan_| and |sample_id_plan_| from |event_attr_|.
+  void BuildDecodePlans();
+
+  // Reads the sample info of |event| by following |plan| over the raw event
+  // data, without going through a DataReader. Returns false if the event is
+  // too short for the plan.
+  bool ReadPerfSampleInfoWithPlan(const event_t& event,
+                                  const std::vector<DecodeStep>& plan,
+                                  struct perf_sample* sample,
+                                  size_t* read_size) const;
+
   // Event attribute info, which determines the contents of some perf_sample
   // data.
   struct perf_event_attr event_attr_;
@@ -66,6 +108,19 @@ class SampleInfoReader {
   // Set this flag if values (uint32s and uint64s) should be endian-swapped
   // during reads.
   bool read_cross_endian_;
+
+  // The fields of PERF_RECORD_SAMPLE events that should be read.
+  uint64_t sample_fields_;
+
+  // The order and kinds of the sample info fields of PERF_RECORD_SAMPLE
+  // events and of the sample_id of other events. Only used when
+  // |has_decode_plans_|, i.e. when the data is native endian and all fields in
+  // event_attr_.sample_type have a layout that a plan can describe, or are
+  // skipped.
+  // Otherwise, the sample info is read field by field through a DataReader.
+  bool has_decode_plans_;
+  std::vector<DecodeStep> sample_plan_;
+  std::vector<DecodeStep> sample_id_plan_;
 };
 
 }  // namespace quipper
@@ -233,6 +233,175 @@ TEST(SampleInfoReaderTest, ReadSampleEventCrossEndian) {
   EXPECT_EQ(bswap_64(10001), sample.period);
 }
 
+TEST(SampleInfoReaderTest, ReadSampleEventCallchainAndBranchStack) {
+  struct perf_event_attr attr = {0};
+  attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                     PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_BRANCH_STACK;
+  attr.branch_sample_type = PERF_SAMPLE_BRANCH_HW_INDEX;
+
+  SampleInfoReader reader(attr, false /* read_cross_endian */);
+
+  const u64 sample_event_array[] = {
+      7,                                     // IDENTIFIER
+      0xffffffff01234567,                    // IP
+      PunU32U64{.v32 = {0x68d, 0x68e}}.v64,  // TID (u32 pid, tid)
+      3,                                     // CALLCHAIN nr
+      0xffffffff01234567,                    // ips[0]
+      0x00007f999c38d15a,                    // ips[1]
+      0x00007f999c38e000,                    // ips[2]
+      2,                                     // BRANCH_STACK nr
+      5,                                     // hw_idx
+      0x00007f999c38d100,                    // lbr[0].from
+      0x00007f999c38d200,                    // lbr[0].to
+      0x0000000000000101,                    // lbr[0].flags
+      0x00007f999c38d300,                    // lbr[1].from
+      0x00007f999c38d400,                    // lbr[1].to
+      0x0000000000000002,                    // lbr[1].flags
+  };
+  const sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+
+  perf_sample sample;
+  ASSERT_TRUE(reader.ReadPerfSampleInfo(event, &sample));
+
+  EXPECT_EQ(7, sample.id);
+  EXPECT_EQ(0xffffffff01234567, sample.ip);
+  EXPECT_EQ(0x68d, sample.pid);
+  EXPECT_EQ(0x68e, sample.tid);
+  ASSERT_NE(nullptr, sample.callchain);
+  ASSERT_EQ(3, sample.callchain->nr);
+  EXPECT_EQ(0xffffffff01234567, sample.callchain->ips[0]);
+  EXPECT_EQ(0x00007f999c38d15a, sample.callchain->ips[1]);
+  EXPECT_EQ(0x00007f999c38e000, sample.callchain->ips[2]);
+  ASSERT_NE(nullptr, sample.branch_stack);
+  EXPECT_FALSE(sample.no_hw_idx);
+  ASSERT_EQ(2, sample.branch_stack->nr);
+  EXPECT_EQ(5, sample.branch_stack->hw_idx);
+  EXPECT_EQ(0x00007f999c38d100, sample.branch_stack->entries[0].from);
+  EXPECT_EQ(0x00007f999c38d200, sample.branch_stack->entries[0].to);
+  EXPECT_EQ(1, sample.branch_stack->entries[0].flags.mispred);
+  EXPECT_EQ(16, sample.branch_stack->entries[0].flags.cycles);
+  EXPECT_EQ(0x00007f999c38d300, sample.branch_stack->entries[1].from);
+  EXPECT_EQ(0x00007f999c38d400, sample.branch_stack->entries[1].to);
+  EXPECT_EQ(1, sample.branch_stack->entries[1].flags.predicted);
+}
+
+TEST(SampleInfoReaderTest, ReadSampleEventSkipsUnselectedFields) {
+  struct perf_event_attr attr = {0};
+  attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                     PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+                     PERF_SAMPLE_READ | PERF_SAMPLE_CALLCHAIN |
+                     PERF_SAMPLE_RAW | PERF_SAMPLE_BRANCH_STACK;
+  attr.read_format =
+      PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_ID;
+
+  const u64 sample_event_array[] = {
+      7,                                     // IDENTIFIER
+      0xffffffff01234567,                    // IP
+      PunU32U64{.v32 = {0x68d, 0x68e}}.v64,  // TID (u32 pid, tid)
+      1415837014 * 1000000000ULL,            // TIME
+      8,                                     // CPU
+      10001,                                 // PERIOD
+      2,                                     // READ: nr
+      1000,                                  // READ: time_enabled
+      100,                                   // READ: values[0].value
+      7,                                     // READ: values[0].id
+      200,                                   // READ: values[1].value
+      8,                                     // READ: values[1].id
+      2,                                     // CALLCHAIN nr
+      0xffffffff01234567,                    // ips[0]
+      0x00007f999c38d15a,                    // ips[1]
+      0x0403020100000006,                    // RAW: size 6, data[0..3]
+      0x0000000000000605,                    // RAW: data[4..5], padding
+      1,                                     // BRANCH_STACK nr
+      0x00007f999c38d100,                    // lbr[0].from
+      0x00007f999c38d200,                    // lbr[0].to
+      0x0000000000000101,                    // lbr[0].flags
+  };
+  const sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+
+  SampleInfoReader full_reader(attr, false /* read_cross_endian */);
+  perf_sample full_sample;
+  ASSERT_TRUE(full_reader.ReadPerfSampleInfo(event, &full_sample));
+  EXPECT_EQ(6, full_sample.raw_size);
+  EXPECT_EQ(2, full_sample.read.group.nr);
+
+  SampleInfoReader reader(attr, false /* read_cross_endian */,
+                          PERF_SAMPLE_IP | PERF_SAMPLE_TIME |
+                              PERF_SAMPLE_PERIOD);
+  perf_sample sample;
+  ASSERT_TRUE(reader.ReadPerfSampleInfo(event, &sample));
+
+  // The identifier is always read.
+  EXPECT_EQ(7, sample.id);
+  EXPECT_EQ(0xffffffff01234567, sample.ip);
+  EXPECT_EQ(1415837014 * 1000000000ULL, sample.time);
+  EXPECT_EQ(10001, sample.period);
+  EXPECT_EQ(0, sample.pid);
+  EXPECT_EQ(0, sample.tid);
+  EXPECT_EQ(0, sample.cpu);
+  EXPECT_EQ(nullptr, sample.read.group.values);
+  EXPECT_EQ(nullptr, sample.callchain);
+  EXPECT_EQ(nullptr, sample.raw_data);
+  EXPECT_EQ(nullptr, sample.branch_stack);
+}
+
+TEST(SampleInfoReaderTest, ReadSampleEventTruncatedCallchain) {
+  struct perf_event_attr attr = {0};
+  attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+
+  SampleInfoReader reader(attr, false /* read_cross_endian */);
+
+  const u64 sample_event_array[] = {
+      0xffffffff01234567,  // IP
+      3,                   // CALLCHAIN nr
+      0xffffffff01234567,  // ips[0]
+      0x00007f999c38d15a,  // ips[1], and the event ends before ips[2]
+  };
+  const sample_event sample_event_struct = {
+      .header = {
+          .type = PERF_RECORD_SAMPLE,
+          .misc = 0,
+          .size = sizeof(sample_event) + sizeof(sample_event_array),
+      }};
+
+  std::stringstream input;
+  input.write(reinterpret_cast<const char*>(&sample_event_struct),
+              sizeof(sample_event_struct));
+  input.write(reinterpret_cast<const char*>(sample_event_array),
+              sizeof(sample_event_array));
+  std::string input_string = input.str();
+  const event_t& event = *reinterpret_cast<const event_t*>(input_string.data());
+
+  perf_sample sample;
+  EXPECT_FALSE(reader.ReadPerfSampleInfo(event, &sample));
+}
+
 TEST(SampleInfoReaderTest, ReadMmapEvent) {
   // clang-format off
   uint64_t sample_type =      // * == in sample_id_all
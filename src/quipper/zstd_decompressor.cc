@@ -0,0 +1,76 @@
+// Copyright 2024 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zstd_decompressor.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "base/logging.h"
+
+namespace quipper {
+
+#ifdef HAVE_ZSTD
+
+ZstdDecompressor::ZstdDecompressor() : stream_(nullptr) {}
+
+ZstdDecompressor::~ZstdDecompressor() {
+  ZSTD_freeDStream(static_cast<ZSTD_DStream*>(stream_));
+}
+
+bool ZstdDecompressor::IsSupported() { return true; }
+
+bool ZstdDecompressor::Decompress(const void* src, size_t size,
+                                  size_t output_chunk_size,
+                                  std::vector<char>* dest) {
+  if (stream_ == nullptr) {
+    stream_ = ZSTD_createDStream();
+    if (stream_ == nullptr) {
+      LOG(ERROR) << "Couldn't create zstd decompression stream";
+      return false;
+    }
+    ZSTD_initDStream(static_cast<ZSTD_DStream*>(stream_));
+  }
+  if (output_chunk_size == 0) output_chunk_size = ZSTD_DStreamOutSize();
+
+  ZSTD_inBuffer input = {src, size, 0};
+  // Keep going while there is input left, or while the last call filled the
+  // whole output chunk and so may still have buffered output to flush.
+  bool output_full = true;
+  while (input.pos < input.size || output_full) {
+    size_t offset = dest->size();
+    dest->resize(offset + output_chunk_size);
+    ZSTD_outBuffer output = {dest->data() + offset, output_chunk_size, 0};
+    size_t ret = ZSTD_decompressStream(static_cast<ZSTD_DStream*>(stream_),
+                                       &output, &input);
+    dest->resize(offset + output.pos);
+    output_full = output.pos == output.size;
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "Couldn't decompress zstd data: "
+                 << ZSTD_getErrorName(ret);
+      return false;
+    }
+  }
+  return true;
+}
+
+#else  // !HAVE_ZSTD
+
+ZstdDecompressor::ZstdDecompressor() : stream_(nullptr) {}
+
+ZstdDecompressor::~ZstdDecompressor() {}
+
+bool ZstdDecompressor::IsSupported() { return false; }
+
+bool ZstdDecompressor::Decompress(const void* src, size_t size,
+                                  size_t output_chunk_size,
+                                  std::vector<char>* dest) {
+  LOG(ERROR) << "Can't decompress zstd data: quipper was built without zstd";
+  return false;
+}
+
+#endif  // HAVE_ZSTD
+
+}  // namespace quipper
@@ -0,0 +1,41 @@
+// Copyright 2024 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMIUMOS_WIDE_PROFILING_ZSTD_DECOMPRESSOR_H_
+#define CHROMIUMOS_WIDE_PROFILING_ZSTD_DECOMPRESSOR_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace quipper {
+
+// Incrementally decompresses a zstd stream that arrives in chunks, such as the
+// payloads of consecutive PERF_RECORD_COMPRESSED events. The decompression
+// context is kept across calls, so a frame may span several chunks.
+class ZstdDecompressor {
+ public:
+  ZstdDecompressor();
+  ~ZstdDecompressor();
+
+  // Returns true if quipper was built with zstd support.
+  static bool IsSupported();
+
+  // Decompresses the |size| bytes at |src| and appends the output to |dest|.
+  // |dest| grows by at most |output_chunk_size| bytes at a time. Returns false
+  // if the input is corrupt or zstd support is not available.
+  bool Decompress(const void* src, size_t size, size_t output_chunk_size,
+                  std::vector<char>* dest);
+
+ private:
+  // Opaque ZSTD_DStream, created on first use.
+  void* stream_;
+
+  ZstdDecompressor(const ZstdDecompressor&) = delete;
+  ZstdDecompressor& operator=(const ZstdDecompressor&) = delete;
+};
+
+}  // namespace quipper
+
+#endif  // CHROMIUMOS_WIDE_PROFILING_ZSTD_DECOMPRESSOR_H_